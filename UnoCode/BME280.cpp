@@ -8,23 +8,74 @@
  ****************************************************************************/
 #include "BME280.h"		// header for this file
 #include "shares.h"		// extern globally shared variables and macros
+#include "scheduler.h"	// tick count for measurement timing
+
+/* Sampling settings of each profile, in bme_Profile order. The standby time
+ * only matters in normal mode.
+ */
+static const BME280_Settings profiles[BME_NUM_PROFILES] = {
+	// BME_WEATHER
+	{ BME280_H_OVSM_1, BME280_P_OVSM_1 | BME280_T_OVSM_1,
+	  BME280_TSB_F | BME280_FLTR_OFF | BME280_SPI_DIS },
+	// BME_INDOOR
+	{ BME280_H_OVSM_1, BME280_P_OVSM_16 | BME280_T_OVSM_2,
+	  BME280_TSB_F | BME280_FLTR_16 | BME280_SPI_DIS },
+	// BME_FAST
+	{ BME280_H_OVSM_1, BME280_P_OVSM_4 | BME280_T_OVSM_1,
+	  BME280_TSB_F | BME280_FLTR_4 | BME280_SPI_DIS }
+};
+
+// status register, polled until the conversion is done
+static const uint8_t status_reg = BME280_STATUS;
+
+// EEPROM copy of the calibration data of the last sensor seen
+static BME280_Cal_Cache EEMEM ee_cal_cache;
+
+// first register of each of the background reads
+static const uint8_t id_reg = BME280_ID;
+static const uint8_t cal_1_reg = BME280_CAL_START_1;
+static const uint8_t cal_2_reg = BME280_CAL_START_2;
+static const uint8_t data_reg = BME280_P_RAW_MSB;
+
+// first register of the control register read
+static const uint8_t ctrl_reg = BME280_CTRL_HUM;
 
 /*****************************************************************************
  * Method:		BME280
  * Description:	This initializer sets up a BME280 sensor to be communicated
  *				with. The method stores a copy of an i2c pointer for use and
- *				calls the init method.
+ *				calls the init method. If the sensor can not be set up here,
+ *				the task keeps trying in the background. The task takes the
+ *				first measurement as soon as it runs.
  * 
  * Parameters:	ptr_i2c		- pointer to an i2c object to be used for 
  *								communicating with the BME280 sensor
  *				ptr_serial	- pointer to a serial object to be used for
  *								debugging
+ *				temperature_cal	- temperature offset in C * 100
+ *				sample_period	- ms between measurements
+ *				profile			- sampling profile to start with
  ****************************************************************************/
-BME280::BME280 (i2c* ptr_i2c, serial *ptr_serial, int32_t temperature_cal)
+BME280::BME280 (i2c* ptr_i2c, serial *ptr_serial, int32_t temperature_cal,
+				uint16_t sample_period, bme_Profile profile)
 {
 	p_i2c = ptr_i2c;			// store local copy of i2c pointer for use
 	p_serial = ptr_serial;		// store local copy of serial pointer for debug
 	temp_cal = temperature_cal;	// store local copy of temp cal
+	period = sample_period;
+	
+	// an unknown profile falls back to the low power one
+	cfg = profiles[profile < BME_NUM_PROFILES ? profile : BME_WEATHER];
+	update_cfg();
+	
+	// until the sensor is set up, the task starts over from init
+	state = BME_INIT;
+	fails = 0;
+	xfer.slow = false;
+	xfer.state = TWI_IDLE;
+	xfer_time = 0;
+	wait_until = scheduler::ticks();
+	sample_time = wait_until;
 	
 	if (p_i2c->ping(BME280_ADDR))
 	{
@@ -32,6 +83,7 @@ BME280::BME280 (i2c* ptr_i2c, serial *ptr_serial, int32_t temperature_cal)
 	}
 	else
 	{
+		// not there yet, the task will keep looking for it
 		//DBG(this->p_serial, "BME280 <0x%X> DEAD\r\n", BME280_ADDR);
 		return;
 	}
@@ -50,8 +102,8 @@ BME280::BME280 (i2c* ptr_i2c, serial *ptr_serial, int32_t temperature_cal)
 		return;
 	}
 	
-	// initial read of data to fill sensor data
-	read_data();
+	// sensor is set up, the task only has to take measurements
+	state = BME_TRIGGER;
 	
 	//DBG(this->p_serial, "BME280 Constructor OK!\r\n");
 }
@@ -60,35 +112,136 @@ BME280::BME280 (i2c* ptr_i2c, serial *ptr_serial, int32_t temperature_cal)
  * Method:		init
  * Description:	This method initializes the BME280 sensor to operate in the
  *				desired mode. This method sets the control and configuration
- *				registers to setup the sampling rates and mode. 
- *				The pressure, temperature, and humidity will all be set to
- *				have an oversampling rate of 1. The mode will be initialized
- *				normal mode. The configuration will be set to turn the IIR 
- *				filter off, set the sample interval to 1s in normal mode, and 
- *				disable SPI.
+ *				registers to the oversampling rates and IIR filter of the
+ *				current sampling settings. The sensor is left in sleep mode,
+ *				measurements are then taken one at a time in forced mode. 
+ *				The registers are all written in one transaction as register
+ *				address and data pairs.
  * 
  * Return:		bool - the status of the operation (false = success,
  *													true = failure)
  ****************************************************************************/
 bool BME280::init (void)
 {
-	/* 1. Set up ctrl_hum register to oversample humidity by 1
-	 * 2. Set up ctrl_meas register to oversample pressure and temperature
-	 *    by 1 and set mode to normal
-	 * 3. Turn off IIR Filter and set inactive duration to 1s for normal
-	 *	  mode
-	 */
-	return (p_i2c->write(BME280_ADDR, BME280_CTRL_HUM, BME280_H_OVSM_1)
-			|| p_i2c->write(BME280_ADDR, BME280_CTRL_MEAS, 
-				BME280_P_OVSM_1 | BME280_T_OVSM_16 | BME280_NORMAL_MODE)
-			|| p_i2c->write(BME280_ADDR, BME280_CONFIG, 
-				BME280_TSB_F | BME280_FLTR_OFF | BME280_SPI_DIS));
+	fill_cfg_cmd();
+	reconfig = false;
+	
+	return p_i2c->write(BME280_ADDR, cmd[0], &cmd[1], sizeof(cmd) - 1);
+}
+
+/*****************************************************************************
+ * Method:		fill_cfg_cmd
+ * Description:	This method fills cmd with the register address and data
+ *				pairs that write the current sampling settings. CTRL_HUM only
+ *				takes effect after CTRL_MEAS is written, so it has to come
+ *				first. The sensor is left asleep until a conversion is 
+ *				triggered, and CONFIG is written while it is asleep so it is
+ *				not ignored.
+ ****************************************************************************/
+void BME280::fill_cfg_cmd (void)
+{
+	cmd[0] = BME280_CTRL_HUM;
+	cmd[1] = cfg.ctrl_hum;
+	cmd[2] = BME280_CTRL_MEAS;
+	cmd[3] = cfg.ctrl_meas | BME280_SLEEP_MODE;
+	cmd[4] = BME280_CONFIG;
+	cmd[5] = cfg.config;
+}
+
+/*****************************************************************************
+ * Method:		update_cfg
+ * Description:	This method works out the conversion time of the current
+ *				sampling settings, rounded up to whole ms, and marks the
+ *				settings to be written to the sensor before the next 
+ *				measurement.
+ ****************************************************************************/
+void BME280::update_cfg (void)
+{
+	meas_ms = (uint8_t)((meas_time(cfg.ctrl_hum, cfg.ctrl_meas) + 999UL) / 1000UL);
+	reconfig = true;
+}
+
+/*****************************************************************************
+ * Method:		set_profile
+ * Description:	This method switches to one of the named sampling profiles.
+ * 
+ * Parameters:	profile - the sampling profile to use
+ * Return:		bool	- the status of the operation (false = success,
+ *													true = unknown profile)
+ ****************************************************************************/
+bool BME280::set_profile (bme_Profile profile)
+{
+	if (profile >= BME_NUM_PROFILES)
+	{
+		return true;
+	}
+	
+	cfg = profiles[profile];
+	update_cfg();
+	
+	return false;
+}
+
+/*****************************************************************************
+ * Method:		set_hum_ovsm
+ * Description:	This method changes the humidity oversampling.
+ * 
+ * Parameters:	h_ovsm - one of the BME280_H_OVSM_ settings
+ ****************************************************************************/
+void BME280::set_hum_ovsm (uint8_t h_ovsm)
+{
+	cfg.ctrl_hum = h_ovsm & BME280_H_OVSM_MSK;
+	update_cfg();
+}
+
+/*****************************************************************************
+ * Method:		set_pres_ovsm
+ * Description:	This method changes the pressure oversampling.
+ * 
+ * Parameters:	p_ovsm - one of the BME280_P_OVSM_ settings
+ ****************************************************************************/
+void BME280::set_pres_ovsm (uint8_t p_ovsm)
+{
+	cfg.ctrl_meas = (cfg.ctrl_meas & ~BME280_P_OVSM_MSK) 
+					| (p_ovsm & BME280_P_OVSM_MSK);
+	update_cfg();
+}
+
+/*****************************************************************************
+ * Method:		set_temp_ovsm
+ * Description:	This method changes the temperature oversampling. Skipping
+ *				temperature also leaves pressure and humidity uncompensated,
+ *				since both depend on it.
+ * 
+ * Parameters:	t_ovsm - one of the BME280_T_OVSM_ settings
+ ****************************************************************************/
+void BME280::set_temp_ovsm (uint8_t t_ovsm)
+{
+	cfg.ctrl_meas = (cfg.ctrl_meas & ~BME280_T_OVSM_MSK) 
+					| (t_ovsm & BME280_T_OVSM_MSK);
+	update_cfg();
+}
+
+/*****************************************************************************
+ * Method:		set_filter
+ * Description:	This method changes the IIR filter coefficient. The filter 
+ *				smooths out short changes in pressure and temperature, but 
+ *				slows the response to real ones.
+ * 
+ * Parameters:	fltr - one of the BME280_FLTR_ settings
+ ****************************************************************************/
+void BME280::set_filter (uint8_t fltr)
+{
+	cfg.config = (cfg.config & ~BME280_FLTR_MSK) | (fltr & BME280_FLTR_MSK);
+	update_cfg();
 }
 
 /*****************************************************************************
  * Method:		set_mode
  * Description:	This method sets the mode of operation of the BME280 to the
- *				specified mode.
+ *				specified mode. The control registers are read in one 
+ *				combined transaction and written back together, with only the
+ *				mode bits changed.
  * 
  * Parameters:	mode - the mode of operation that the BME280 will be set to
  * Return:		bool - the status of the operation (false = success,
@@ -96,36 +249,37 @@ bool BME280::init (void)
  ****************************************************************************/
 bool BME280::set_mode (op_Mode mode)
 {
-	bool stat = false;
-	
-	uint8_t ctrl_hum = p_i2c->read(BME280_ADDR, BME280_CTRL_HUM);
+	uint8_t ctrl[NUM_CTRL_REG];		// CTRL_HUM, STATUS and CTRL_MEAS
+	uint8_t cmd[4];					// register address and data pairs
+	uint8_t mode_bits;
 	
-	if (p_i2c->write(BME280_ADDR, BME280_CTRL_HUM, ctrl_hum))
-    {
-		// There was a problem overwriting the humidity 
-		//DBG(this->p_serial,
-		//	"BME280::set_mode - FAILED overwriting humidity.\r\n");
+	// read both control registers in one combined transaction
+	if (p_i2c->write_read(BME280_ADDR, &ctrl_reg, 1, ctrl, NUM_CTRL_REG))
+	{
 		return true;
 	}
 	
 	switch (mode)
 	{
 		case FORCED:
-			stat = p_i2c->write(BME280_ADDR, BME280_CTRL_MEAS, 
-			 p_i2c->read(BME280_ADDR, BME280_CTRL_MEAS) | BME280_FORCED_MODE);
+			mode_bits = BME280_FORCED_MODE;
 			break;
 		case NORMAL:
-			stat = p_i2c->write(BME280_ADDR, BME280_CTRL_MEAS,
-			 p_i2c->read(BME280_ADDR, BME280_CTRL_MEAS) | BME280_NORMAL_MODE);
+			mode_bits = BME280_NORMAL_MODE;
 			break;
 		case SLEEP:
 		default:
-			stat = p_i2c->write(BME280_ADDR, BME280_CTRL_MEAS,
-			 p_i2c->read(BME280_ADDR, BME280_CTRL_MEAS) | BME280_SLEEP_MODE);
+			mode_bits = BME280_SLEEP_MODE;
 			break;
 	}
 	
-	return stat;	
+	// CTRL_HUM is written back since it only takes effect after CTRL_MEAS
+	cmd[0] = BME280_CTRL_HUM;
+	cmd[1] = ctrl[NDX_CTRL_HUM];
+	cmd[2] = BME280_CTRL_MEAS;
+	cmd[3] = (ctrl[NDX_CTRL_MEAS] & ~BME280_MODE_MSK) | mode_bits;
+	
+	return p_i2c->write_read(BME280_ADDR, cmd, sizeof(cmd), NULL, 0);
 }
 
 /*****************************************************************************
@@ -135,18 +289,56 @@ bool BME280::set_mode (op_Mode mode)
  *				raw values to the human-readable format are derived from the
  *				compensation formulas in the BME280 Datasheet 
  *				(https://cdn-shop.adafruit.com/product-files/2652/2652.pdf).
+ *				BME280_PRES_32BIT selects the datasheet's 32 bit integer 
+ *				formula, which avoids the slow 64 bit multiplies and divides
+ *				of the 64 bit one, at the cost of a few Pa (up to 7 Pa off, 
+ *				inside the sensor's own +/-12 Pa relative accuracy). Uses the
+ *				t_fine from convert_temperature, which must be run first.
  * 
- * Return:		int32_t - the human-readable pressure reading accurate to
- *							2 decimal places in Pascals. A value of 5382 is
- *							equal to 53.82 Pa
+ * Return:		int32_t - the human-readable pressure reading in Pascals. A
+ *							value of 101325 is equal to 1013.25 hPa
  ****************************************************************************/
+#if BME280_PRES_32BIT
 int32_t BME280::convert_pressure (void)
 {
-	int64_t var1, var2, p;
+	int32_t var1, var2;
+	uint32_t p;
+	
+	var1 =	(t_fine >> 1) - (int32_t)64000;
+	
+	var2 =	(((var1 >> 2) * (var1 >> 2)) >> 11) * ((int32_t)cal.dig_P6);
+	var2 =	var2 + ((var1 * ((int32_t)cal.dig_P5)) << 1);
+	var2 =	(var2 >> 2) + (((int32_t)cal.dig_P4) << 16);
 	
-	raw_pres >>= 4;
+	var1 =	(((((int32_t)cal.dig_P3) * (((var1 >> 2) * (var1 >> 2)) >> 13)) >> 3)
+			+ ((((int32_t)cal.dig_P2) * var1) >> 1)) >> 18;
+	var1 =	((((int32_t)32768 + var1)) * ((int32_t)cal.dig_P1)) >> 15;
 	
-	var1 =	((int64_t)cal.t_fine) - 128000;
+	if (var1 == 0) {
+		return 0;  // avoid exception caused by division by zero 
+	}
+	
+	p = (((uint32_t)((int32_t)1048576 - raw_pres)) - (var2 >> 12)) * 3125;
+	
+	// keep the top bit for the division when it is free
+	if (p < 0x80000000) {
+		p = (p << 1) / ((uint32_t)var1);
+	} else {
+		p = (p / (uint32_t)var1) * 2;
+	}
+	
+	var1 =	(((int32_t)cal.dig_P9) * ((int32_t)(((p >> 3) * (p >> 3)) >> 13)))
+			>> 12;
+	var2 =	(((int32_t)(p >> 2)) * ((int32_t)cal.dig_P8)) >> 13;
+	
+	return (int32_t)p + ((var1 + var2 + cal.dig_P7) >> 4);
+}
+#else
+int32_t BME280::convert_pressure (void)
+{
+	int64_t var1, var2, p;
+	
+	var1 =	((int64_t)t_fine) - 128000;
 	
 	var2 =	var1 * var1 * (int64_t)cal.dig_P6;
 	var2 =	var2 + ((var1*(int64_t)cal.dig_P5) << 17);
@@ -170,6 +362,7 @@ int32_t BME280::convert_pressure (void)
 	 
 	return p >> 8;
 }
+#endif
 
 /*****************************************************************************
  * Method:		convert_temperature
@@ -199,9 +392,9 @@ int32_t BME280::convert_temperature (void)
 			   ((raw_temp>>4) - ((int32_t)cal.dig_T1))) >> 12) *
 			((int32_t)cal.dig_T3)) >> 14;
 	
-	cal.t_fine = var1 + var2;
+	t_fine = var1 + var2;
 	
-	return (((cal.t_fine * 5 + 128) >> 8) - temp_cal);
+	return (((t_fine * 5 + 128) >> 8) - temp_cal);
 }
 
 /*****************************************************************************
@@ -220,7 +413,7 @@ uint32_t BME280::convert_humidity (void)
 	int32_t var1;
 	
 	/* Utilize t_fine calculation */
-	var1 = (cal.t_fine - ((int32_t)76800));
+	var1 = (t_fine - ((int32_t)76800));
 	
 	/* Calculate var1 - part 1	 */
 	var1 =	(((((raw_hum << 14) - (((int32_t)cal.dig_H4) << 20) -
@@ -242,6 +435,306 @@ uint32_t BME280::convert_humidity (void)
 	return (uint32_t)((var1 >> 12));
 }
 
+/*****************************************************************************
+ * Function:	mul_q24
+ * Description:	This function multiplies two Q24 numbers without needing a 64
+ *				bit product, by splitting each into 12 bit halves.
+ * 
+ * Parameters:	a - the first Q24 number, under 2 either way
+ *				b - the second Q24 number, under 32 either way
+ * Return:		int32_t - a * b in Q24, within one step of it
+ ****************************************************************************/
+static int32_t mul_q24 (int32_t a, int32_t b)
+{
+	int32_t a_hi = a >> 12;
+	int32_t a_lo = a & 0xFFF;
+	int32_t b_hi = b >> 12;
+	int32_t b_lo = b & 0xFFF;
+	
+	return a_hi * b_hi + ((a_hi * b_lo + a_lo * b_hi) >> 12);
+}
+
+/*****************************************************************************
+ * Function:	div_q24
+ * Description:	This function divides two whole numbers to a Q24 result, in
+ *				two steps so the dividend does not have to be shifted 24 bits.
+ * 
+ * Parameters:	n - the dividend, under 2^19 either way
+ *				d - the divisor, positive and under 2^19
+ * Return:		int32_t - n / d in Q24, rounded towards 0
+ ****************************************************************************/
+static int32_t div_q24 (int32_t n, int32_t d)
+{
+	int32_t q = (n << 12) / d;
+	int32_t r = (n << 12) - q * d;
+	
+	return (q << 12) + (r << 12) / d;
+}
+
+/*****************************************************************************
+ * Function:	log2_q16
+ * Description:	This function works out the base 2 log of a Q16 number. The
+ *				number is shifted into [1, 2) for the whole part of the log,
+ *				then the fraction bits come from squaring it again and again:
+ *				each time the square reaches 2, the next bit is a one.
+ * 
+ * Parameters:	x - the Q16 number, must not be 0
+ * Return:		int32_t - log2(x) in Q16
+ ****************************************************************************/
+static int32_t log2_q16 (uint32_t x)
+{
+	int32_t result = 0;
+	uint32_t sq;
+	
+	// Q15 has 1.0 at bit 15, so shift x until that is its top bit
+	while (x >= 0x10000UL)
+	{
+		x >>= 1;
+		result += BME280_Q16_ONE;
+	}
+	while (x < 0x8000UL)
+	{
+		x <<= 1;
+		result -= BME280_Q16_ONE;
+	}
+	
+	// x is now 1.0 to 2.0 in Q15, so one less than the whole part of Q16
+	result -= BME280_Q16_ONE;
+	
+	for (uint16_t bit = 0x8000; bit; bit >>= 1)
+	{
+		sq = x * x;
+		
+		if (sq >= 0x80000000UL)
+		{
+			// square is 2 or more, halve it
+			x = sq >> 16;
+			result += bit;
+		}
+		else
+		{
+			x = sq >> 15;
+		}
+	}
+	
+	return result;
+}
+
+/*****************************************************************************
+ * Function:	exp2_q16
+ * Description:	This function works out 2 to a Q16 power. The whole part of
+ *				the power is a shift and the fraction comes from a quartic 
+ *				fit of 2^f on [0, 1), which is within 1e-5 of it.
+ * 
+ * Parameters:	x - the Q16 power, from -16 to under 15
+ * Return:		uint32_t - 2^x in Q16
+ ****************************************************************************/
+static uint32_t exp2_q16 (int32_t x)
+{
+	int8_t whole = (int8_t)(x >> 16);
+	uint32_t f = (uint32_t)x & 0xFFFF;
+	uint32_t r;
+	
+	// 2^f - 1 = f * (c1 + f * (c2 + f * (c3 + f * c4))), all Q16
+	r = 884;
+	r = 3413 + ((f * r) >> 16);
+	r = 15821 + ((f * r) >> 16);
+	r = 45418 + ((f * r) >> 16);
+	r = BME280_Q16_ONE + ((f * r) >> 16);
+	
+	return (whole >= 0 ? r << whole : r >> -whole);
+}
+
+/*****************************************************************************
+ * Function:	isqrt
+ * Description:	This function works out the integer square root of a number,
+ *				one result bit at a time.
+ * 
+ * Parameters:	x - the number
+ * Return:		uint16_t - the square root of x, rounded down
+ ****************************************************************************/
+static uint16_t isqrt (uint32_t x)
+{
+	uint16_t root = 0;
+	uint32_t sq;
+	
+	for (uint16_t bit = 0x8000; bit; bit >>= 1)
+	{
+		sq = (uint32_t)(root | bit) * (root | bit);
+		
+		if (sq <= x)
+		{
+			root |= bit;
+		}
+	}
+	
+	return root;
+}
+
+/*****************************************************************************
+ * Method:		calc_vapor
+ * Description:	This method works out the water vapour pressure with the 
+ *				Magnus formula, e = 6.112 hPa * RH * exp(b*T / (c + T)). It 
+ *				is kept as a base 2 log, which the dew point and absolute
+ *				humidity both start from, so no natural logs or powers are
+ *				needed. Must be run after the temperature and humidity are
+ *				converted.
+ * 
+ * Return:		int32_t - log2(e / 6.112 hPa) in Q16
+ ****************************************************************************/
+int32_t BME280::calc_vapor (void)
+{
+	uint32_t rh;
+	int32_t ratio;
+	
+	// RH as a Q16 fraction (humidity / 1024 / 100 * 65536), at least the
+	// smallest step so there is a log
+	rh = (humidity * 16) / 25;
+	rh = (rh ? rh : 1);
+	
+	// T / (c + T) in Q24, then b / ln(2) times that, rounded to Q16. Q16
+	// is not enough for the ratio, as b / ln(2) is 25 times its error
+	ratio = div_q24(temperature, BME280_MAGNUS_C + temperature);
+	
+	return log2_q16(rh) + ((mul_q24(ratio, BME280_MAGNUS_B2) + 128) >> 8);
+}
+
+/*****************************************************************************
+ * Method:		calc_dew_point
+ * Description:	This method works out the dew point from the Magnus formula,
+ *				Td = c * g / (b - g), where g is the natural log of the 
+ *				vapour pressure over 6.112 hPa. The ln(2) in g and b cancel,
+ *				so the base 2 log is used as it is. Within 0.02 C of the 
+ *				formula over -40 C to 85 C, 1% to 100% RH.
+ * 
+ * Parameters:	vapor	- the vapour pressure from calc_vapor
+ * Return:		int32_t - the dew point in C * 100
+ ****************************************************************************/
+int32_t BME280::calc_dew_point (int32_t vapor)
+{
+	int32_t b2 = BME280_MAGNUS_B2 >> 8;
+	int32_t frac;
+	
+	// g / (b - g) in Q16, the divisor is cut down so the dividend fits
+	frac = (vapor << 10) / ((b2 - vapor) >> 6);
+	
+	return (frac * BME280_MAGNUS_C + 0x8000) >> 16;
+}
+
+/*****************************************************************************
+ * Method:		calc_abs_humidity
+ * Description:	This method works out the mass of water in a cubic metre of
+ *				air from the vapour pressure, 216.74 * e / T, with e in hPa
+ *				and T in K.
+ * 
+ * Parameters:	vapor	 - the vapour pressure from calc_vapor
+ * Return:		uint16_t - the absolute humidity in g/m^3 * 100
+ ****************************************************************************/
+uint16_t BME280::calc_abs_humidity (int32_t vapor)
+{
+	uint32_t e = exp2_q16(vapor);
+	
+	// e * 6.112 hPa * 216.74 / T, the factor is cut down by 2^9 to fit in
+	// Q24 and e is in Q16, so the product is 2^7 too big
+	return (uint16_t)((mul_q24((int32_t)e, div_q24(BME280_ABS_HUM_K >> 9,
+						temperature + BME280_KELVIN)) + 64) >> 7);
+}
+
+/*****************************************************************************
+ * Method:		calc_heat_index
+ * Description:	This method works out the heat index, how hot it feels, with
+ *				the NWS method: the simple formula below 80 F, otherwise the
+ *				Rothfusz regression with its low and high humidity 
+ *				adjustments. The regression is split into powers of the 
+ *				temperature, HI = A + T * (B + C * T), with A, B and C 
+ *				quadratics in RH, each worked from the inside out so the 
+ *				products stay in 32 bits. RH is taken in tenths of a percent.
+ *				Whole percent would be up to half a percent off, worth
+ *				over 1.5 F at the top of the range.
+ * 
+ * Return:		int32_t - the heat index in F * 100
+ ****************************************************************************/
+int32_t BME280::calc_heat_index (void)
+{
+	int32_t t = TEMP_C_TO_F(temperature);		// F * 100
+	int32_t rh = (int32_t)((humidity * 10 + 512) >> 10);	// % * 10
+	int32_t hi, a, b, c, d;
+	uint16_t root;
+	
+	// simple formula, 0.5 * (T + 61 + (T - 68) * 1.2 + RH * 0.094)
+	hi = (t + 6100 + ((t - 6800) * 6) / 5 + (rh * 47) / 50) / 2;
+	
+	if ((hi + t) / 2 < 8000)
+	{
+		return hi;
+	}
+	
+	// regression coefficients: a in F * 100, b * 10^4, c * 10^6
+	a = (-4237900L + (rh * (1014333L - (54817L * rh) / 100)) / 10) / 1000;
+	b = (2049015L + (rh * ((85282L * rh) / 1000 - 224755L)) / 10) / 100;
+	c = (-683783L + (rh * (122874L - (199L * rh) / 10)) / 10) / 100;
+	
+	// C * T in 10^4, then B + C * T times T in F * 100
+	b += (c * t) / 10000;
+	hi = a + (b * t) / 10000;
+	
+	if (rh < 130 && t > 8000 && t < 11200)
+	{
+		// dry: - (13 - RH) / 4 * sqrt((17 - |T - 95|) / 17)
+		d = (t > 9500 ? t - 9500 : 9500 - t);
+		root = isqrt(((1700 - d) * 10000L) / 1700);
+		hi -= ((130 - rh) * 25 * (int32_t)root) / 1000;
+	}
+	else if (rh > 850 && t > 8000 && t < 8700)
+	{
+		// humid: + (RH - 85) / 10 * (87 - T) / 5
+		hi += ((rh - 850) * (8700 - t)) / 500;
+	}
+	
+	return hi;
+}
+
+/*****************************************************************************
+ * Method:		calc_sea_level
+ * Description:	This method works out the pressure at sea level from the
+ *				pressure at BME280_ALTITUDE with the barometric formula,
+ *				P0 = P * (1 + L * h / T)^5.257, where L is the standard lapse
+ *				rate and T the temperature in K. The power is worked out as
+ *				exp(5.257 * ln(1 + L * h / T)), both as series, which stay
+ *				within 1 Pa of it from -400 m to 2000 m.
+ * 
+ * Return:		uint32_t - the sea level pressure in Pa
+ ****************************************************************************/
+uint32_t BME280::calc_sea_level (void)
+{
+	int32_t lh = (BME280_ALTITUDE * BME280_LAPSE) / 100;	// K * 100
+	int32_t z, y, term, e;
+	
+	// z = L * h / T in Q24
+	z = div_q24(lh, temperature + BME280_KELVIN);
+	
+	// ln(1 + z) = z * (1 - z * (1/2 - z * (1/3 - z / 4)))
+	y = BME280_Q24_ONE / 3 - z / 4;
+	y = BME280_Q24_ONE / 2 - mul_q24(z, y);
+	y = BME280_Q24_ONE - mul_q24(z, y);
+	y = mul_q24(z, y);
+	
+	// times the exponent, 5 + 0.257
+	y = y * 5 + mul_q24(y, BME280_BARO_EXP_FRAC);
+	
+	// exp(y) - 1 = y + y^2 / 2! + ... + y^7 / 7!
+	term = y;
+	e = y;
+	for (uint8_t k = 2; k <= 7; k++)
+	{
+		term = mul_q24(term, y) / k;
+		e += term;
+	}
+	
+	// the pressure is scaled up for the multiply so it keeps its last Pa
+	return (uint32_t)(pressure + ((mul_q24(pressure << 7, e) + 64) >> 7));
+}
+
 /*****************************************************************************
  * Method:		reset
  * Description:	This method resets the BME280 to its factory conditions.
@@ -270,13 +763,30 @@ bool BME280::read_data (void)
 	uint8_t data[NUM_DATA_REG];		// array to hold all of raw data from read
 	
 	// read in the data from the registers
-	if (p_i2c->read(BME280_ADDR, BME280_P_RAW_MSB, data, NUM_DATA_REG))
+	if (p_i2c->write_read(BME280_ADDR, &data_reg, 1, data, NUM_DATA_REG))
 	{
 		// There was an error in the read operation, propagate this message
 		//DBG(this->p_serial, "BME280::read_data FAILED to read data registers\r\n");
 		return true;
 	}
 	
+	parse_data(data);
+	
+	return false;
+}
+
+/*****************************************************************************
+ * Method:		parse_data
+ * Description:	This method unpacks the raw data registers into the class
+ *				variables and then performs the appropriate calculations and
+ *				conversions on the data.
+ * 
+ * Parameters:	data - the NUM_DATA_REG bytes read from BME280_P_RAW_MSB on
+ ****************************************************************************/
+void BME280::parse_data (const uint8_t *data)
+{
+	int32_t vapor;					// log2 of the vapour pressure
+	
 	// store data in class variables
 	raw_pres = (int32_t)(
 						((uint32_t)data[NDX_P_MSB]  << P_T_MSB_SHIFT)
@@ -295,19 +805,29 @@ bool BME280::read_data (void)
 						| ((uint32_t)data[NDX_H_LSB])
 						);
 	
-	// convert the raw values into human readable format
-	pressure = convert_pressure();
+	// convert the raw values into human readable format, temperature first
+	// since the others are compensated with its t_fine
 	temperature = convert_temperature();
+	pressure = convert_pressure();
 	humidity = convert_humidity();
 	
-	return false;
+	// readings derived from the converted ones
+	vapor = calc_vapor();
+	dew_point = calc_dew_point(vapor);
+	abs_hum = calc_abs_humidity(vapor);
+	heat_index = calc_heat_index();
+	sea_level = calc_sea_level();
 }
 
 /*****************************************************************************
  * Method:		read_cal
  * Description:	This method reads in the calibration data from the BME280
  *				sensor. These values are static and are used to convert the 
- *				raw data into a human readable format.		
+ *				raw data into a human readable format. The chip id and the
+ *				dig_T1 to dig_T3 fingerprint are read first, and if the 
+ *				EEPROM cache holds the data of a sensor with both it is used
+ *				instead of reading the rest of the calibration registers. 
+ *				Otherwise all of them are read and the cache is refreshed.
  * 
  * Return:		bool - the status of the operation (false = success,
  *													true = failure)
@@ -317,14 +837,103 @@ bool BME280::read_cal (void)
 	uint8_t data1[BME280_CAL_RNG_1];	// hold calibration data from range 1
 	uint8_t data2[BME280_CAL_RNG_2];	// hold calibration data from range 2
 	
-	if (p_i2c->read(BME280_ADDR, BME280_CAL_START_1, data1, BME280_CAL_RNG_1)
-	 || p_i2c->read(BME280_ADDR, BME280_CAL_START_2, data2, BME280_CAL_RNG_2))
+	if (p_i2c->write_read(BME280_ADDR, &id_reg, 1, &chip_id, 1)
+	 || p_i2c->write_read(BME280_ADDR, &cal_1_reg, 1, data1, 
+						  BME280_FPRINT_LEN))
+	{
+		return true;
+	}
+	
+	if (!load_cal(data1))
+	{
+		// cached data is good for this sensor
+		return false;
+	}
+	
+	if (p_i2c->write_read(BME280_ADDR, &cal_1_reg, 1, data1, BME280_CAL_RNG_1)
+	 || p_i2c->write_read(BME280_ADDR, &cal_2_reg, 1, data2, BME280_CAL_RNG_2))
 	{
 		// There was an error in the read operation, propagate this message
 		//DBG(this->p_serial, "BME280::read_cal FAILED to read cal reigsters\r\n");
 		return true;
 	}
 	
+	parse_cal(data1, data2);
+	save_cal();
+	
+	return false;
+}
+
+/*****************************************************************************
+ * Method:		load_cal
+ * Description:	This method loads the calibration data from the EEPROM cache
+ *				if the cache is intact and was saved for a sensor with the
+ *				chip id that was read. The chip id is the same for every 
+ *				BME280, so the cached dig_T1 to dig_T3 must also match the 
+ *				ones read from the sensor, or a swapped sensor would be run
+ *				with the old one's calibration.
+ * 
+ * Parameters:	fprint - the BME280_FPRINT_LEN bytes from BME280_CAL_START_1
+ * Return:		bool - the status of the operation (false = success,
+ *									true = cache empty, corrupt or stale)
+ ****************************************************************************/
+bool BME280::load_cal (const uint8_t *fprint)
+{
+	BME280_Cal_Cache cache;
+	uint16_t t1, t2, t3;
+	
+	eeprom_read_block(&cache, &ee_cal_cache, sizeof(cache));
+	
+	t1 = ((uint16_t)fprint[CAL_DIG_T1_MSB] << BYTE_SHIFT) 
+		 | fprint[CAL_DIG_T1_LSB];
+	t2 = ((uint16_t)fprint[CAL_DIG_T2_MSB] << BYTE_SHIFT) 
+		 | fprint[CAL_DIG_T2_LSB];
+	t3 = ((uint16_t)fprint[CAL_DIG_T3_MSB] << BYTE_SHIFT) 
+		 | fprint[CAL_DIG_T3_LSB];
+	
+	if (cache.chip_id != chip_id
+	 || cache.cal.dig_T1 != t1
+	 || (uint16_t)cache.cal.dig_T2 != t2
+	 || (uint16_t)cache.cal.dig_T3 != t3
+	 || cache.crc != serial::crc16((uint8_t *)&cache,
+								   sizeof(cache) - sizeof(cache.crc)))
+	{
+		return true;
+	}
+	
+	cal = cache.cal;
+	
+	return false;
+}
+
+/*****************************************************************************
+ * Method:		save_cal
+ * Description:	This method stores the calibration data in the EEPROM cache.
+ *				Only the bytes that changed are written, each takes about
+ *				3.4ms, so this is only done when a new sensor is seen.
+ ****************************************************************************/
+void BME280::save_cal (void)
+{
+	BME280_Cal_Cache cache;
+	
+	cache.chip_id = chip_id;
+	cache.cal = cal;
+	cache.crc = serial::crc16((uint8_t *)&cache,
+							  sizeof(cache) - sizeof(cache.crc));
+	
+	eeprom_update_block(&cache, &ee_cal_cache, sizeof(cache));
+}
+
+/*****************************************************************************
+ * Method:		parse_cal
+ * Description:	This method unpacks the calibration registers into the
+ *				calibration data structure.
+ * 
+ * Parameters:	data1 - the BME280_CAL_RNG_1 bytes from BME280_CAL_START_1 on
+ *				data2 - the BME280_CAL_RNG_2 bytes from BME280_CAL_START_2 on
+ ****************************************************************************/
+void BME280::parse_cal (const uint8_t *data1, const uint8_t *data2)
+{
 	cal.dig_T1 = (uint16_t)(((uint16_t)data1[CAL_DIG_T1_MSB] << BYTE_SHIFT)
 							| data1[CAL_DIG_T1_LSB]);
 	cal.dig_T2 = (int16_t)(((uint16_t)data1[CAL_DIG_T2_MSB] << BYTE_SHIFT)
@@ -361,42 +970,286 @@ bool BME280::read_cal (void)
 							| ((data2[CAL_DIG_H5_LSB] >> NIB_SHIFT) 
 								& CAL_DIG_H_MSK));
 	cal.dig_H6 = (int8_t)data2[CAL_DIG_H6_LSB];
+}
+
+/*****************************************************************************
+ * Method:		meas_time
+ * Description:	This method works out the longest time a forced mode 
+ *				conversion can take with the given oversampling settings,
+ *				using the formula from the datasheet (9.1). Skipped channels
+ *				take no time.
+ * 
+ * Parameters:	ctrl_hum  - the CTRL_HUM register setting
+ *				ctrl_meas - the CTRL_MEAS register setting
+ * Return:		uint32_t  - the conversion time in us, over 16 bits when
+ *							all three channels oversample heavily
+ ****************************************************************************/
+uint32_t BME280::meas_time (uint8_t ctrl_hum, uint8_t ctrl_meas)
+{
+	uint8_t osrs[3];
+	uint32_t us = BME280_MEAS_BASE_US;
 	
-	return false;
+	osrs[0] = (ctrl_meas & BME280_T_OVSM_MSK) >> BME280_T_OVSM_SHIFT;
+	osrs[1] = (ctrl_meas & BME280_P_OVSM_MSK) >> BME280_P_OVSM_SHIFT;
+	osrs[2] = (ctrl_hum & BME280_H_OVSM_MSK);
+	
+	for (uint8_t ch = 0; ch < 3; ch++)
+	{
+		if (osrs[ch] == 0)
+		{
+			// channel skipped
+			continue;
+		}
+		
+		// settings 1 to 5 are x1 to x16, anything above is also x16
+		us += (uint32_t)BME280_MEAS_OVSM_US << (osrs[ch] > 5 ? 4 : osrs[ch] - 1);
+		
+		// pressure and humidity have a fixed overhead as well
+		us += (ch ? BME280_MEAS_CH_US : 0);
+	}
+	
+	return us;
 }
 
-void BME280::BME280Task (void)
+/*****************************************************************************
+ * Method:		start_step
+ * Description:	This method starts the background i2c transaction for the
+ *				current step. Setting up the sensor takes up to five steps:
+ *				write the control registers, read the chip id and the 
+ *				calibration fingerprint, then read each calibration range 
+ *				unless it is already cached. 
+ *				Each measurement then takes three more: trigger a forced mode
+ *				conversion, read the status register until the conversion is
+ *				done, and burst read the data registers. Changed sampling 
+ *				settings are written in a step of their own before the next
+ *				trigger.
+ ****************************************************************************/
+void BME280::start_step (void)
 {
-	static uint8_t runs = 0;
-	int32_t temp_f;
+	xfer.addr = BME280_ADDR;
+	xfer.ntx = 1;
+	xfer.nrx = 0;
+	
+	switch (state)
+	{
+		case BME_INIT:
+		case BME_CONFIG:
+			// the settings are written as they are now, later changes wait
+			// for the next step
+			reconfig = false;
+			fill_cfg_cmd();
+			xfer.tx = cmd;
+			xfer.ntx = sizeof(cmd);
+			break;
+			
+		case BME_ID:
+			xfer.tx = &id_reg;
+			xfer.rx = &chip_id;
+			xfer.nrx = 1;
+			break;
+			
+		case BME_FPRINT:
+			xfer.tx = &cal_1_reg;
+			xfer.rx = buf;
+			xfer.nrx = BME280_FPRINT_LEN;
+			break;
+			
+		case BME_CAL_1:
+			xfer.tx = &cal_1_reg;
+			xfer.rx = buf;
+			xfer.nrx = BME280_CAL_RNG_1;
+			break;
+			
+		case BME_CAL_2:
+			xfer.tx = &cal_2_reg;
+			xfer.rx = &buf[BME280_CAL_RNG_1];
+			xfer.nrx = BME280_CAL_RNG_2;
+			break;
+			
+		case BME_TRIGGER:
+			// start a single conversion, the sensor goes back to sleep when
+			// it is done
+			cmd[0] = BME280_CTRL_MEAS;
+			cmd[1] = cfg.ctrl_meas | BME280_FORCED_MODE;
+			xfer.tx = cmd;
+			xfer.ntx = 2;
+			break;
+			
+		case BME_STATUS:
+			xfer.tx = &status_reg;
+			xfer.rx = buf;
+			xfer.nrx = 1;
+			break;
+			
+		case BME_READ:
+		default:
+			xfer.tx = &data_reg;
+			xfer.rx = buf;
+			xfer.nrx = NUM_DATA_REG;
+			break;
+	}
 	
-	read_data();
-	temp_f = TEMP_C_TO_F(temperature);
+	p_i2c->begin(&xfer);
+}
+
+/*****************************************************************************
+ * Method:		next_step
+ * Description:	This method uses the result of the transaction that has just
+ *				finished and works out which step comes next and when. After
+ *				a conversion is triggered, the status is not read until the 
+ *				conversion should be done, and then again on every run of the
+ *				task until it is. The next conversion is triggered one sample
+ *				period after the last.
+ * 
+ * Parameters:	now - the current tick
+ ****************************************************************************/
+void BME280::next_step (uint32_t now)
+{
+	wait_until = now;
 	
-	// update global values to be used to send packet
+	switch (state)
+	{
+		case BME_INIT:
+			state = BME_ID;
+			break;
+			
+		case BME_ID:
+			state = BME_FPRINT;
+			break;
+			
+		case BME_FPRINT:
+			// the calibration registers only have to be read for a sensor
+			// that is not in the cache
+			state = (load_cal(buf) ? BME_CAL_1 : BME_TRIGGER);
+			break;
+			
+		case BME_CAL_1:
+			state = BME_CAL_2;
+			break;
+			
+		case BME_CAL_2:
+			parse_cal(buf, &buf[BME280_CAL_RNG_1]);
+			save_cal();
+			state = BME_TRIGGER;
+			break;
+			
+		case BME_CONFIG:
+			state = BME_TRIGGER;
+			break;
+			
+		case BME_TRIGGER:
+			sample_time = xfer_time;
+			wait_until = now + meas_ms;
+			state = BME_STATUS;
+			break;
+			
+		case BME_STATUS:
+			if (!(buf[0] & (1 << BME280_STATUS_MEAS)))
+			{
+				state = BME_READ;
+			}
+			break;
+			
+		case BME_READ:
+		default:
+			parse_data(buf);
+			publish();
+			
+			wait_until = sample_time + period;
+			state = BME_TRIGGER;
+			break;
+	}
+}
+
+/*****************************************************************************
+ * Method:		publish
+ * Description:	This method updates the shared sensor values that are sent in
+ *				the sensor packet.
+ ****************************************************************************/
+void BME280::publish (void)
+{
 	ext_hum = humidity;
-	ext_temp = temp_f;
+	ext_pres = pressure;
+	ext_temp = TEMP_C_TO_F(temperature);
+	ext_dew = TEMP_C_TO_F(dew_point);
+	ext_abs_hum = abs_hum;
+	ext_heat = heat_index;
+	ext_slp = sea_level;
+}
+
+/*****************************************************************************
+ * Method:		BME280Task
+ * Description:	This task steps the sensor through its background i2c 
+ *				transactions, so it never waits on the bus or on a 
+ *				conversion. It should be run every few ms; on most runs there
+ *				is nothing to do and it returns straight away. The 
+ *				conversions and derived values are done here rather than in
+ *				the ISR since they take too long to run with interrupts off.
+ *				A transaction that has not finished after BME280_XFER_TIMEOUT
+ *				is aborted, which also recovers the bus. A failure during a 
+ *				measurement starts the measurement over, but after 
+ *				BME280_REINIT_FAILS in a row the sensor is set up again in 
+ *				case it was reset. A failure setting the sensor up or writing
+ *				new sampling settings starts over from init. Each failure in
+ *				a row doubles the wait before the next try, up to 
+ *				2^BME280_MAX_BACKOFF sample periods, so a missing sensor is
+ *				not hammered.
+ ****************************************************************************/
+void BME280::BME280Task (void)
+{
+	uint32_t now = scheduler::ticks();
 	
-	/*
-	if ((runs % 5) == 0)
+	if (xfer.state == TWI_BUSY)
 	{
-		DBG(this->p_serial, "\r\nBME280 Task Running\r\n");
-		
-		read_data();
+		if ((now - xfer_time) < BME280_XFER_TIMEOUT)
+		{
+			// still running
+			return;
+		}
 		
-		temp_f = TEMP_C_TO_F(temperature);	
+		// the bus has hung
+		p_i2c->abort(&xfer);
+	}
+	
+	if (xfer.state == TWI_DONE)
+	{
+		fails = 0;
+		next_step(now);
+	}
+	else if (xfer.state == TWI_ERROR)
+	{
+		if (fails <= BME280_MAX_BACKOFF)
+		{
+			fails++;
+		}
 		
-		DBG(this->p_serial, "Temperature: %ld.%02ldC or %ld.%02ldF\r\n",
-				(temperature / 100), (temperature % 100),
-				(temp_f / 100), (temp_f % 100));
+		if (state <= BME_CONFIG || fails >= BME280_REINIT_FAILS)
+		{
+			state = BME_INIT;
+		}
+		else
+		{
+			state = BME_TRIGGER;
+		}
 		
-		DBG(this->p_serial, "Humidity: %lu.%lu%%\r\n",
-			(humidity / 1024), (humidity % 1024));
-			
-		DBG(this->p_serial, "Pressure: %luPa\r\n",
-			pressure);
+		// wait 0, 1, 3, 7... sample periods before trying again
+		wait_until = now + (uint32_t)period * ((1 << (fails - 1)) - 1);
 	}
-	*/
-	runs++;
-	return;
-}
\ No newline at end of file
+	
+	// result has been used
+	xfer.state = TWI_IDLE;
+	
+	if ((int32_t)(now - wait_until) < 0)
+	{
+		return;
+	}
+	
+	if (state == BME_TRIGGER && reconfig)
+	{
+		// write the new sampling settings before the next measurement
+		state = BME_CONFIG;
+	}
+	
+	xfer_time = now;
+	start_step();
+}
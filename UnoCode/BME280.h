@@ -10,6 +10,8 @@
 #ifndef __BME280_H__
 #define __BME280_H__
 
+#include <avr/eeprom.h>
+
 #include "i2c.h"
 #include "serial.h"
 
@@ -108,6 +110,13 @@
 #define BME280_SLEEP_MODE		0b00000000
 #define	BME280_FORCED_MODE		0b00000001
 #define BME280_NORMAL_MODE		0b00000011
+#define BME280_MODE_MSK			0b00000011
+
+#define BME280_P_OVSM_MSK		0b11100000
+#define BME280_P_OVSM_SHIFT		5
+#define BME280_T_OVSM_MSK		0b00011100
+#define BME280_T_OVSM_SHIFT		2
+#define BME280_H_OVSM_MSK		0b00000111
 
 /* Config register controls the rate, filter, and interface 
  * options of the device. NOTE: writes to register in normal 
@@ -144,6 +153,7 @@
 #define BME280_FLTR_4			0b00001000
 #define BME280_FLTR_8			0b00001100
 #define BME280_FLTR_16			0b00010000
+#define BME280_FLTR_MSK			0b00011100
 
 #define	BME280_SPI_EN			0b00000001
 #define BME280_SPI_DIS			0b00000000
@@ -225,6 +235,10 @@
 #define CAL_DIG_P9_MSB			23
 #define CAL_DIG_H1_LSB			25
 
+// dig_T1 to dig_T3, read at every start to check the cached calibration 
+// is from the sensor that is fitted
+#define BME280_FPRINT_LEN		(CAL_DIG_T3_MSB + 1)
+
 #define BME280_CAL_START_2		0xE1 /* 26 */
 #define BME280_CAL_RNG_2		7
 
@@ -266,6 +280,11 @@
 #define NDX_H_MSB		6
 #define NDX_H_LSB		7
 
+// Reading Control Register Index Positions, from CTRL_HUM to CTRL_MEAS
+#define NUM_CTRL_REG	3
+#define NDX_CTRL_HUM	0
+#define NDX_CTRL_MEAS	2
+
 // Shifting Values
 #define P_T_MSB_SHIFT	12
 #define P_T_LSB_SHIFT	4
@@ -273,9 +292,92 @@
 #define BYTE_SHIFT		8
 #define NIB_SHIFT		4
 
+// Size of the buffer background reads are made into, big enough to hold
+// both calibration ranges
+#define BME280_BUF_SIZE	(BME280_CAL_RNG_1 + BME280_CAL_RNG_2)
+
+// Failed background transactions in a row before the measurement gives up
+// and sets the sensor up again
+#define BME280_REINIT_FAILS	3
+
+// Longest wait between tries after failures, 2^6 = 64 sample periods
+#define BME280_MAX_BACKOFF	6
+
+/* Pressure compensation formula, 1 = the datasheet's 32 bit integer one,
+ * 0 = the 64 bit one. The 32 bit formula is much cheaper on the AVR and
+ * is within a few Pa of the 64 bit one.
+ */
+#ifndef BME280_PRES_32BIT
+#define BME280_PRES_32BIT	1
+#endif
+
+// Height of the sensor above sea level in m, for the sea level pressure
+#ifndef BME280_ALTITUDE
+#define BME280_ALTITUDE		0
+#endif
+
+/* Fixed point constants for the derived readings. Q16 and Q24 values have
+ * 16 and 24 fraction bits, so 65536 and 16777216 are 1.0.
+ *
+ * MAGNUS_B2	- Magnus formula b (17.62) over ln(2), in Q24
+ * MAGNUS_C		- Magnus formula c (243.12 C), C * 100
+ * ABS_HUM_K	- 6.112 hPa * 216.74 g K / (m^3 hPa) * 10^4
+ * KELVIN		- 0 C in K * 100
+ * LAPSE		- standard lapse rate (0.0065 K/m) * 10^4
+ * BARO_EXP_FRAC - fraction part of the barometric exponent (5.257) in Q24
+ */
+#define BME280_Q16_ONE		65536L
+#define BME280_Q24_ONE		16777216L
+#define BME280_MAGNUS_B2	426481639L
+#define BME280_MAGNUS_C		24312L
+#define BME280_ABS_HUM_K	13247149L
+#define BME280_KELVIN		27315L
+#define BME280_LAPSE		65L
+#define BME280_BARO_EXP_FRAC 4311744L
+
+// Background transaction still not finished after this many ms has hung
+#define BME280_XFER_TIMEOUT	100
+
+/* Measurement time from the datasheet (9.1), in us. Each enabled channel
+ * takes MEAS_OVSM_US per oversample, pressure and humidity also take a
+ * fixed MEAS_CH_US on top.
+ */
+#define BME280_MEAS_BASE_US	1250
+#define BME280_MEAS_OVSM_US	2300
+#define BME280_MEAS_CH_US	575
+
+// Register address and data pairs for CTRL_HUM, CTRL_MEAS and CONFIG
+#define BME280_CFG_CMD_LEN	6
+
 // Operation Modes
 enum op_Mode {SLEEP, FORCED, NORMAL};
 
+/* Sampling profiles, trading resolution against conversion time and current
+ * (datasheet 3.5).
+ *
+ * BME_WEATHER	- all channels x1, filter off. Lowest current, for battery
+ * BME_INDOOR	- pressure x16, temperature x2, humidity x1, filter 16. 
+ *					Highest resolution, for mains power
+ * BME_FAST		- pressure x4, temperature x1, humidity x1, filter 4. Short
+ *					conversions that still follow quick changes
+ */
+enum bme_Profile {BME_WEATHER, BME_INDOOR, BME_FAST, BME_NUM_PROFILES};
+
+// Background transaction steps, set up the sensor and read its chip id and
+// calibration fingerprint (and the whole calibration if it is not cached) 
+// then take forced mode measurements: trigger a conversion, wait for it and
+// read the data. CONFIG writes new sampling settings between measurements.
+enum bme_State {BME_INIT, BME_ID, BME_FPRINT, BME_CAL_1, BME_CAL_2, 
+				BME_CONFIG, BME_TRIGGER, BME_STATUS, BME_READ};
+
+// Sampling settings, the CTRL_HUM, CTRL_MEAS (without mode) and CONFIG 
+// register values
+struct BME280_Settings {
+	uint8_t ctrl_hum;
+	uint8_t ctrl_meas;
+	uint8_t config;
+};
+
 // Calibration data structure
 struct BME280_Cal_Data {
 	uint16_t dig_T1;		//SEE TABLE ON PG 22 FOR REGISTER BREAKDOWN
@@ -298,8 +400,15 @@ struct BME280_Cal_Data {
 	int16_t  dig_H4;
 	int16_t  dig_H5;
 	int8_t 	 dig_H6;
+};
 
-	int32_t	 t_fine;
+// Calibration data cached in EEPROM, so it does not have to be read from 
+// the sensor on every boot. Only used for a sensor with the same chip id 
+// and the same dig_T1 to dig_T3, as every BME280 has the same chip id.
+struct BME280_Cal_Cache {
+	uint8_t			chip_id;	// chip id of the sensor the data is from
+	BME280_Cal_Data	cal;		// parsed calibration data
+	uint16_t		crc;		// CRC-16 of chip_id and cal
 };
 
 /*****************************************************************************
@@ -322,15 +431,34 @@ class BME280
 		int32_t raw_temp;		// raw temperature data from BME280
 		int32_t raw_hum;		// raw humidity data from BME280
 		
-		int32_t pressure;		// scaled and shifted pressure reading
+		int32_t pressure;		// pressure reading in Pa
+		
+		int32_t dew_point;		// dew point in C * 100
+		uint16_t abs_hum;		// absolute humidity in g/m^3 * 100
+		int32_t heat_index;		// heat index in F * 100
+		uint32_t sea_level;		// pressure at sea level in Pa
 		int32_t temperature;	// scaled and shifted temperature reading
 		uint32_t humidity;		// scaled and shifted humidity reading
 
 		BME280_Cal_Data cal; 	// calibration data from BME280
-
-		// this method gets the calibration data of the BME280
-		bool get_calibration(void);
+		int32_t t_fine;			// fine temperature, used to compensate the
+								// pressure and humidity readings
+		uint8_t chip_id;		// chip id read from the BME280
+		
+		bme_State state;				// step the background read is on
+		uint8_t fails;					// failed transactions in a row
+		twi_xfer xfer;					// background i2c transaction
+		uint32_t xfer_time;				// tick the transaction started at
+		uint32_t wait_until;			// tick the next step is due at
+		uint32_t sample_time;			// tick the last conversion started
+		uint16_t period;				// ms between measurements
+		uint8_t meas_ms;				// ms one conversion takes
+		uint8_t buf[BME280_BUF_SIZE];	// data read in the background
 		
+		BME280_Settings cfg;			// sampling settings in use
+		bool reconfig;					// cfg changed, write it to sensor
+		uint8_t cmd[BME280_CFG_CMD_LEN];// data written in the background
+
 		// this method sets the mode of operation of the BME280
 		bool set_mode (op_Mode mode);
 		
@@ -338,15 +466,50 @@ class BME280
 		int32_t convert_pressure (void);
 		int32_t convert_temperature (void);
 		uint32_t convert_humidity (void);
+		
+		// these methods work out readings derived from the converted ones
+		int32_t calc_vapor (void);
+		int32_t calc_dew_point (int32_t vapor);
+		uint16_t calc_abs_humidity (int32_t vapor);
+		int32_t calc_heat_index (void);
+		uint32_t calc_sea_level (void);
 
 		// this method reads in the static calibration data
 		bool read_cal (void);
 		
+		// these methods load and store the calibration data EEPROM cache
+		bool load_cal (const uint8_t *fprint);
+		void save_cal (void);
+		
+		// these methods unpack the raw register data read from the BME280
+		void parse_data (const uint8_t *data);
+		void parse_cal (const uint8_t *data1, const uint8_t *data2);
+		
+		// this method starts the background transaction for the current step
+		void start_step (void);
+		
+		// this method moves on once the current step's transaction is done
+		void next_step (uint32_t now);
+		
+		// this method works out how long a conversion takes in us
+		static uint32_t meas_time (uint8_t ctrl_hum, uint8_t ctrl_meas);
+		
+		// this method fills cmd with the writes that set up the sensor
+		void fill_cfg_cmd (void);
+		
+		// this method applies a change to the sampling settings
+		void update_cfg (void);
+		
+		// this method updates the shared sensor values
+		void publish (void);
+		
 	public:
 		// No public class variables
 
-		// this constructor sets up a BME280 sensor
-		BME280 (i2c* ptr_i2c, serial* ptr_serial, int32_t temperature_cal);
+		// this constructor sets up a BME280 sensor measuring every period ms
+		// with the given sampling profile
+		BME280 (i2c* ptr_i2c, serial* ptr_serial, int32_t temperature_cal,
+				uint16_t sample_period, bme_Profile profile);
 
 		// this method initializes the BME280
 		bool init (void);
@@ -362,13 +525,27 @@ class BME280
 		int32_t get_temperature (void)		{ return temperature;	};
 		int32_t get_humidity (void)			{ return humidity;		};
 		int32_t get_temp_cal (void)			{ return temp_cal;		};
+		int32_t get_dew_point (void)		{ return dew_point;		};
+		uint16_t get_abs_humidity (void)	{ return abs_hum;		};
+		int32_t get_heat_index (void)		{ return heat_index;	};
+		uint32_t get_sea_level (void)		{ return sea_level;		};
 
 		int32_t get_raw_pressure(void)		{ return raw_pres;		};
 		int32_t get_raw_temperature(void)	{ return raw_temp;		};
 		uint32_t get_raw_humidity(void)		{ return raw_hum;		};
 			
+		uint8_t get_meas_ms (void)			{ return meas_ms;		};
+			
 		// setter methods
 		void set_temp_cal (int32_t new_temp_cal);
+		
+		// these methods change the sampling settings, they are written to
+		// the sensor before the next measurement
+		bool set_profile (bme_Profile profile);
+		void set_hum_ovsm (uint8_t h_ovsm);
+		void set_pres_ovsm (uint8_t p_ovsm);
+		void set_temp_ovsm (uint8_t t_ovsm);
+		void set_filter (uint8_t fltr);
 			
 		// task method
 		void BME280Task (void);
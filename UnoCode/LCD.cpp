@@ -289,8 +289,10 @@ LCD::LCD (void)
 	spi_init();
 	setup_lcd();
 	
-	sprintf(surfStr, "Surf:%02ld.%02ld", surf_temp / 100, surf_temp % 100);
-	sprintf(subStr, "Sub:%02ld.%02ld", sub_temp / 100, sub_temp % 100);
+	sprintf(surfStr, "Surf:%02d.%02d", water_temps[WATER_SURFACE] / 100,
+			water_temps[WATER_SURFACE] % 100);
+	sprintf(subStr, "Sub:%02d.%02d", water_temps[WATER_UNDERWATER] / 100,
+			water_temps[WATER_UNDERWATER] % 100);
 	sprintf(extStr, "Ext:%02ld.%02ld", ext_temp / 100, ext_temp % 100);
 	sprintf(humStr, "Hum:%02lu.%02lu", ext_hum / 1024, ext_hum % 1024);
 
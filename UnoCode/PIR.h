@@ -9,7 +9,6 @@
 
 #define F_CPU 16000000UL
 
-#include <stdio.h>
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <util/delay.h>
@@ -9,7 +9,6 @@
 
 #define F_CPU 16000000UL
 
-#include <stdio.h>
 #include <avr/io.h>
 #include <util/delay.h>
 #include "serial.h"
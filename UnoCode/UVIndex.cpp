@@ -9,33 +9,54 @@
 
 #include "UVIndex.h"
 #include "shares.h"
+#include "scheduler.h"	// tick count for the sample period
+
+/* Sum and sum of squares of the samples taken by the ADC interrupt. Only the
+ * ISR touches them until uv_samples reaches 0. */
+static volatile uint16_t uv_sum;
+static volatile uint32_t uv_sum_sq;
 
 /*****************************************************************************
- * Method:		
- * Description:	
+ * Method:		UVIndex
+ * Description:	This constructor sets up the ADC and the sensor, and has the
+ *				first reading taken on the first run of the task.
  *
- * Parameters:	ptr_serial	- pointer to serial object for debugging
- *				pin			- the pin to be associated with the enable pin
+ * Parameters:	ptr_serial		- pointer to serial object for debugging
+ *				pin				- the pin to be associated with the enable pin
+ *				sample_period	- ms between readings
+ *				samples			- samples in each reading, see set_samples
  ****************************************************************************/
-UVIndex::UVIndex (serial *ptr_serial, uint8_t pin)
+UVIndex::UVIndex (serial *ptr_serial, uint8_t pin, uint16_t sample_period,
+				  uint8_t samples)
 {
 	p_serial = ptr_serial;
 	enable_pin = pin;
+	period = sample_period;
+	
+	state = UV_IDLE;
+	wait_until = scheduler::ticks();
+	mean = 0;
+	mean_bits = UV_ADC_BITS;
+	variance = 0;
+	set_samples(samples);
 	
-	init();	
+	init();
+	disable();
 }
 
 /*****************************************************************************
  * Method:		init
  * Description:	This method initializes the internal Analog to Digital 
  *				Converter (ADC) to use a prescaler of 128 with no auto trigger
- *				and a gain of 1X
+ *				and a gain of 1X. At 16 MHz a conversion takes 104 us.
  ****************************************************************************/
 void UVIndex::init (void)
 {
-	ADCSRA = 0x87;	//Turn On ADC and set prescaler (CLK/128)
-	ADCSRB = 0x00;	//Set gain & turn off auto trigger
-	ADMUX = 0x00;   //Set ADC channel ADC0 with 1X gain
+	// turn on ADC and set prescaler (CLK/128)
+	ADCSRA = (1 << ADEN) | (1 << ADIF) | (1 << ADPS2) | (1 << ADPS1) | 
+			 (1 << ADPS0);
+	ADCSRB = 0x00;				// turn off auto trigger
+	ADMUX = UV_ADC_CHANNEL;		// set ADC channel with 1X gain
 }
 
 /*****************************************************************************
@@ -63,56 +84,167 @@ void UVIndex::disable (void)
 }
 
 /*****************************************************************************
- * Method:		read
- * Description:	This method reads a single value from the UVIndex Sensor. The
- *				sensor is first enabled, then a delay is included for the 
- *				stabilization period. Once a reading has been collected, the
- *				sensor is disabled.
+ * Method:		set_samples
+ * Description:	This method sets the number of samples in each reading. It
+ *				is rounded down to a power of 2 and held to 4 to 64.
  *
- * Return:		int16_t - the digital value of the analog read of the UV Index
- *					where a value of 302 is equivalent to 3.02
+ * Parameters:	samples - the samples to take for each reading
  ****************************************************************************/
-int16_t UVIndex::read (void)
+void UVIndex::set_samples (uint8_t samples)
 {
-	int16_t value;
-	
-	enable();
-	
-	// stabilization period
-	_delay_ms(1);
+	if (samples < UV_MIN_SAMPLES)
+	{
+		samples = UV_MIN_SAMPLES;
+	}
+	else if (samples > UV_MAX_SAMPLES)
+	{
+		samples = UV_MAX_SAMPLES;
+	}
 	
-	// start conversion
-	ADCSRA = 0xC7;
+	shift = 0;
+	while ((samples >>= 1) != 0)
+	{
+		shift++;
+	}
+}
+
+/*****************************************************************************
+ * Method:		start_samples
+ * Description:	This method clears the sums and turns the ADC interrupt on.
+ *				The scheduler starts each conversion the next time it 
+ *				sleeps, in ADC noise reduction mode when it can, so the
+ *				samples are taken between runs of the other tasks.
+ ****************************************************************************/
+void UVIndex::start_samples (void)
+{
+	uv_sum = 0;
+	uv_sum_sq = 0;
 	
-	// wait for conversion to finish
-	_delay_us(260);
+	// clear any old result and turn the conversion interrupt on
+	ADCSRA |= (1 << ADIF) | (1 << ADIE);
+	uv_samples = (1 << shift);
+}
+
+/*****************************************************************************
+ * Method:		end_samples
+ * Description:	This method works the reading out from the samples. Adding 
+ *				4^n samples and dropping n bits of the sum gives n bits more
+ *				than one conversion, so long as there is at least a count of 
+ *				noise on the input to spread the samples over codes. The
+ *				variance shows how much the samples spread.
+ *				uv_ndx keeps its scale, it is the mean rounded to a count.
+ *				The oversampled mean goes out as uv_mean with its 
+ *				resolution in uv_mean_bits.
+ ****************************************************************************/
+void UVIndex::end_samples (void)
+{
+	uint16_t sum = uv_sum;
+	uint32_t spread;
+	uint8_t extra = shift >> 1;
 	
-	value = ADC & 0x3FF;
+	// oversampled mean
+	mean = sum >> (shift - extra);
+	mean_bits = UV_ADC_BITS + extra;
 	
-	disable();
+	// N * sum of squares - sum^2 is N^2 times the variance, it fits in 32
+	// bits for up to 64 samples of 10 bits
+	spread = (uv_sum_sq << shift) - (uint32_t)sum * sum;
+	variance = (spread >> (2 * shift)) * 100 + 
+			   (((spread & ((1UL << (2 * shift)) - 1)) * 100) >> (2 * shift));
 	
-	return value;
+	// update global values
+	uv_ndx = (sum + (1 << (shift - 1))) >> shift;
+	uv_var = (variance > UINT16_MAX) ? UINT16_MAX : (uint16_t)variance;
+	uv_mean = mean;
+	uv_mean_bits = mean_bits;
 }
 
 /*****************************************************************************
  * Method:		UVIndexTask
- * Description:	This method is run once every loop of the main control and 
- *				triggers the sensor to take a reading and store the value so
- *				it can be used by other objects.
+ * Description:	This method runs the UVIndex task. Once every sample period
+ *				it enables the sensor, lets the output settle, then has the 
+ *				samples taken while the main loop is asleep between tasks.
+ *				With the default 16 samples that takes about 2 ms when 
+ *				nothing else is running. The task should be run every few ms
+ *				so the reading is picked up soon after the last sample.
  ****************************************************************************/
 void UVIndex::UVIndexTask (void)
 {
-	static uint8_t runs  = 0;
+	uint32_t now = scheduler::ticks();
 	
-	// update global value
-	uv_ndx = read();
+	switch (state)
+	{
+		case UV_IDLE:
+			if ((int32_t)(now - wait_until) < 0)
+			{
+				break;
+			}
+			
+			wait_until += period;
+			if ((int32_t)(now - wait_until) >= 0)
+			{
+				// fell behind, start the period over from now
+				wait_until = now + period;
+			}
+			
+			enable();
+			
+			// a tick may be about to pass, so wait one more to be sure
+			settle_until = now + UV_SETTLE_MS + 1;
+			state = UV_SETTLE;
+			break;
+		
+		case UV_SETTLE:
+			if ((int32_t)(now - settle_until) < 0)
+			{
+				break;
+			}
+			
+			start_samples();
+			state = UV_SAMPLE;
+			break;
+		
+		case UV_SAMPLE:
+		default:
+			if (uv_samples != 0)
+			{
+				// still sampling
+				break;
+			}
+			
+			disable();
+			end_samples();
+			
+			//DBG(this->p_serial, "UV Index reading: %d var: %u\r\n", uv_ndx,
+			//	uv_var);
+			state = UV_IDLE;
+			break;
+	}
+}
+
+/*****************************************************************************
+ * ISR:			ADC_vect
+ * Description:	This ISR adds each finished conversion to the sums, and 
+ *				turns itself off once every sample has been taken. It also
+ *				wakes the CPU from ADC noise reduction sleep, and flags that
+ *				it ran for the scheduler.
+ ****************************************************************************/
+ISR (ADC_vect)
+{
+	uint16_t sample = ADC & 0x3FF;
+	
+	adc_woke = 1;
+	
+	if (uv_samples == 0)
+	{
+		return;
+	}
 	
-	/*
-	if ((runs % 5) == 0)
+	uv_sum += sample;
+	uv_sum_sq += (uint32_t)sample * sample;
+	
+	if (--uv_samples == 0)
 	{
-		DBG(this->p_serial, "\r\nUVIndex Task Running\r\n")
-		DBG(this->p_serial, "UV Index reading: %d\r\n", read());
+		ADCSRA &= ~(1 << ADIE);
 	}
-	*/
-	runs++;
-}
\ No newline at end of file
+}
@@ -27,10 +27,32 @@
 #define UV_EN_PORT		PORTD
 #define UV_EN_PIN		PIND
 
+// ADC input the sensor output is on, and the bits in a single conversion
+#define UV_ADC_CHANNEL	0
+#define UV_ADC_BITS		10
+
+// Samples averaged into each reading, a power of 2 from 4 to 64. Every 4x
+// the samples gives one more bit of resolution.
+#define UV_MIN_SAMPLES	4
+#define UV_MAX_SAMPLES	64
+#ifndef UV_DEF_SAMPLES
+#define UV_DEF_SAMPLES	16
+#endif
+
+// Time the sensor output takes to settle after it is enabled, in ms
+#define UV_SETTLE_MS	1
+
+// Task steps: wait for the next sample period, let the sensor settle, then
+// wait for the ADC interrupt to take every sample
+enum uv_State {UV_IDLE, UV_SETTLE, UV_SAMPLE};
+
 /*****************************************************************************
  * Class:		UVIndex
  * Description:	The UVIndex class controls an analog sensor that detects the
- *				UV index of its environment.
+ *				UV index of its environment. Each reading is the mean of a 
+ *				burst of samples taken by the ADC conversion complete 
+ *				interrupt. The conversions are run while the scheduler 
+ *				sleeps, in ADC noise reduction mode when it can.
  ****************************************************************************/
 class UVIndex
 {
@@ -42,6 +64,26 @@ class UVIndex
 		
 		uint8_t enable_pin;	// enable pin that is used to turn on/off the sensor
 		
+		// step the task is on
+		uv_State state;
+		
+		// ms between readings and the tick the next one is due at
+		uint16_t period;
+		uint32_t wait_until;
+		
+		// tick the sensor output has settled at
+		uint32_t settle_until;
+		
+		// samples in each reading, as a power of 2
+		uint8_t shift;
+		
+		// mean of the last reading with the extra bits the samples give,
+		// its resolution in bits and the variance of its samples in 
+		// counts^2 * 100
+		uint16_t mean;
+		uint8_t mean_bits;
+		uint32_t variance;
+		
 		// This method initializes the internal ADC and sets the sensor
 		// to standby mode
 		void init (void);
@@ -54,18 +96,32 @@ class UVIndex
 		// sensor into standby mode
 		void disable (void);
 		
-		// This method collects a data reading from the UVIndex
-		int16_t read (void);
+		// This method sets the number of samples in each reading
+		void set_samples (uint8_t samples);
+		
+		// This method starts the ADC interrupt taking the samples
+		void start_samples (void);
+		
+		// This method works the reading out from the samples taken
+		void end_samples (void);
 		
 	public:
 		// no public class variables
 		
-		// This constructor creates a UVIndex sensor object
-		UVIndex(serial *ptr_serial, uint8_t pin);
+		// This constructor creates a UVIndex sensor object that takes a 
+		// reading every sample_period ms from the given number of samples
+		UVIndex(serial *ptr_serial, uint8_t pin, uint16_t sample_period,
+				uint8_t samples);
 		
 		// This method collects a sample from the UVIndex sensor when called
 		// from main
 		void UVIndexTask();
+		
+		// Getter Methods
+		uint16_t get_mean (void)		{ return mean;				};
+		uint8_t get_mean_bits (void)	{ return mean_bits;			};
+		uint32_t get_variance (void)	{ return variance;			};
+		uint8_t get_samples (void)		{ return (1 << shift);		};
 };
 
 
@@ -9,20 +9,160 @@
 #include "i2c.h"
 #include "shares.h"
 
+/* Background transaction state, shared with the TWI interrupt */
+static twi_xfer * volatile twi_cur = NULL;	// running transaction, or NULL
+static volatile uint8_t twi_ndx = 0;		// next byte to write or read
+static volatile bool twi_rd = false;		// in the read part of twi_cur
+
+/* Transactions waiting for the bus, oldest first, shared with the ISR */
+static twi_xfer *twi_queue[I2C_QUEUE_SIZE];
+static volatile uint8_t twi_q_len = 0;
+
+/* Bit rate settings for the bus clock and for slow transactions */
+static uint8_t twi_br = 0;				// TWBR for the bus clock
+static uint8_t twi_ps = 0;				// TWPS for the bus clock
+static uint8_t twi_slow_br = 0;			// TWBR for slow transactions
+static uint8_t twi_slow_ps = 0;			// TWPS for slow transactions
+
+/* Error counters for each device, shared with the TWI interrupt */
+static i2c_stats twi_stats[I2C_MAX_DEVS];
+
+// TWCR value to let the bus carry on with the interrupt enabled
+#define TWCR_NEXT	((1 << TWINT) | (1 << TWEN) | (1 << TWIE))
+
+/*****************************************************************************
+ * Function:	twi_rate
+ * Description:	This function works out the bit rate register and prescaler
+ *				that give an SCL frequency as close to the target as possible
+ *				without going over it, or F_CPU / 16 for any target above
+ *				that. The smallest prescaler that can reach the target is 
+ *				used, since it gives the finest steps.
+ * 
+ * Parameters:	scl	 - the target SCL frequency in Hz
+ *				p_br - returns the TWBR setting
+ *				p_ps - returns the TWPS setting
+ * Return:		uint32_t - the SCL frequency the settings give, or 0 if the
+ *						   target is too slow to reach
+ ****************************************************************************/
+static uint32_t twi_rate (uint32_t scl, uint8_t *p_br, uint8_t *p_ps)
+{
+	uint32_t div;
+	uint32_t br;
+	
+	if (scl == 0)
+	{
+		return 0;
+	}
+	
+	// total divider needed, rounded up so the rate does not go over
+	div = (F_CPU + scl - 1) / scl;
+	div = (div > TWI_SCL_BASE ? div - TWI_SCL_BASE : 0);
+	
+	for (uint8_t ps = 0; ps <= TWI_MAX_PS; ps++)
+	{
+		// 2 * 4^ps
+		uint8_t step = 2 << (2 * ps);
+		
+		br = (div + step - 1) / step;
+		
+		if (br <= 0xFF)
+		{
+			*p_br = (uint8_t)br;
+			*p_ps = ps;
+			
+			return F_CPU / (TWI_SCL_BASE + (br * step));
+		}
+	}
+	
+	return 0;
+}
+
+/*****************************************************************************
+ * Function:	twi_count
+ * Description:	This function counts a bus error against the device at the
+ *				given address. Each new device takes the next free entry of
+ *				the stats table, errors from devices beyond the size of the
+ *				table are not counted.
+ * 
+ * Parameters:	addr  - the address of the device
+ *				event - the kind of error
+ ****************************************************************************/
+static void twi_count (uint8_t addr, i2c_Event event)
+{
+	addr &= ~READ_BIT;
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		for (uint8_t ndx = 0; ndx < I2C_MAX_DEVS; ndx++)
+		{
+			i2c_stats *p_stats = &twi_stats[ndx];
+			
+			if (p_stats->addr != addr && p_stats->addr != 0)
+			{
+				continue;
+			}
+			
+			p_stats->addr = addr;
+			
+			switch (event)
+			{
+				case I2C_EV_NACK:
+					p_stats->nacks++;
+					break;
+				case I2C_EV_TIMEOUT:
+					p_stats->timeouts++;
+					break;
+				case I2C_EV_RECOVERY:
+				default:
+					p_stats->recoveries++;
+					break;
+			}
+			
+			break;
+		}
+	}
+}
+
+/*****************************************************************************
+ * Function:	twi_stop_wait
+ * Description:	This function waits for a stop condition that has been
+ *				requested to finish going out on the bus. A new start
+ *				condition can not be requested until it has.
+ * 
+ * Return:		bool - status of operation (true = error, false = success)
+ ****************************************************************************/
+static bool twi_stop_wait (void)
+{
+	for (uint16_t twcnt = 0; TWCR & (1 << TWSTO); twcnt++)
+	{
+		if (twcnt > TW_TIMEOUT)
+		{
+			return true;
+		}
+	}
+	
+	return false;
+}
+
 /*****************************************************************************
  * Method:		i2c
  * Description:	This constructor sets up the i2c protocol on the ATmega328P
- *				to operate at a frequency of 200kHz
+ *				to operate at the given bus clock frequency
  * 
  * Parameters:	ptr_serial - a reference to the serial debug object
+ *				scl		   - the bus clock frequency in Hz, e.g. I2C_FAST
  ****************************************************************************/
-i2c::i2c (serial *ptr_serial)
+i2c::i2c (serial *ptr_serial, uint32_t scl)
 {
 	p_serial = ptr_serial;	// store a local copy of serial pointer for debug
+	bus_clk = 0;
+	timed_out = false;
 	
-	// set the bit rate to 200kHz, with no prescaler
-	TWSR = 0x00;
-	TWBR = 32;
+	// set the bit rate, falling back to standard mode if it can not be hit
+	if (set_clock(scl))
+	{
+		set_clock(I2C_STANDARD);
+	}
 	
 	// enable i2c protocol
 	TWCR = (1 << TWEN);
@@ -30,6 +170,47 @@ i2c::i2c (serial *ptr_serial)
 	//DBG(this->p_serial, "i2c constructor OK!\r\n");
 }
 
+/*****************************************************************************
+ * Method:		set_clock
+ * Description:	This method sets the bus clock as close to the target as the
+ *				bit rate register and prescaler allow without going over it.
+ *				The rate actually set is returned by get_clock. Transactions
+ *				marked slow run at standard mode, or at the bus clock if that
+ *				is already slower. Must not be called while a background
+ *				transaction is running.
+ * 
+ * Parameters:	scl  - the target bus clock frequency in Hz
+ * Return:		bool - status of operation (true = error, false = success)
+ ****************************************************************************/
+bool i2c::set_clock (uint32_t scl)
+{
+	uint8_t br;
+	uint8_t ps;
+	uint32_t actual;
+	
+	if (busy() || (actual = twi_rate(scl, &br, &ps)) == 0)
+	{
+		// target too slow to reach, or bus in use
+		return true;
+	}
+	
+	twi_br = br;
+	twi_ps = ps;
+	bus_clk = actual;
+	
+	if (scl <= I2C_STANDARD || twi_rate(I2C_STANDARD, &twi_slow_br,
+										&twi_slow_ps) == 0)
+	{
+		twi_slow_br = twi_br;
+		twi_slow_ps = twi_ps;
+	}
+	
+	TWBR = twi_br;
+	TWSR = twi_ps;
+	
+	return false;
+}
+
 /*****************************************************************************
  * Method:		ping
  * Description:	This method pings an address and checks if there is a response
@@ -40,7 +221,11 @@ i2c::i2c (serial *ptr_serial)
 bool i2c::ping (uint8_t addr)
 {
 	bool sign_of_life;
-	start();
+	
+	if (start())
+	{
+		return false;
+	}
 	sign_of_life = write_byte(addr);
 	stop();
 	
@@ -49,12 +234,26 @@ bool i2c::ping (uint8_t addr)
 
 /*****************************************************************************
  * Method:		start
- * Description:	This method puts the start signal on the i2c bus
+ * Description:	This method puts the start signal on the i2c bus. It fails if
+ *				a background transaction is using the bus.
  * 
  * Return:		bool - status of operation (true = error, false = success)
  ****************************************************************************/
 bool i2c::start (void)
 {
+	// the bus belongs to the background transaction until it finishes
+	if (busy())
+	{
+		return true;
+	}
+	
+	if (twi_stop_wait())
+	{
+		// the last stop never went out, something is holding the bus
+		timed_out = true;
+		return true;
+	}
+	
 	// put a start condition on the line
 	TWCR = ((1 << TWSTA) | (1 << TWEN) | (1 << TWINT));
 	
@@ -66,6 +265,7 @@ bool i2c::start (void)
 		{
 			// timeout occurred, error
 			//DBG(this->p_serial, "i2c::start FAILED - timed out\r\n");
+			timed_out = true;
 			return true;
 		}
 	}
@@ -100,6 +300,7 @@ bool i2c::restart (void)
 		{
 			// timeout occurred, error
 			//DBG(this->p_serial, "i2c::restart FAILED - timed out\r\n");
+			timed_out = true;
 			return true;
 		}
 	}
@@ -133,7 +334,8 @@ bool i2c::stop (void)
  *				the status code generated by writing the data
  * 
  * Parameters:	data - the byte of data being written to the bus
- * Return:		bool - status of operation (true = ack, false = nack)
+ * Return:		bool - status of operation (true = ack, false = nack or
+ *													   timeout)
  ****************************************************************************/
 bool i2c::write_byte (uint8_t data)
 {	
@@ -149,7 +351,8 @@ bool i2c::write_byte (uint8_t data)
 		{
 			// timeout occurred, error
 			//DBG(this->p_serial, "i2c::write_byte FAILED - timed out\r\n");
-			return true;
+			timed_out = true;
+			return false;
 		}
 	}
 	
@@ -201,6 +404,7 @@ uint8_t i2c::read_byte (bool ack)
 		{
 			// timeout occurred, error
 			//DBG(this->p_serial, "i2c::read_byte FAILED - timed out\r\n");
+			timed_out = true;
 			return 0xFF;
 		}
 	}
@@ -220,19 +424,9 @@ uint8_t i2c::read_byte (bool ack)
  ****************************************************************************/
 bool i2c::write (uint8_t addr, uint8_t reg, uint8_t data)
 {
-	start();
-	if (!write_byte(addr) || !write_byte(reg) || !write_byte(data))
-	{
-		// an error occurred, one of these had a NACK
-		//DBG(this->p_serial,
-		//	"NACK on write <addr:0x%2X, reg:0x%2X, data:0x%2X>\r\n",
-		//	addr, reg, data);
-		return true;
-	}
-	stop();
+	uint8_t cmd[2] = {reg, data};
 	
-	// all good, success!
-	return false;
+	return retry(addr, cmd, sizeof(cmd), NULL, 0, NULL, 0);
 }
 
 /*****************************************************************************
@@ -247,28 +441,150 @@ bool i2c::write (uint8_t addr, uint8_t reg, uint8_t data)
  ****************************************************************************/
 bool i2c::write (uint8_t addr, uint8_t reg, uint8_t* p_buff, uint8_t count)
 {
-	start();
-	if (!write_byte(addr) || !write_byte(reg))
+	return retry(addr, &reg, 1, p_buff, count, NULL, 0);
+}
+
+/*****************************************************************************
+ * Method:		write_read
+ * Description:	This method writes bytes to a device and then reads bytes 
+ *				back from it as one combined transaction. The tx bytes are
+ *				normally the register to start reading from. The read part
+ *				follows a repeated start, so the bus is never released in
+ *				between and no other master can get in. With nothing to
+ *				write the read starts straight away, and with nothing to read
+ *				it is a plain write. Failed transactions are retried.
+ * 
+ * Parameters:	addr - the address of the i2c device
+ *				tx	 - the bytes to write to the device
+ *				ntx	 - the number of bytes to write
+ *				rx	 - the buffer to hold the bytes read back
+ *				nrx	 - the number of bytes to read
+ * Return:		bool - status of operation (true = error, false = success)
+ ****************************************************************************/
+bool i2c::write_read (uint8_t addr, const uint8_t *tx, uint8_t ntx,
+					  uint8_t *rx, uint8_t nrx)
+{
+	return retry(addr, tx, ntx, NULL, 0, rx, nrx);
+}
+
+/*****************************************************************************
+ * Method:		retry
+ * Description:	This method runs a polled transaction, trying again up to 
+ *				I2C_MAX_TRIES times if it fails. Each failure is counted
+ *				against the device. After a timeout the bus is recovered
+ *				before the next try, since a device may be holding it. The
+ *				wait between tries starts at I2C_RETRY_US and doubles each 
+ *				time. Nothing is tried while a background transaction has
+ *				the bus.
+ * 
+ * Parameters:	see transfer
+ * Return:		bool - status of operation (true = error, false = success)
+ ****************************************************************************/
+bool i2c::retry (uint8_t addr, const uint8_t *tx1, uint8_t ntx1,
+				 const uint8_t *tx2, uint8_t ntx2, uint8_t *rx, uint8_t nrx)
+{
+	for (uint8_t tries = 0; !busy(); tries++)
+	{
+		timed_out = false;
+		
+		if (!transfer(addr, tx1, ntx1, tx2, ntx2, rx, nrx))
+		{
+			return false;
+		}
+		
+		if (timed_out)
+		{
+			twi_count(addr, I2C_EV_TIMEOUT);
+			twi_count(addr, I2C_EV_RECOVERY);
+			recover();
+		}
+		else
+		{
+			twi_count(addr, I2C_EV_NACK);
+		}
+		
+		if (tries + 1 >= I2C_MAX_TRIES)
+		{
+			break;
+		}
+		
+		// back off, doubling the wait each time
+		for (uint8_t wait = 0; wait < (1 << tries); wait++)
+		{
+			_delay_us(I2C_RETRY_US);
+		}
+	}
+	
+	return true;
+}
+
+/*****************************************************************************
+ * Method:		transfer
+ * Description:	This method runs one attempt at a polled transaction. The 
+ *				bytes in tx1 and then tx2 are written, then if there is 
+ *				anything to read a repeated start is sent and nrx bytes are
+ *				read back. With nothing to write the read starts straight 
+ *				away. A stop condition is always sent at the end, even after
+ *				an error, so the bus is never left held.
+ * 
+ * Parameters:	addr - the address of the i2c device
+ *				tx1	 - the first bytes to write, normally the register
+ *				ntx1 - the number of bytes in tx1
+ *				tx2	 - the bytes to write after tx1
+ *				ntx2 - the number of bytes in tx2
+ *				rx	 - the buffer to hold the bytes read back
+ *				nrx	 - the number of bytes to read
+ * Return:		bool - status of operation (true = error, false = success)
+ ****************************************************************************/
+bool i2c::transfer (uint8_t addr, const uint8_t *tx1, uint8_t ntx1,
+					const uint8_t *tx2, uint8_t ntx2, uint8_t *rx,
+					uint8_t nrx)
+{
+	bool err = false;
+	
+	if (start())
 	{
-		// an error occurred, one of these had a NACK
-		//DBG(this->p_serial, "NACK on write <addr:0x%2X, reg:0x%2X>\r\n",
-		//	addr, reg);
 		return true;
 	}
-	// write the data one byte at a time
-	for (uint8_t ndx = 0; ndx < count; ndx++)
+	
+	if (ntx1 || ntx2 || !nrx)
 	{
-		if (!write_byte(*p_buff++))
+		// write part
+		err = !write_byte(addr);
+		
+		for (uint8_t ndx = 0; !err && ndx < ntx1; ndx++)
 		{
-			// a NACK happened too early
-			//DBG(this->p_serial, "NACK on write data %u\r\n", ndx);
-			return true;
+			err = !write_byte(tx1[ndx]);
+		}
+		
+		for (uint8_t ndx = 0; !err && ndx < ntx2; ndx++)
+		{
+			err = !write_byte(tx2[ndx]);
+		}
+		
+		// switch to reading without letting go of the bus
+		if (!err && nrx)
+		{
+			err = restart();
+		}
+	}
+	
+	if (!err && nrx)
+	{
+		// read part
+		err = !write_byte(addr | READ_BIT);
+		
+		// ACK every byte but the last, which is NACKed to end the read
+		for (uint8_t ndx = 1; !err && ndx <= nrx; ndx++)
+		{
+			*rx++ = read_byte(ndx < nrx);
+			err = timed_out;
 		}
 	}
+	
 	stop();
 	
-	// all good, success
-	return false;
+	return err;
 }
 
 /*****************************************************************************
@@ -285,28 +601,10 @@ uint8_t i2c::read (uint8_t addr, uint8_t reg)
 {
 	uint8_t data;
 	
-	start();
-	// Write the register address that you are trying to read
-	if (!write_byte(addr) || !write_byte(reg))
+	if (write_read(addr, &reg, 1, &data, 1))
 	{
-		// an error occurred, one of these had a NACK
-		//DBG(this->p_serial, "Write NACK on read <addr:0x%2X, reg:0x%2X>\r\n",
-		//	addr, reg);
 		return 0xFF;
 	}
-	stop();
-	restart();
-	// read the info
-	if (!write_byte(addr | READ_BIT))
-	{
-		// an error occurred, a NACK was received
-		//DBG(this->p_serial, "NACK on read <addr:0x%2X>\r\n",
-		//	addr | READ_BIT);
-		return 0xFF;
-	}
-	// read byte with a NACK expected
-	data = read_byte(false);
-	stop();
 	
 	return data;
 }
@@ -324,34 +622,391 @@ uint8_t i2c::read (uint8_t addr, uint8_t reg)
  ****************************************************************************/
 bool i2c::read (uint8_t addr, uint8_t reg, uint8_t* p_buff, uint8_t count)
 {
-		start();
-		if (!write_byte(addr) || !write_byte(reg))
+	return write_read(addr, &reg, 1, p_buff, count);
+}
+
+/*****************************************************************************
+ * Function:	twi_load
+ * Description:	This function makes a transaction the running one and sets
+ *				the bus clock for it. The caller then requests the start 
+ *				condition. Must be called with interrupts disabled.
+ * 
+ * Parameters:	xfer - the transaction to run
+ ****************************************************************************/
+static void twi_load (twi_xfer *xfer)
+{
+	twi_cur = xfer;
+	twi_ndx = 0;
+	
+	// with nothing to write, go straight to reading
+	twi_rd = (xfer->ntx == 0 && xfer->nrx != 0);
+	
+	// slow transactions drop to standard mode until they finish
+	TWBR = (xfer->slow ? twi_slow_br : twi_br);
+	TWSR = (xfer->slow ? twi_slow_ps : twi_ps);
+}
+
+/*****************************************************************************
+ * Function:	twi_pop
+ * Description:	This function takes the oldest transaction off the queue.
+ *				Must be called with interrupts disabled.
+ * 
+ * Return:		twi_xfer* - the transaction, or NULL if the queue is empty
+ ****************************************************************************/
+static twi_xfer* twi_pop (void)
+{
+	twi_xfer *xfer;
+	
+	if (twi_q_len == 0)
+	{
+		return NULL;
+	}
+	
+	xfer = twi_queue[0];
+	twi_q_len--;
+	
+	for (uint8_t ndx = 0; ndx < twi_q_len; ndx++)
+	{
+		twi_queue[ndx] = twi_queue[ndx + 1];
+	}
+	
+	return xfer;
+}
+
+/*****************************************************************************
+ * Function:	twi_finish
+ * Description:	This function ends the running transaction and starts the
+ *				next one waiting in the queue, if there is one, so that 
+ *				transactions from different drivers run back to back. With
+ *				the queue empty the TWI interrupt is turned off so the polled
+ *				methods can use the bus again, and the bus clock is put back
+ *				in case the transaction was slow. Called from the TWI ISR.
+ * 
+ * Parameters:	state - the final state of the transaction
+ *				stop  - send a stop condition, false if the bus was lost
+ ****************************************************************************/
+static void twi_finish (twi_State state, bool stop)
+{
+	uint8_t twcr = ((1 << TWINT) | (1 << TWEN)) | (stop ? (1 << TWSTO) : 0);
+	twi_xfer *next = twi_pop();
+	
+	twi_cur->state = state;
+	twi_cur = NULL;
+	
+	if (next != NULL)
+	{
+		// a start after the stop, or once the bus is free again
+		twi_load(next);
+		twcr |= ((1 << TWSTA) | (1 << TWIE));
+	}
+	else
+	{
+		TWBR = twi_br;
+		TWSR = twi_ps;
+	}
+	
+	TWCR = twcr;
+}
+
+/*****************************************************************************
+ * Method:		begin
+ * Description:	This method submits a transaction to run in the background,
+ *				driven by the TWI interrupt, so the caller never waits on the
+ *				bus. If the bus is free the transaction starts straight away,
+ *				otherwise it waits in a queue of up to I2C_QUEUE_SIZE 
+ *				transactions and starts as soon as the ones ahead of it are
+ *				done. This lets several drivers share the bus. The state of 
+ *				the transaction is set to TWI_BUSY and is changed to TWI_DONE
+ *				or TWI_ERROR by the interrupt when it finishes. The polled 
+ *				methods fail while any transaction is running or queued. A 
+ *				slow transaction runs at standard mode.
+ * 
+ * Parameters:	xfer - the transaction to run
+ * Return:		bool - status of operation (true = error, false = success)
+ ****************************************************************************/
+bool i2c::begin (twi_xfer *xfer)
+{
+	bool err = false;
+	
+	if (xfer->state == TWI_BUSY)
+	{
+		// already running or queued, leave it alone
+		return true;
+	}
+	
+	// a new start can not be requested until the last stop is out
+	if (!busy() && twi_stop_wait())
+	{
+		xfer->state = TWI_ERROR;
+		return true;
+	}
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		if (twi_cur == NULL)
 		{
-			// an error occurred, one of these had a NACK
-			//DBG(this->p_serial, "Write NACK on read <addr:0x%2X, reg:0x%2X>\r\n",
-			//	addr, reg);
-			return true;
+			// bus is free, put a start condition on the line and the ISR
+			// takes it from there
+			xfer->state = TWI_BUSY;
+			twi_load(xfer);
+			TWCR = TWCR_NEXT | (1 << TWSTA);
 		}
-		stop();
-		restart();	// change?
-		// read the info
-		if (!write_byte(addr | READ_BIT))
+		else if (twi_q_len < I2C_QUEUE_SIZE)
 		{
-			// an error occurred, a NACK was received
-			//DBG(this->p_serial, "NACK on read <addr:0x%2X>\r\n",
-			//	addr | READ_BIT);
-			return 0xFF;
+			xfer->state = TWI_BUSY;
+			twi_queue[twi_q_len++] = xfer;
+		}
+		else
+		{
+			// queue full, the transaction is not started
+			xfer->state = TWI_ERROR;
+			err = true;
+		}
+	}
+	
+	return err;
+}
+
+/*****************************************************************************
+ * Method:		busy
+ * Description:	This method checks if a background transaction is running.
+ * 
+ * Return:		bool - true if a transaction is running, false if not
+ ****************************************************************************/
+bool i2c::busy (void)
+{
+	return (twi_cur != NULL);
+}
+
+/*****************************************************************************
+ * Method:		abort
+ * Description:	This method gives up on a background transaction, for 
+ *				example when a device holds the bus for too long. The 
+ *				transaction is marked as failed. If it was still waiting in 
+ *				the queue it is just taken out. If it was running it is 
+ *				counted as a timeout and the bus is recovered, then the next
+ *				transaction in the queue is started.
+ * 
+ * Parameters:	xfer - the transaction to give up on
+ ****************************************************************************/
+void i2c::abort (twi_xfer *xfer)
+{
+	bool hung = false;
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		if (xfer->state != TWI_BUSY)
+		{
+			// already finished
+		}
+		else if (twi_cur == xfer)
+		{
+			hung = true;
+			
+			twi_count(xfer->addr, I2C_EV_TIMEOUT);
+			twi_count(xfer->addr, I2C_EV_RECOVERY);
+			
+			twi_cur = NULL;
+		}
+		else
+		{
+			// take it out of the queue, keeping the order of the rest
+			uint8_t out = 0;
+			
+			for (uint8_t ndx = 0; ndx < twi_q_len; ndx++)
+			{
+				if (twi_queue[ndx] != xfer)
+				{
+					twi_queue[out++] = twi_queue[ndx];
+				}
+			}
+			
+			twi_q_len = out;
+		}
+		
+		xfer->state = TWI_ERROR;
+	}
+	
+	if (hung)
+	{
+		recover();
+		
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		{
+			twi_xfer *next = twi_pop();
+			
+			if (next != NULL)
+			{
+				twi_load(next);
+				TWCR = TWCR_NEXT | (1 << TWSTA);
+			}
+		}
+	}
+}
+
+/*****************************************************************************
+ * Method:		recover
+ * Description:	This method frees a bus that a device is holding, e.g. a 
+ *				device that was reset or glitched part way through sending a
+ *				byte and is still driving SDA low. The TWI is turned off so 
+ *				the pins can be driven directly, then SCL is clocked up to 
+ *				nine times until the device lets go of SDA. A stop condition
+ *				is then sent by hand and the TWI is set up again. The pins 
+ *				are only ever driven low or released, the pull ups on the bus
+ *				take them high.
+ * 
+ * Return:		bool - status of operation (true = bus still held,
+ *												false = bus free)
+ ****************************************************************************/
+bool i2c::recover (void)
+{
+	// take the pins back from the TWI, released to start with
+	TWCR = 0;
+	I2C_PORT &= ~((1 << I2C_SDA) | (1 << I2C_SCL));
+	I2C_DDR &= ~((1 << I2C_SDA) | (1 << I2C_SCL));
+	_delay_us(I2C_RECOVER_US);
+	
+	// clock out the rest of the byte the device is stuck sending
+	for (uint8_t clk = 0;
+		 clk < I2C_RECOVER_CLKS && !(I2C_PIN & (1 << I2C_SDA)); clk++)
+	{
+		I2C_DDR |= (1 << I2C_SCL);
+		_delay_us(I2C_RECOVER_US);
+		I2C_DDR &= ~(1 << I2C_SCL);
+		_delay_us(I2C_RECOVER_US);
+	}
+	
+	// stop condition, SDA rises while SCL is high
+	I2C_DDR |= (1 << I2C_SCL);
+	_delay_us(I2C_RECOVER_US);
+	I2C_DDR |= (1 << I2C_SDA);
+	_delay_us(I2C_RECOVER_US);
+	I2C_DDR &= ~(1 << I2C_SCL);
+	_delay_us(I2C_RECOVER_US);
+	I2C_DDR &= ~(1 << I2C_SDA);
+	_delay_us(I2C_RECOVER_US);
+	
+	// set the TWI back up
+	TWBR = twi_br;
+	TWSR = twi_ps;
+	TWCR = (1 << TWEN);
+	
+	return ((I2C_PIN & ((1 << I2C_SDA) | (1 << I2C_SCL))) 
+			!= ((1 << I2C_SDA) | (1 << I2C_SCL)));
+}
+
+/*****************************************************************************
+ * Method:		get_stats
+ * Description:	This method copies the error counters of every device that
+ *				has had an error into a stats frame payload. Each device
+ *				takes I2C_STATS_LEN bytes, see serial.h for the layout.
+ * 
+ * Parameters:	buff - the buffer to copy the counters into
+ *				size - the size of the buffer
+ * Return:		uint8_t - the number of bytes copied
+ ****************************************************************************/
+uint8_t i2c::get_stats (uint8_t *buff, uint8_t size)
+{
+	uint8_t *p = buff;
+	i2c_stats stats;
+	
+	for (uint8_t ndx = 0; ndx < I2C_MAX_DEVS; ndx++)
+	{
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		{
+			stats = twi_stats[ndx];
 		}
 		
-		// Read the data
-		for (uint8_t ndx = 1; ndx < count; ndx++)
+		if (stats.addr == 0 || (p - buff) + I2C_STATS_LEN > size)
 		{
-			// still have more to read, so expect an ACK
-			*p_buff++ = read_byte(true);
+			break;
 		}
-		// Read last bit of data, so expect a NACK
-		*p_buff++ = read_byte(false);
-		stop();
 		
-		return false;
-}
\ No newline at end of file
+		p = serial::put_le(p, stats.addr, 1);
+		p = serial::put_le(p, stats.nacks, 2);
+		p = serial::put_le(p, stats.timeouts, 2);
+		p = serial::put_le(p, stats.recoveries, 2);
+	}
+	
+	return (uint8_t)(p - buff);
+}
+
+/*****************************************************************************
+ * ISR:			TWI_vect
+ * Description:	This ISR steps the background transaction along each time
+ *				the TWI hardware finishes a bus operation, based on the status
+ *				code it reports. The write part sends the device address and
+ *				the tx bytes, then a repeated start switches to the read part,
+ *				which ACKs every byte but the last.
+ ****************************************************************************/
+ISR (TWI_vect)
+{
+	twi_xfer *xfer = twi_cur;
+	
+	if (xfer == NULL)
+	{
+		// nothing running, turn the interrupt back off
+		TWCR = (1 << TWEN);
+		return;
+	}
+	
+	switch (TWSR & STAT_MSK)
+	{
+		case STAT_START:
+		case STAT_RESTART:
+			// send the device address for this part of the transaction
+			TWDR = (twi_rd ? (xfer->addr | READ_BIT) : xfer->addr);
+			TWCR = TWCR_NEXT;
+			break;
+		
+		case STAT_WRITE_ACK:
+		case STAT_TRANS_ACK:
+			if (twi_ndx < xfer->ntx)
+			{
+				// more bytes to write
+				TWDR = xfer->tx[twi_ndx++];
+				TWCR = TWCR_NEXT;
+			}
+			else if (xfer->nrx)
+			{
+				// done writing, repeated start for the read part
+				twi_rd = true;
+				TWCR = TWCR_NEXT | (1 << TWSTA);
+			}
+			else
+			{
+				twi_finish(TWI_DONE, true);
+			}
+			break;
+		
+		case STAT_READ_ACK:
+			// device answered its read address, ACK unless only one byte
+			twi_ndx = 0;
+			TWCR = TWCR_NEXT | (xfer->nrx > 1 ? (1 << TWEA) : 0);
+			break;
+		
+		case STAT_REC_ACK:
+			xfer->rx[twi_ndx++] = TWDR;
+			
+			// NACK the last byte so the device lets go of the bus
+			TWCR = TWCR_NEXT | ((twi_ndx + 1) < xfer->nrx ? (1 << TWEA) : 0);
+			break;
+		
+		case STAT_REC_NACK:
+			// last byte of the read
+			xfer->rx[twi_ndx++] = TWDR;
+			twi_finish(TWI_DONE, true);
+			break;
+		
+		case STAT_BAD:
+			// arbitration lost, release the bus without a stop condition
+			twi_finish(TWI_ERROR, false);
+			break;
+		
+		default:
+			// a NACK on an address or data byte
+			twi_count(xfer->addr, I2C_EV_NACK);
+			twi_finish(TWI_ERROR, true);
+			break;
+	}
+}
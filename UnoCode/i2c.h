@@ -9,14 +9,47 @@
 
 #define F_CPU 16000000UL
 
-#include <stdio.h>
 #include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
 #include <util/delay.h>
 #include "serial.h"
 
 #define TW_TIMEOUT	1024
 #define READ_BIT	0x01
 
+/* Bus clock (SCL) frequencies in Hz */
+#define I2C_STANDARD	100000UL	// standard mode, long cables
+#define I2C_FAST		400000UL	// fast mode, the BME280 default
+
+/* Bus pins, used directly to free a stuck bus */
+#define I2C_DDR			DDRC
+#define I2C_PORT		PORTC
+#define I2C_PIN			PINC
+#define I2C_SDA			4
+#define I2C_SCL			5
+
+/* Bus recovery and retries */
+#define I2C_RECOVER_CLKS	9		// clocks to free a device stuck mid-byte
+#define I2C_RECOVER_US		5		// half an SCL period at 100kHz
+#define I2C_MAX_TRIES		3		// attempts at a polled transaction
+#define I2C_RETRY_US		100		// first backoff, doubles on each retry
+
+/* Background transactions that can wait for the bus behind the running one */
+#ifndef I2C_QUEUE_SIZE
+#define I2C_QUEUE_SIZE	4
+#endif
+
+/* Devices with their own error counters, further devices are not counted */
+#define I2C_MAX_DEVS	2
+
+// size of one device's error counters in the stats frame
+#define I2C_STATS_LEN	7
+
+/* SCL = F_CPU / (16 + 2 * TWBR * 4^TWPS) */
+#define TWI_SCL_BASE	16			// fixed part of the divider
+#define TWI_MAX_PS		3			// largest prescaler setting, 4^3 = 64
+
 /* Status Masks for i2c status register - TWSR */
 #define STAT_MSK		0xF8
 #define STAT_START		0x08
@@ -31,10 +64,43 @@
 #define STAT_REC_ACK	0x50
 #define STAT_REC_NACK	0x58
 
+// Bus errors counted for each device
+enum i2c_Event {I2C_EV_NACK, I2C_EV_TIMEOUT, I2C_EV_RECOVERY};
+
+// Error counters for one device
+struct i2c_stats {
+	uint8_t addr;			// address of the device, 0 if the entry is free
+	uint16_t nacks;			// address or data bytes NACKed
+	uint16_t timeouts;		// transactions the bus hung on
+	uint16_t recoveries;	// times the bus had to be freed
+};
+
+// Asynchronous transaction states
+enum twi_State {TWI_IDLE, TWI_BUSY, TWI_DONE, TWI_ERROR};
+
+/* Asynchronous i2c transaction, run in the background by the TWI interrupt.
+ * The tx bytes are written first (normally the register address followed by
+ * any data), then if nrx is not zero a repeated start is sent and nrx bytes
+ * are read back into rx. The transaction and its buffers must stay valid
+ * until the state is no longer TWI_BUSY. The state must not be TWI_BUSY
+ * when the transaction is first handed to begin.
+ */
+struct twi_xfer {
+	uint8_t addr;				// address of the device, with the R/W bit clear
+	const uint8_t *tx;			// bytes to write to the device
+	uint8_t ntx;				// number of bytes to write
+	uint8_t *rx;				// buffer to hold the bytes read back
+	uint8_t nrx;				// number of bytes to read
+	bool slow;					// run at I2C_STANDARD for long cables
+	volatile twi_State state;	// state of the transaction, set by the ISR
+};
+
 /*****************************************************************************
  * Class:		i2c
  * Description:	The i2c class enables the microcontroller to communicate with
- *				other i2c devices.
+ *				other i2c devices. Transactions can either be run to
+ *				completion by polling the bus, or queued with begin and run
+ *				in the background by the TWI interrupt.
  ****************************************************************************/
 class i2c
 {
@@ -45,6 +111,12 @@ class i2c
 		// debug serial serial connection
 		serial *p_serial;
 		
+		// the SCL frequency the bit rate settings actually give
+		uint32_t bus_clk;
+		
+		// set when a polled bus operation times out
+		bool timed_out;
+		
 		// this method sends a start condition on the i2c bus
 		bool start (void);
 		
@@ -59,12 +131,28 @@ class i2c
 		
 		// this method reads one byte to the i2c device
 		uint8_t read_byte (bool ack);
+		
+		// this method runs one attempt at a polled transaction
+		bool transfer (uint8_t addr, const uint8_t *tx1, uint8_t ntx1,
+					   const uint8_t *tx2, uint8_t ntx2, uint8_t *rx,
+					   uint8_t nrx);
+		
+		// this method runs a polled transaction, retrying on errors
+		bool retry (uint8_t addr, const uint8_t *tx1, uint8_t ntx1,
+					const uint8_t *tx2, uint8_t ntx2, uint8_t *rx,
+					uint8_t nrx);
 	
 	public:
 		// No public class variables
 		
-		// this constructor sets up the i2c for use
-		i2c (serial *ptr_serial);
+		// this constructor sets up the i2c for use at the given SCL rate
+		i2c (serial *ptr_serial, uint32_t scl);
+		
+		// this method sets the bus clock as close to scl as it can
+		bool set_clock (uint32_t scl);
+		
+		// this method returns the SCL frequency the bus is running at
+		uint32_t get_clock (void)	{ return bus_clk; };
 		
 		// this method checks if a sensor is alive at the given address
 		bool ping (uint8_t addr);
@@ -80,6 +168,25 @@ class i2c
 		
 		// this method reads multiple bytes from the i2c sensor
 		bool read (uint8_t addr, uint8_t reg, uint8_t* p_buff, uint8_t count);
+		
+		// this method writes then reads bytes in one combined transaction
+		bool write_read (uint8_t addr, const uint8_t *tx, uint8_t ntx,
+						 uint8_t *rx, uint8_t nrx);
+		
+		// this method queues a transaction to run in the background
+		bool begin (twi_xfer *xfer);
+		
+		// this method checks if a background transaction is running
+		bool busy (void);
+		
+		// this method gives up on a background transaction
+		void abort (twi_xfer *xfer);
+		
+		// this method frees a bus held by a stuck device
+		bool recover (void);
+		
+		// this method copies the error counters into a stats frame payload
+		uint8_t get_stats (uint8_t *buff, uint8_t size);
 };
 
 #endif // __I2C_H__
\ No newline at end of file
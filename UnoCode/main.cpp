@@ -14,11 +14,10 @@
 #include "oneWire.h"
 #include "UVIndex.h"
 #include "PIR.h"
+#include "scheduler.h"
 #include "shares.h"		// extern for global shared variables
 
 /* initialize shared variables */
-char dbg_str[SERIAL_MAX_SEND];
-
 // PIR related globals
 volatile uint8_t lane_states = OPEN;
 volatile uint8_t ln_tmr_flg = 0x00;
@@ -27,41 +26,209 @@ volatile uint8_t portd_hist = 0x00;
 volatile uint8_t ln_1_tmr_cnt = 0;
 volatile uint8_t ln_2_tmr_cnt = 0;
 
+// Scheduler related globals
+volatile uint32_t sys_ticks = 0;
+uint16_t duty_cycle = 1000;
+
+// UVIndex related globals
+volatile uint8_t uv_samples = 0;
+volatile uint8_t adc_woke = 0;
+
 // Shared Variables for Sensor Values
-int32_t surf_temp = 0;
-int32_t sub_temp = 0;
+int16_t water_temps[WATER_SLOTS];
 int32_t ext_temp = 0;
 uint32_t ext_hum = 0;
+uint32_t ext_pres = 0;
+int32_t ext_dew = 0;
+uint16_t ext_abs_hum = 0;
+int32_t ext_heat = 0;
+uint32_t ext_slp = 0;
 uint8_t windy = 0;
 int16_t uv_ndx = 0;
+uint16_t uv_var = 0;
+uint16_t uv_mean = 0;
+uint8_t uv_mean_bits = 0;
+
+// Task periods in ms
+#define BME280_PERIOD		1000
+#define BME280_POLL_PERIOD	5
+#define ONEWIRE_PERIOD		1000
+#define ONEWIRE_POLL_PERIOD	10
+#define TILTBALL_PERIOD		250
+#define UVINDEX_PERIOD		1000
+#define UVINDEX_POLL_PERIOD	5
+#define PIR_PERIOD			1000
+#define SEND_PKT_PERIOD		30000
+#define COMMAND_PERIOD		20
+#define LINK_PERIOD			50
+
+// UV samples averaged into each reading, 4 to 64, 16 gives 12 bits
+#define UVINDEX_SAMPLES		16
+
+// Water temperature resolution in bits, 9 bit converts in 94 ms, 12 in 750 ms
+#define ONEWIRE_RESOLUTION	12
 
+// Water temperature buses
+#define SURFACE_BUS_PIN		3
+#define UNDERWATER_BUS_PIN	2
+
+/* Water temperature probe table, see ow_probe in oneWire.h. Probes can be 
+ * listed by ROM code to pin them to a slot and give them a calibration. A
+ * ROM of all zeros takes the first probe found on the bus that is not 
+ * listed. Probes that are not in the table at all take the free slots.
+ */
+static const ow_probe probes[] = {
+	// port	pin				rom	slot			cal	resolution
+	{ &PIND, SURFACE_BUS_PIN,	 {0}, WATER_SURFACE,	0, ONEWIRE_RESOLUTION },
+	{ &PIND, UNDERWATER_BUS_PIN, {0}, WATER_UNDERWATER, 0, ONEWIRE_RESOLUTION },
+};
+#define NUM_PROBES	(sizeof(probes) / sizeof(probes[0]))
+
+// Send packet task context, the scheduler's lost tasks and the i2c error
+// counters go out with the sensors
+struct pkt_ctx {
+	serial*		p_serial;	// link to the WiFi board
+	scheduler*	p_sched;	// scheduler whose lost tasks are sent
+	i2c*		p_i2c;		// bus whose error counters are sent
+};
+
+// Command task context, commands act on the link, the scheduler and the
+// sampling settings of the BME280 and the water temperature probes
+struct cmd_ctx {
+	serial*		p_serial;	// link to the WiFi board
+	scheduler*	p_sched;	// scheduler the commands act on
+	BME280*		p_bme;		// sensor whose profile can be switched
+	oneWire*	p_surf;		// surface water temperature bus
+	oneWire*	p_sub;		// underwater temperature bus
+	int8_t		pkt_task;	// id of the send packet task
+};
+
+/* Scheduler task wrappers, each runs the task method of the object passed */
+static void run_BME280 (void *p)	{ ((BME280 *)p)->BME280Task();		}
+static void run_oneWire (void *p)	{ ((oneWire *)p)->oneWireTask();	}
+static void run_TiltBall (void *p)	{ ((TiltBall *)p)->TiltBallTask();	}
+static void run_UVIndex (void *p)	{ ((UVIndex *)p)->UVIndexTask();	}
+static void run_PIR (void *p)		{ ((PIR *)p)->PIRTask();			}
+static void run_link (void *p)		{ ((serial *)p)->linkTask();		}
+
+/*****************************************************************************
+ * Function:	run_sendPkt
+ * Description:	This task sends the sensor packet to the WiFi board, followed
+ *				by the water temperatures and the stats: the tasks that did
+ *				not fit in the scheduler, which would never run, and the 
+ *				i2c error counters.
+ *
+ * Parameters:	p - pointer to the send packet task context
+ ****************************************************************************/
+static void run_sendPkt (void *p)
+{
+	pkt_ctx *ctx = (pkt_ctx *)p;
+	uint8_t stats[PKT_STATS_HDR_LEN + I2C_MAX_DEVS * I2C_STATS_LEN];
+	
+	ctx->p_serial->sendPkt();
+	ctx->p_serial->sendWaterPkt();
+	stats[0] = ctx->p_sched->get_lost();
+	ctx->p_serial->send_frame(PKT_TYPE_I2C_STATS, stats, PKT_STATS_HDR_LEN +
+		ctx->p_i2c->get_stats(&stats[PKT_STATS_HDR_LEN],
+							  sizeof(stats) - PKT_STATS_HDR_LEN));
+}
+
+/*****************************************************************************
+ * Function:	run_commands
+ * Description:	This task handles the command frames sent by the WiFi board.
+ *				Task ids are assigned in the order the tasks are added in
+ *				main. The command frames are described in serial.h. Unknown
+ *				or badly formed commands are ignored.
+ *
+ * Parameters:	p - pointer to the command task context
+ ****************************************************************************/
+static void run_commands (void *p)
+{
+	cmd_ctx *ctx = (cmd_ctx *)p;
+	uint8_t cmd[PKT_MAX_SIZE];
+	uint8_t *payload = &cmd[PKT_HDR_SIZE];
+	uint8_t len;
+	
+	while ((len = ctx->p_serial->get_frame(cmd, sizeof(cmd))))
+	{
+		len -= PKT_HDR_SIZE;
+		
+		switch (cmd[PKT_NDX_TYPE])
+		{
+			case PKT_TYPE_CMD_SEND:
+				ctx->p_sched->trigger(ctx->pkt_task);
+				break;
+				
+			case PKT_TYPE_CMD_PERIOD:
+				if (len == PKT_CMD_PERIOD_LEN)
+				{
+					ctx->p_sched->set_period((int8_t)payload[0],
+						(uint16_t)serial::get_le(&payload[1], 2));
+				}
+				break;
+				
+			case PKT_TYPE_CMD_PROFILE:
+				if (len == PKT_CMD_PROFILE_LEN)
+				{
+					ctx->p_bme->set_profile((bme_Profile)payload[0]);
+				}
+				break;
+				
+			case PKT_TYPE_CMD_OW_RES:
+				if (len == PKT_CMD_OW_RES_LEN)
+				{
+					ctx->p_surf->set_resolution(payload[0]);
+					ctx->p_sub->set_resolution(payload[0]);
+				}
+				break;
+				
+			case PKT_TYPE_BAUD_ACK:
+				if (len == PKT_BAUD_LEN)
+				{
+					ctx->p_serial->baud_ack(serial::get_le(payload, PKT_BAUD_LEN));
+				}
+				break;
+				
+			default:
+				break;
+		}
+	}
+}
 
 int main(void)
 {
-	uint16_t main_runs = 0;
+	// no water temperatures until the probes are read
+	for (uint8_t slot = 0; slot < WATER_SLOTS; slot++)
+	{
+		water_temps[slot] = WATER_TEMP_NONE;
+	}
 	
 	/* create serial object */
 	serial ser_dev = serial(9600, 16000000);
 	
 	//DBG(&ser_dev, "Creating and initializing all sensors...\r\n");
 	
-	// create a i2c object 
-	i2c my_i2c = i2c(&ser_dev);
+	// create a i2c object, the BME280 is fine with fast mode
+	i2c my_i2c = i2c(&ser_dev, I2C_FAST);
 	
-	// create a BME280 object
-	BME280 my_BME280 = BME280(&my_i2c, &ser_dev, 278);
+	// create a BME280 object, low power sampling until told otherwise
+	BME280 my_BME280 = BME280(&my_i2c, &ser_dev, 278, BME280_PERIOD,
+							  BME_WEATHER);
 	
-	// create a water temperature sensor - surface
-	oneWire my_oneWire_surface_temp = oneWire(&ser_dev, 3, ID_SURFACE_TEMP);
+	// create the water temperature bus - surface
+	oneWire my_oneWire_surface_temp = oneWire(&ser_dev, &PIND, SURFACE_BUS_PIN,
+		probes, NUM_PROBES, ONEWIRE_PERIOD, ONEWIRE_RESOLUTION);
 	
-	// create a water temperature sensor - surface
-	oneWire my_oneWire_underwater_temp = oneWire(&ser_dev, 2, ID_UNDERWATER_TEMP);
+	// create the water temperature bus - underwater
+	oneWire my_oneWire_underwater_temp = oneWire(&ser_dev, &PIND,
+		UNDERWATER_BUS_PIN, probes, NUM_PROBES, ONEWIRE_PERIOD,
+		ONEWIRE_RESOLUTION);
 	
 	// create a tilt-ball object
 	TiltBall my_TiltBall = TiltBall(&ser_dev, 0);
 	
 	// create a UVIndex sensor
-	UVIndex my_UVIndex = UVIndex(&ser_dev, 7);
+	UVIndex my_UVIndex = UVIndex(&ser_dev, 7, UVINDEX_PERIOD, UVINDEX_SAMPLES);
 	
 	// create a PIR sensor for lane 1
 	PIR my_pir_ln1 = PIR(&ser_dev, LN_1_PIN);
@@ -71,31 +238,35 @@ int main(void)
 	
 	//DBG(&ser_dev, "All Sensors created!\r\n");
 	
+	// create the scheduler and register every task with its period,
+	// offsets spread the slow tasks out so they do not share a tick
+	scheduler sched = scheduler();
+	
+	sched.add_task(run_BME280, &my_BME280, BME280_POLL_PERIOD, 0);
+	sched.add_task(run_oneWire, &my_oneWire_surface_temp, ONEWIRE_POLL_PERIOD,
+		100);
+	sched.add_task(run_oneWire, &my_oneWire_underwater_temp,
+		ONEWIRE_POLL_PERIOD, 200);
+	sched.add_task(run_TiltBall, &my_TiltBall, TILTBALL_PERIOD, 0);
+	sched.add_task(run_UVIndex, &my_UVIndex, UVINDEX_POLL_PERIOD, 300);
+	sched.add_task(run_PIR, &my_pir_ln1, PIR_PERIOD, 400);
+	sched.add_task(run_PIR, &my_pir_ln2, PIR_PERIOD, 400);
+	
+	// send update packet to WiFi board once the first samples are in
+	pkt_ctx pkt = { &ser_dev, &sched, &my_i2c };
+	cmd_ctx cmds = { &ser_dev, &sched, &my_BME280, &my_oneWire_surface_temp,
+					 &my_oneWire_underwater_temp, SCHED_NO_TASK };
+	cmds.pkt_task = sched.add_task(run_sendPkt, &pkt, SEND_PKT_PERIOD, 500);
+	
+	// listen for commands from the WiFi board
+	sched.add_task(run_commands, &cmds, COMMAND_PERIOD, 0);
+	
+	// move the link to the WiFi board up to a faster baud rate
+	sched.add_task(run_link, &ser_dev, LINK_PERIOD, 0);
+	
     while (1) 
     {
-		
-		my_BME280.BME280Task();
-		
-		my_oneWire_surface_temp.oneWireTask();
-		
-		my_oneWire_underwater_temp.oneWireTask();
-		
-		my_TiltBall.TiltBallTask();
-				
-		my_UVIndex.UVIndexTask();
-		
-		my_pir_ln1.PIRTask();
-		
-		my_pir_ln2.PIRTask();
-		
-		if ((main_runs % 30) == 0)
-		{
-			// send update packet to WiFi board
-			ser_dev.sendPkt();
-		}
-		
-		_delay_ms(1000);
-		main_runs++;
+		sched.run();
     }
 }
 
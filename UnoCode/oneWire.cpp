@@ -9,224 +9,1153 @@
 
 #include "oneWire.h"
 #include "shares.h"
+#include "scheduler.h"	// tick count for conversion timing
+#include <avr/pgmspace.h>	// CRC-8 tables kept in flash
+
+/* Dallas CRC-8 (polynomial x^8 + x^5 + x^4 + 1, bit reversed 0x8C) of a byte
+ * split into nibbles. The CRC of a whole byte is the two entries XORed, which
+ * takes 32 bytes of flash instead of 256. */
+static const uint8_t PROGMEM crc8_lo[16] = {
+	0x00, 0x5E, 0xBC, 0xE2, 0x61, 0x3F, 0xDD, 0x83,
+	0xC2, 0x9C, 0x7E, 0x20, 0xA3, 0xFD, 0x1F, 0x41
+};
+static const uint8_t PROGMEM crc8_hi[16] = {
+	0x00, 0x9D, 0x23, 0xBE, 0x46, 0xDB, 0x65, 0xF8,
+	0x8C, 0x11, 0xAF, 0x32, 0xCA, 0x57, 0xE9, 0x74
+};
+
+// Parts of a background transfer, in the order they run
+enum ow_Step {OW_STEP_RESET, OW_STEP_TX, OW_STEP_SEARCH, OW_STEP_RX};
+
+/* Background transfer state, shared with the Timer1 compare interrupt */
+static ow_xfer * volatile ow_cur = NULL;	// running transfer, or NULL
+static volatile uint8_t *ow_pins;			// PIN register of its port
+static ow_xfer *ow_queue[OW_QUEUE_SIZE];	// transfers waiting, oldest first
+static volatile uint8_t ow_q_len = 0;		// number of transfers waiting
+static uint8_t ow_msk;			// port bit of the running transfer
+static ow_Step ow_step;			// part of the transfer running
+static uint8_t ow_phase;		// reset: presence next, search: slot of bit
+static uint8_t ow_ndx;			// byte being sent or read, or bit searched
+static uint8_t ow_bit;			// bit of the byte being sent or read
+static bool ow_id;				// first bit read for the bit searched
+static bool ow_low;				// line held low, let go at the next match
+static uint8_t ow_after;		// us to wait once the line is let go
+
+/* Slots of water_temps given out, to a table entry or to a probe with none */
+static uint16_t ow_slots_taken = 0;
+
+/*****************************************************************************
+ * Function:	ow_wait
+ * Description:	This function sets how long until the next compare match,
+ *				counted from the one the ISR is running for. The timer is
+ *				cleared on each match, so time spent in the ISR counts 
+ *				toward the wait and is not to be taken off it. OCR1A is not
+ *				buffered in CTC mode, so if the ISR has already run past
+ *				the new value the match would only come once the timer 
+ *				wraps, 32 ms on. The count is then put just short of it, 
+ *				for a match on the next tick, and any match the old count
+ *				raised on the way is dropped. Called from the ISR.
+ *
+ * Parameters:	us - the time to wait in us
+ ****************************************************************************/
+static inline void ow_wait (uint16_t us)
+{
+	OCR1A = OW_US_TO_TICKS(us) - 1;
+	
+	if (TCNT1 >= OCR1A)
+	{
+		TCNT1 = OCR1A - 1;
+		TIFR1 = (1 << OCF1A);
+	}
+}
+
+/*****************************************************************************
+ * Function:	ow_timer_init
+ * Description:	This function sets Timer1 up in CTC mode with the clock
+ *				stopped. The clock only runs while a transfer is on a bus.
+ ****************************************************************************/
+static void ow_timer_init (void)
+{
+	TIMSK1 = 0;
+	TCCR1A = 0;
+	TCCR1B = (1 << WGM12);
+}
+
+/*****************************************************************************
+ * Function:	ow_load
+ * Description:	This function makes a transfer the running one and starts
+ *				the timer for it. Must be called with interrupts disabled.
+ *
+ * Parameters:	xfer - the transfer to run
+ ****************************************************************************/
+static void ow_load (ow_xfer *xfer)
+{
+	ow_cur = xfer;
+	ow_pins = xfer->pins;
+	ow_msk = (1 << xfer->pin);
+	ow_step = (xfer->reset ? OW_STEP_RESET : OW_STEP_TX);
+	ow_phase = 0;
+	ow_ndx = 0;
+	ow_bit = 0x01;
+	ow_low = false;
+	
+	// the line is only ever driven low
+	OW_PORT_REG(ow_pins) &= ~ow_msk;
+	
+	TCNT1 = 0;
+	ow_wait(OW_REC_US);
+	TIFR1 = (1 << OCF1A);
+	TIMSK1 = (1 << OCIE1A);
+	TCCR1B = (1 << WGM12) | (1 << CS11);
+}
+
+/*****************************************************************************
+ * Function:	ow_finish
+ * Description:	This function ends the running transfer and starts the next
+ *				one waiting, or stops the timer. Called from the ISR.
+ *
+ * Parameters:	state - the final state of the transfer
+ ****************************************************************************/
+static void ow_finish (ow_Xfer state)
+{
+	ow_cur->state = state;
+	ow_cur = NULL;
+	
+	if (ow_q_len == 0)
+	{
+		TIMSK1 = 0;
+		TCCR1B = (1 << WGM12);
+		return;
+	}
+	
+	ow_load(ow_queue[0]);
+	ow_q_len--;
+	for (uint8_t ndx = 0; ndx < ow_q_len; ndx++)
+	{
+		ow_queue[ndx] = ow_queue[ndx + 1];
+	}
+}
+
+/*****************************************************************************
+ * Function:	ow_begin
+ * Description:	This function submits a transfer to run in the background.
+ *				If no bus is busy the transfer starts straight away,
+ *				otherwise it waits in a queue of up to OW_QUEUE_SIZE
+ *				transfers, since every bus shares the one timer. The state
+ *				of the transfer is set to OW_XFER_BUSY and is changed by the
+ *				interrupt when it finishes.
+ *
+ * Parameters:	xfer - the transfer to run
+ * Return:		bool - status of operation (true = error, false = success)
+ ****************************************************************************/
+static bool ow_begin (ow_xfer *xfer)
+{
+	bool err = false;
+	
+	if (xfer->state == OW_XFER_BUSY)
+	{
+		// already running or queued, leave it alone
+		return true;
+	}
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		if (ow_cur == NULL)
+		{
+			xfer->state = OW_XFER_BUSY;
+			ow_load(xfer);
+		}
+		else if (ow_q_len < OW_QUEUE_SIZE)
+		{
+			xfer->state = OW_XFER_BUSY;
+			ow_queue[ow_q_len++] = xfer;
+		}
+		else
+		{
+			// queue full, the transfer is not started
+			err = true;
+		}
+	}
+	
+	return err;
+}
+
+/*****************************************************************************
+ * Function:	ow_write_slot
+ * Description:	This function starts a write time slot. A 1 is a short low
+ *				pulse, made here with interrupts off so nothing can stretch
+ *				it. A 0 holds the line low until the next compare match.
+ *				Called from the ISR.
+ *
+ * Parameters:	bit - the bit to write
+ ****************************************************************************/
+static void ow_write_slot (bool bit)
+{
+	OW_DDR_REG(ow_pins) |= ow_msk;
+	
+	if (bit)
+	{
+		_delay_us(OW_W1_LOW_US);
+		OW_DDR_REG(ow_pins) &= ~ow_msk;
+		ow_wait(OW_SLOT_US);
+	}
+	else
+	{
+		ow_low = true;
+		ow_after = OW_REC_US;
+		ow_wait(OW_W0_LOW_US);
+	}
+}
+
+/*****************************************************************************
+ * Function:	ow_read_slot
+ * Description:	This function runs a read time slot. The start pulse and the
+ *				sample right after it have to be within 15 us, so they are
+ *				done here with interrupts off. The rest of the slot is left
+ *				to the timer. Called from the ISR.
+ *
+ * Return:		bool - the bit read
+ ****************************************************************************/
+static bool ow_read_slot (void)
+{
+	bool bit;
+	
+	OW_DDR_REG(ow_pins) |= ow_msk;
+	_delay_us(OW_R_LOW_US);
+	OW_DDR_REG(ow_pins) &= ~ow_msk;
+	_delay_us(OW_R_SAMPLE_US);
+	bit = (OW_PIN_REG(ow_pins) & ow_msk);
+	ow_wait(OW_SLOT_US);
+	
+	return bit;
+}
+
+/*****************************************************************************
+ * Function:	ow_next_bit
+ * Description:	This function moves on to the next bit of the byte being
+ *				sent or read. Called from the ISR.
+ ****************************************************************************/
+static inline void ow_next_bit (void)
+{
+	ow_bit <<= 1;
+	if (ow_bit == 0)
+	{
+		ow_bit = 0x01;
+		ow_ndx++;
+	}
+}
 
 /*****************************************************************************
  * Method:		oneWire
- * Description:	This constructor sets up the oneWire protocol on the 
- *				ATmega328P.
- * 
+ * Description:	This constructor sets up a oneWire bus on the ATmega328P. The
+ *				slots of the table entries for the bus are kept out of the
+ *				ones given to probes with no entry.
+ *
  * Parameters:	ptr_serial 	- a reference to the serial debug object
- *				pin 		- the pin on the ATmega328P the sensor outputs to.
- *				id 			- the unique id of the sensor
+ *				pins		- the PIN register of the port the bus is on
+ *				pin 		- the pin of the port the bus is on
+ *				probes		- the probe settings table
+ *				num			- the number of entries in probes
+ *				sample_period - ms between samples
+ *				res			- resolution in bits of probes with no entry
  ****************************************************************************/
-oneWire::oneWire(serial *ptr_serial, uint8_t pin, uint8_t id)
+oneWire::oneWire(serial *ptr_serial, volatile uint8_t *pins, uint8_t pin,
+				 const ow_probe *probes, uint8_t num, uint16_t sample_period,
+				 uint8_t res)
 {
 	p_serial = ptr_serial;	// store local copy for debug
+	data_pins = pins;		// store local copy
 	data_line = pin;		// store local copy
-	dev_id = id;			// store local copy
+	table = probes;			// store local copy
+	table_len = num;		// store local copy
+	period = sample_period;	// store local copy
+	
+	for (uint8_t ndx = 0; ndx < table_len; ndx++)
+	{
+		if (table[ndx].pins == data_pins && table[ndx].pin == data_line &&
+			table[ndx].slot < WATER_SLOTS)
+		{
+			ow_slots_taken |= (1U << table[ndx].slot);
+		}
+	}
+	
+	resolution = OW_DEF_RESOLUTION;
+	set_resolution(res);
+	res_set = 0;
+	free_slots = 0;
+	num_probes = 0;
+	read_ndx = 0;
+	tries = 0;
+	crc_errs = 0;
+	wait_until = scheduler::ticks();
+	conv_start = wait_until;
+	xfer.state = OW_XFER_IDLE;
+	
+	// the task finds the probes before the first conversion
+	new_search();
 	
 	// make the data an input
-	INPUT(DATA_DDR, data_line);
+	INPUT(OW_DDR_REG(data_pins), data_line);
+	
+	// the timer runs the time slots
+	ow_timer_init();
+	
+	//DBG(this->p_serial, "oneWire Constructor ok! Pin: %d\r\n", data_line);
+}
 
-	//DBG(this->p_serial, "oneWire Constructor ok! Device id: %d\r\n", dev_id);
+/*****************************************************************************
+ * Method:		convert_temp
+ * Description:	This method converts the raw temperature data to human 
+ * 				readable values
+ ****************************************************************************/
+int16_t oneWire::convert_temp(int16_t raw)
+{
+	return (raw * 6) + (raw / 4);
 }
 
 /*****************************************************************************
- * Method:		reset
- * Description:	This method resets the oneWire device.
+ * Method:		crc8
+ * Description:	This method computes the Dallas CRC-8 of a buffer, a nibble
+ *				at a time. Running it over data that ends in its own CRC 
+ *				gives 0.
  *
- * Return:		bool - if the device is ready.
+ * Parameters:	src - the data to compute the CRC of
+ *				len - the number of bytes in src
+ * Return:		uint8_t - the CRC
  ****************************************************************************/
-bool oneWire::reset (void)
+uint8_t oneWire::crc8 (const uint8_t *src, uint8_t len)
 {
-	bool presence_pulse;
-	uint8_t retries = 125;
+	uint8_t crc = 0;
 	
-	// make pin an input
-	INPUT(DATA_DDR, data_line);
+	while (len--)
+	{
+		crc ^= *src++;
+		crc = pgm_read_byte(&crc8_lo[crc & 0x0F]) ^ 
+			  pgm_read_byte(&crc8_hi[crc >> 4]);
+	}
 	
-	// wait for wire to go high
-	do 
+	return crc;
+}
+
+/*****************************************************************************
+ * Method:		set_resolution
+ * Description:	This method changes the resolution of every probe on the bus,
+ *				over the one in the table. Each bit less halves the
+ *				conversion time, from 750 ms at 12 bits down to 94 ms at 9
+ *				bits. The probes are set before the next conversion.
+ *
+ * Parameters:	res - the resolution in bits, held to 9 to 12
+ ****************************************************************************/
+void oneWire::set_resolution (uint8_t res)
+{
+	if (res < OW_MIN_RESOLUTION)
+	{
+		res = OW_MIN_RESOLUTION;
+	}
+	else if (res > OW_MAX_RESOLUTION)
+	{
+		res = OW_MAX_RESOLUTION;
+	}
+	
+	resolution = res;
+	res_set = res;
+	reconfig = true;
+	config_ndx = 0;
+}
+
+/*****************************************************************************
+ * Method:		conv_time
+ * Description:	This method works out the longest time a conversion can take
+ *				at the highest resolution of the probes on the bus.
+ *
+ * Return:		uint16_t - the conversion time in ms
+ ****************************************************************************/
+uint16_t oneWire::conv_time (void)
+{
+	uint8_t res = OW_MIN_RESOLUTION;
+	
+	for (uint8_t ndx = 0; ndx < num_probes; ndx++)
 	{
-		if (--retries == 0)
+		if (probe_res(ndx) > res)
 		{
-			return false;
+			res = probe_res(ndx);
 		}
-		_delay_us(2);
-	} while (!(DATA_PIN & (1 << data_line)));
+	}
 	
-	// set data_line low
-	DATA_PORT &= ~(1 << data_line);
+	return OW_CONV_MS_9BIT << (res - OW_MIN_RESOLUTION);
+}
+
+/*****************************************************************************
+ * Method:		probe_res
+ * Description:	This method works out the resolution a probe should be at:
+ *				the one set for the whole bus, else the one in its entry,
+ *				else the bus resolution.
+ *
+ * Parameters:	ndx - the probe
+ * Return:		uint8_t - the resolution in bits
+ ****************************************************************************/
+uint8_t oneWire::probe_res (uint8_t ndx)
+{
+	uint8_t res = resolution;
 	
-	// set data_line as output
-	OUTPUT(DATA_DDR, data_line);
+	if (res_set == 0 && settings[ndx] != NULL)
+	{
+		res = settings[ndx]->res;
+		if (res < OW_MIN_RESOLUTION || res > OW_MAX_RESOLUTION)
+		{
+			res = resolution;
+		}
+	}
 	
-	_delay_us(480);
-		
-	// set data_line as input
-	INPUT(DATA_DDR, data_line);
+	return res;
+}
+
+/*****************************************************************************
+ * Method:		begin
+ * Description:	This method starts a transfer on this bus that writes the
+ *				first ntx bytes of cmd and reads nrx bytes into scratch.
+ *
+ * Parameters:	reset - start with a reset and presence pulse
+ *				ntx   - the number of bytes of cmd to write
+ *				nrx   - the number of bytes to read
+ *				rom   - the ROM to search along after writing, or NULL
+ * Return:		bool - status of operation (true = error, false = success)
+ ****************************************************************************/
+bool oneWire::begin (bool reset, uint8_t ntx, uint8_t nrx, uint8_t *rom)
+{
+	xfer.pins = data_pins;
+	xfer.pin = data_line;
+	xfer.reset = reset;
+	xfer.tx = cmd;
+	xfer.ntx = ntx;
+	xfer.rom = rom;
+	xfer.fork = 0;
+	xfer.rx = scratch;
+	xfer.nrx = nrx;
+	
+	return ow_begin(&xfer);
+}
+
+/*****************************************************************************
+ * Method:		select
+ * Description:	This method puts the ROM command that addresses one probe
+ *				with Match ROM, or every probe at once with Skip ROM, at the
+ *				start of cmd. The function command that follows only acts on
+ *				the probes addressed.
+ *
+ * Parameters:	rom  - the ROM code of the probe, or NULL for every probe
+ * Return:		uint8_t - the number of bytes of cmd used
+ ****************************************************************************/
+uint8_t oneWire::select (const uint8_t *rom)
+{
+	if (rom == NULL)
+	{
+		cmd[0] = OW_SKIP_ROM;
+		return 1;
+	}
+	
+	cmd[0] = OW_MATCH_ROM;
+	for (uint8_t ndx = 0; ndx < OW_ROM_SIZE; ndx++)
+	{
+		cmd[ndx + 1] = rom[ndx];
+	}
 	
-	_delay_us(70);
+	return OW_ROM_SIZE + 1;
+}
+
+/*****************************************************************************
+ * Method:		new_search
+ * Description:	This method forgets the probes found and starts the search 
+ *				for them over. The slots given to probes with no entry are
+ *				handed back. The probes found are set to their resolution
+ *				before they are used.
+ ****************************************************************************/
+void oneWire::new_search (void)
+{
+	ow_slots_taken &= ~free_slots;
+	free_slots = 0;
+	num_probes = 0;
+	last_fork = 0;
+	last_rom = false;
+	lost_probe = false;
+	reconfig = true;
+	config_ndx = 0;
+	pending = false;
+	state = OW_SEARCH;
+}
+
+/*****************************************************************************
+ * Method:		search_start
+ * Description:	This method starts a Search ROM for the next probe on the bus
+ *				(Maxim application note 187). Each ROM bit is read from every
+ *				device at once, as the bit and then its complement. Where the
+ *				devices left disagree, the bit forks: the search takes the 1
+ *				path at the fork it took the 0 path at last time, follows the
+ *				last ROM before that and takes the 0 path after it. This sets
+ *				search_rom up with that path for the interrupt to follow.
+ *
+ * Return:		bool - status of operation (true = error, false = success)
+ ****************************************************************************/
+bool oneWire::search_start (void)
+{
+	uint8_t bit_num = 1;
 	
-	presence_pulse = (bool)!((DATA_PIN & (1 << data_line)));
+	for (uint8_t byte = 0; byte < OW_ROM_SIZE; byte++)
+	{
+		for (uint8_t msk = 0x01; msk; msk <<= 1, bit_num++)
+		{
+			if (bit_num == last_fork)
+			{
+				search_rom[byte] |= msk;
+			}
+			else if (bit_num > last_fork)
+			{
+				search_rom[byte] &= ~msk;
+			}
+		}
+	}
 	
-	_delay_us(410);
+	cmd[0] = OW_SEARCH_ROM;
 	
-	return presence_pulse;
+	return begin(true, 1, 0, search_rom);
 }
 
 /*****************************************************************************
- * Method:		write_byte
- * Description:	This method writes one byte to the oneWire device.
+ * Method:		search_end
+ * Description:	This method keeps the ROM a finished search found. Only
+ *				DS18B20 probes with a good CRC are kept, and the search stops
+ *				when OW_MAX_PROBES have been found.
  *
- * Parameters:	data - the data to write to the device
+ * Return:		bool - if there are more ROMs to search for (true  = more,
+ *															 false = done)
  ****************************************************************************/
-void oneWire::write_byte (uint8_t data)
+bool oneWire::search_end (void)
 {
-	for (uint8_t i = 0; i < 8; i++)
+	if (xfer.state != OW_XFER_DONE)
+	{
+		// no device answered
+		last_rom = true;
+		return false;
+	}
+	
+	last_fork = xfer.fork;
+	last_rom = (last_fork == 0);
+	
+	if (crc8(search_rom, OW_ROM_SIZE) != 0)
+	{
+		// a bit was misread, the ROM is found again on the next search
+		crc_errs++;
+		lost_probe = true;
+	}
+	else if (search_rom[0] == OW_FAMILY_DS18B20)
 	{
-		if (data & 0x01)
+		for (uint8_t ndx = 0; ndx < OW_ROM_SIZE; ndx++)
 		{
-			write_1();
+			roms[num_probes][ndx] = search_rom[ndx];
 		}
-		else
+		num_probes++;
+	}
+	
+	return (!last_rom && num_probes < OW_MAX_PROBES);
+}
+
+/*****************************************************************************
+ * Method:		find_setting
+ * Description:	This method looks for the table entry on this bus that lists
+ *				a ROM code, or for the first entry for any probe that has
+ *				not been used yet if rom is NULL.
+ *
+ * Parameters:	rom	   - the ROM code to look for, or NULL for any probe
+ *				p_used - bit for each table entry already used, updated
+ * Return:		const ow_probe* - the entry, or NULL if there is none
+ ****************************************************************************/
+const ow_probe* oneWire::find_setting (const uint8_t *rom, uint8_t *p_used)
+{
+	const ow_probe *entry;
+	uint8_t byte;
+	
+	for (uint8_t ndx = 0; ndx < table_len; ndx++)
+	{
+		entry = &table[ndx];
+		if (entry->pins != data_pins || entry->pin != data_line ||
+			(p_used[ndx >> 3] & (1 << (ndx & 0x07))))
+		{
+			continue;
+		}
+		
+		for (byte = 0; rom != NULL && byte < OW_ROM_SIZE; byte++)
 		{
-			write_0();
+			if (entry->rom[byte] != rom[byte])
+			{
+				break;
+			}
+		}
+		
+		// no device has a family code of 0, so it marks an entry for any
+		if ((rom == NULL) ? (entry->rom[0] == 0) : (byte == OW_ROM_SIZE))
+		{
+			p_used[ndx >> 3] |= (1 << (ndx & 0x07));
+			return entry;
 		}
-		data >>= 1;
 	}
+	
+	return NULL;
 }
 
 /*****************************************************************************
- * Method:		write_1
- * Description:	This method writes a logial high to the oneWire device.
+ * Method:		take_slot
+ * Description:	This method gives a probe with no table entry the first slot
+ *				of water_temps that nothing else has.
+ *
+ * Return:		uint8_t - the slot, or OW_NO_SLOT if they are all taken
  ****************************************************************************/
-void oneWire::write_1 (void)
+uint8_t oneWire::take_slot (void)
 {
-	// set data_line low
-	DATA_PORT &= ~(1 << data_line);
+	for (uint8_t slot = 0; slot < WATER_SLOTS; slot++)
+	{
+		if (!(ow_slots_taken & (1U << slot)))
+		{
+			ow_slots_taken |= (1U << slot);
+			free_slots |= (1U << slot);
+			return slot;
+		}
+	}
 	
-	// make data_line an output
-	OUTPUT(DATA_DDR, data_line);
+	return OW_NO_SLOT;
+}
+
+/*****************************************************************************
+ * Method:		assign_probes
+ * Description:	This method matches the probes a search found to the table.
+ *				Entries that list a ROM code are matched first, then entries
+ *				for any probe go to the rest in the order they were found,
+ *				then the probes left take free slots. Probes that get no
+ *				slot are dropped.
+ ****************************************************************************/
+void oneWire::assign_probes (void)
+{
+	uint8_t used[(UINT8_MAX + 7) / 8] = {0};
+	uint8_t kept = 0;
+	
+	for (uint8_t ndx = 0; ndx < num_probes; ndx++)
+	{
+		settings[ndx] = find_setting(roms[ndx], used);
+	}
+	
+	for (uint8_t ndx = 0; ndx < num_probes; ndx++)
+	{
+		if (settings[ndx] == NULL)
+		{
+			settings[ndx] = find_setting(NULL, used);
+		}
+		
+		slots[ndx] = (settings[ndx] != NULL ? settings[ndx]->slot
+											: take_slot());
+		if (slots[ndx] >= WATER_SLOTS)
+		{
+			continue;
+		}
+		
+		// move the probe down over any dropped ahead of it
+		for (uint8_t byte = 0; byte < OW_ROM_SIZE; byte++)
+		{
+			roms[kept][byte] = roms[ndx][byte];
+		}
+		settings[kept] = settings[ndx];
+		slots[kept] = slots[ndx];
+		kept++;
+	}
 	
-	_delay_us(10);
+	num_probes = kept;
+}
+
+/*****************************************************************************
+ * Method:		write_config
+ * Description:	This method writes the resolution to one probe with Write
+ *				Scratchpad. The alarm limits have to be written along with
+ *				it, they are not used here. The setting is not copied to the
+ *				probe EEPROM, so a probe that loses power comes back at its
+ *				stored resolution; read_end spots that.
+ *
+ * Parameters:	ndx  - the probe to write
+ * Return:		bool - status of operation (true = error, false = success)
+ ****************************************************************************/
+bool oneWire::write_config (uint8_t ndx)
+{
+	uint8_t len = select(roms[ndx]);
 	
-	// make data_line an input
-	INPUT(DATA_DDR, data_line);
+	cmd[len++] = OW_WRITE_SCRATCH;
+	cmd[len++] = OW_ALARM_HIGH;
+	cmd[len++] = OW_ALARM_LOW;
+	cmd[len++] = ((probe_res(ndx) - OW_MIN_RESOLUTION) << OW_CFG_RES_SHIFT) |
+				 OW_CFG_RESERVED;
 	
-	_delay_us(55);
+	return begin(true, len, 0, NULL);
 }
 
 /*****************************************************************************
- * Method:		write_0
- * Description:	This method writes a logial low to the oneWire device.
+ * Method:		start_conversion
+ * Description:	This method starts a temperature conversion on every probe
+ *				at once. The probes go on converting by themselves.
+ *
+ * Return:		bool - status of operation (true = error, false = success)
  ****************************************************************************/
-void oneWire::write_0 (void)
+bool oneWire::start_conversion (void)
 {
-	// set data_line low
-	DATA_PORT &= ~(1 << data_line);
+	uint8_t len = select(NULL);
 	
-	// make data_line an output
-	OUTPUT(DATA_DDR, data_line);
+	cmd[len++] = OW_CONVERT_T;
 	
-	_delay_us(65);
+	return begin(true, len, 0, NULL);
+}
+
+/*****************************************************************************
+ * Method:		poll_conversion
+ * Description:	This method reads a byte of time slots while a conversion is
+ *				running. Powered DS18B20s answer 0 until every one of them
+ *				is done.
+ *
+ * Return:		bool - status of operation (true = error, false = success)
+ ****************************************************************************/
+bool oneWire::poll_conversion (void)
+{
+	return begin(false, 0, 1, NULL);
+}
+
+/*****************************************************************************
+ * Method:		read_start
+ * Description:	This method starts reading the whole scratchpad of one probe.
+ *
+ * Parameters:	ndx  - the probe to read
+ * Return:		bool - status of operation (true = error, false = success)
+ ****************************************************************************/
+bool oneWire::read_start (uint8_t ndx)
+{
+	uint8_t len = select(roms[ndx]);
 	
-	// make data_line an input
-	INPUT(DATA_DDR, data_line);
+	cmd[len++] = OW_READ_SCRATCH;
 	
-	_delay_us(5);
+	return begin(true, len, OW_SCRATCH_SIZE, NULL);
 }
 
 /*****************************************************************************
- * Method:		read_byte
- * Description:	This method reads one byte from the oneWire device.
+ * Method:		read_end
+ * Description:	This method takes the temperature out of a scratchpad that
+ *				has been read, if the CRC matches, and adds the probe's
+ *				calibration. A line held low reads as
+ *				all zeros, which passes the CRC, so the bits of the
+ *				configuration register that always read 1 are checked too.
+ *				The bits of the temperature below the probe's resolution are
+ *				undefined, so they are cleared. A probe that is not at the 
+ *				resolution set is written again before the next conversion.
+ *
+ * Parameters:	ndx  - the probe read
+ * Return:		ow_Status - OW_OK, OW_NO_DEVICE if the probe did not answer,
+ *							or OW_BAD_CRC if the scratchpad was misread
  ****************************************************************************/
-uint8_t oneWire::read_byte (void)
+ow_Status oneWire::read_end (uint8_t ndx)
 {
-	uint8_t data_in;
-	uint8_t data_read = 0;
+	uint8_t res;
+	int16_t temp;
 	
-	for (uint8_t bit_msk = 0x01; bit_msk; bit_msk <<= 1)
+	if (xfer.state != OW_XFER_DONE)
 	{
-		// make data_line low
-		DATA_PORT &= ~(1 << data_line);
-		// make data_line output
-		OUTPUT(DATA_DDR, data_line);
-		
-		_delay_us(3);
-		// make data_line input
-		INPUT(DATA_DDR, data_line);
-		_delay_us(10);
-		
-		data_in = DATA_PIN & (1 << data_line);
-		_delay_us(53);
-		
-		if (data_in)
-		{
-			data_read |= bit_msk;
-		}
+		return OW_NO_DEVICE;
+	}
+	
+	if (crc8(scratch, OW_SCRATCH_SIZE) != 0 ||
+		(scratch[OW_SCRATCH_CONFIG] & OW_CFG_RESERVED) != OW_CFG_RESERVED)
+	{
+		crc_errs++;
+		return OW_BAD_CRC;
 	}
 	
-	return data_read;
+	res = ((scratch[OW_SCRATCH_CONFIG] >> OW_CFG_RES_SHIFT) & OW_CFG_RES_MSK) +
+		  OW_MIN_RESOLUTION;
+	if (res != probe_res(ndx))
+	{
+		reconfig = true;
+	}
+	
+	// read temperature
+	temp = (scratch[OW_SCRATCH_TEMP_MSB] << BYTE_SHIFT) | 
+		   scratch[OW_SCRATCH_TEMP_LSB];
+	temp &= ~((1 << (OW_MAX_RESOLUTION - res)) - 1);
+	temps[ndx] = convert_temp(temp);
+	if (settings[ndx] != NULL)
+	{
+		temps[ndx] += settings[ndx]->cal;
+	}
+	
+	return OW_OK;
 }
 
 /*****************************************************************************
- * Method:		convert_temp
- * Description:	This method converts the raw temperature data to human 
- * 				readable values
+ * Method:		publish
+ * Description:	This method updates the shared temperature in the slot of
+ *				one probe.
+ *
+ * Parameters:	ndx  - the probe
  ****************************************************************************/
-int16_t oneWire::convert_temp(int16_t raw)
+void oneWire::publish (uint8_t ndx)
 {
-	return (raw * 6) + (raw / 4);
+	int32_t temp_f = TEMP_C_TO_F((int32_t)temps[ndx]);
+	
+	// update global value
+	water_temps[slots[ndx]] = (int16_t)temp_f;
+	
+	//DBG(this->p_serial, "Temp probe %d: %d.%02dC or %ld.%02ldF\r\n",
+	//	slots[ndx],
+	//	(temps[ndx] / 100), (temps[ndx] % 100),
+	//	(temp_f / 100), (temp_f % 100));
 }
 
 /*****************************************************************************
  * Method:		oneWireTask
- * Description:	This method runs the oneWire task
+ * Description:	This method runs the oneWire task. Each step puts a transfer
+ *				on the bus, which the Timer1 interrupt carries out while the
+ *				main loop goes on, and a later run picks up the result:
+ *				- search: finds one probe on the bus per transfer, then
+ *				  matches the probes to their settings. If none are found,
+ *				  the search starts over a sample period later.
+ *				- idle: writes the resolution to each probe when it has
+ *				  changed. Then once every sample period, starts a 
+ *				  conversion on every probe at once with Skip ROM, so the
+ *				  sample takes one conversion time however many probes 
+ *				  there are.
+ *				- convert: waits until the conversion time for the 
+ *				  resolution has passed, or sooner if a read slot returns 1,
+ *				  which powered DS18B20s do once they are all done.
+ *				- read: reads one probe per transfer with Match ROM and puts
+ *				  the result in its slot of water_temps. A probe whose
+ *				  scratchpad fails the CRC is read again, up to
+ *				  OW_READ_RETRIES times, then keeps its old value.
+ *				The task should be run every few ms so the results are picked
+ *				up soon after they are ready. A probe that does not answer
+ *				has its slot cleared and the bus is searched again.
  ****************************************************************************/
 void oneWire::oneWireTask (void)
 {
-	static uint8_t runs = 0;
+	uint32_t now = scheduler::ticks();
+	ow_Status status;
 	
-	uint8_t low_byte, high_byte;
-	int16_t temp;
-	int32_t temp_f;
+	if (xfer.state == OW_XFER_BUSY)
+	{
+		// still on the bus
+		return;
+	}
 	
-	//if ((runs % 5) == 0)
-	//{
-		//DBG(this->p_serial, "\r\noneWire Task Running on device: %d\r\n", dev_id);
+	switch (state)
+	{
+		case OW_SEARCH:
+			if (!pending)
+			{
+				if ((int32_t)(now - wait_until) >= 0 && !search_start())
+				{
+					pending = true;
+				}
+				break;
+			}
+			
+			pending = false;
+			if (search_end())
+			{
+				// look for the next one on the next run
+				break;
+			}
+			
+			assign_probes();
+			if (num_probes == 0)
+			{
+				// nothing there, look again later
+				new_search();
+				wait_until = now + period;
+				break;
+			}
+			
+			wait_until = now;
+			state = OW_IDLE;
+			break;
 		
-		// perform temperature conversion
-		reset();
-		write_byte(0xCC);	// skip ROM
-		write_byte(0x44);	// single temp conversion
+		case OW_IDLE:
+			if (pending)
+			{
+				// the resolution has been written to a probe
+				pending = false;
+				if (xfer.state != OW_XFER_DONE)
+				{
+					new_search();
+				}
+				else if (++config_ndx >= num_probes)
+				{
+					reconfig = false;
+					config_ndx = 0;
+				}
+				break;
+			}
+			
+			if ((int32_t)(now - wait_until) < 0)
+			{
+				break;
+			}
+			
+			if (reconfig)
+			{
+				// set the resolutions first, one probe per run
+				if (!write_config(config_ndx))
+				{
+					pending = true;
+				}
+				break;
+			}
+			
+			if (start_conversion())
+			{
+				break;
+			}
+			
+			wait_until += period;
+			if ((int32_t)(now - wait_until) >= 0)
+			{
+				// fell behind, resync to now
+				wait_until = now + period;
+			}
+			
+			conv_start = now;
+			pending = true;
+			state = OW_CONVERT;
+			break;
 		
-		// read in scratch pad
-		reset();
-		write_byte(0xCC);	// skip ROM
-		write_byte(0xBE);	// read scratchpad
+		case OW_CONVERT:
+			if (pending)
+			{
+				pending = false;
+				if (xfer.state != OW_XFER_DONE)
+				{
+					// every probe is gone
+					new_search();
+					break;
+				}
+				
+				if (xfer.nrx == 0 || scratch[0] == 0)
+				{
+					// conversion just started, or still going
+					break;
+				}
+			}
+			else if ((now - conv_start) < conv_time())
+			{
+				if (!poll_conversion())
+				{
+					pending = true;
+				}
+				break;
+			}
+			
+			read_ndx = 0;
+			tries = 0;
+			state = OW_READ;
+			break;
 		
-		// read temperature
-		low_byte = read_byte();
-		high_byte = read_byte();
-		temp = (high_byte << BYTE_SHIFT) | low_byte;
-		temp = convert_temp(temp);
-		temp_f = TEMP_C_TO_F((int32_t)temp);
+		case OW_READ:
+		default:
+			if (!pending)
+			{
+				if (!read_start(read_ndx))
+				{
+					pending = true;
+				}
+				break;
+			}
+			
+			pending = false;
+			status = read_end(read_ndx);
+			
+			if (status == OW_BAD_CRC && tries++ < OW_READ_RETRIES)
+			{
+				// read the same probe again on the next run
+				break;
+			}
+			
+			if (status == OW_OK)
+			{
+				publish(read_ndx);
+			}
+			else if (status == OW_NO_DEVICE)
+			{
+				// the reading is stale until the probe is found again
+				water_temps[slots[read_ndx]] = WATER_TEMP_NONE;
+				lost_probe = true;
+			}
+			
+			tries = 0;
+			if (++read_ndx < num_probes)
+			{
+				break;
+			}
+			
+			if (lost_probe)
+			{
+				new_search();
+			}
+			else
+			{
+				state = OW_IDLE;
+			}
+			break;
+	}
+}
+
+/*****************************************************************************
+ * ISR:			TIMER1_COMPA_vect
+ * Description:	This ISR runs the time slots of the background transfer, one
+ *				compare match at a time. The short parts of a slot, which
+ *				have tight timing, are done inside the ISR where no other
+ *				interrupt can stretch them. The long parts (the reset pulse,
+ *				a written 0 and the gap to the next slot) are timed by the
+ *				compare match. Another interrupt can only make those later,
+ *				which the 1-Wire timing allows for.
+ ****************************************************************************/
+ISR (TIMER1_COMPA_vect)
+{
+	ow_xfer *xfer = ow_cur;
+	bool cmp_bit, dir;
+	uint8_t *p_byte;
+	uint8_t msk;
+	
+	if (xfer == NULL)
+	{
+		// nothing running, stop the timer
+		TIMSK1 = 0;
+		TCCR1B = (1 << WGM12);
+		return;
+	}
+	
+	if (ow_low)
+	{
+		// end of a reset pulse or a written 0
+		OW_DDR_REG(ow_pins) &= ~ow_msk;
+		ow_low = false;
+		ow_wait(ow_after);
+		return;
+	}
+	
+	switch (ow_step)
+	{
+		case OW_STEP_RESET:
+			if (ow_phase == 0)
+			{
+				if (!(OW_PIN_REG(ow_pins) & ow_msk))
+				{
+					// line held low, nothing can answer
+					ow_finish(OW_XFER_NO_DEVICE);
+					break;
+				}
+				
+				OW_DDR_REG(ow_pins) |= ow_msk;
+				ow_low = true;
+				ow_after = OW_PRESENCE_US;
+				ow_wait(OW_RESET_LOW_US);
+				ow_phase = 1;
+				break;
+			}
+			
+			if (OW_PIN_REG(ow_pins) & ow_msk)
+			{
+				// no presence pulse
+				ow_finish(OW_XFER_NO_DEVICE);
+				break;
+			}
+			
+			ow_wait(OW_RESET_REC_US);
+			ow_step = OW_STEP_TX;
+			break;
 		
-		// update global value
-		if (dev_id == ID_SURFACE_TEMP)
-		{
-			surf_temp = temp_f;
-		}
-		else if (dev_id == ID_UNDERWATER_TEMP)
-		{
-			sub_temp = temp_f;
-		}
+		case OW_STEP_TX:
+			if (ow_ndx < xfer->ntx)
+			{
+				ow_write_slot(xfer->tx[ow_ndx] & ow_bit);
+				ow_next_bit();
+				break;
+			}
+			
+			ow_ndx = 0;
+			ow_phase = 0;
+			ow_step = OW_STEP_SEARCH;
+			// fall through, the line is free for the next slot
+		
+		case OW_STEP_SEARCH:
+			if (xfer->rom != NULL && ow_ndx < (OW_ROM_SIZE * 8))
+			{
+				p_byte = &xfer->rom[ow_ndx >> 3];
+				msk = (1 << (ow_ndx & 0x07));
+				
+				if (ow_phase == 0)
+				{
+					ow_id = ow_read_slot();
+					ow_phase = 1;
+				}
+				else if (ow_phase == 1)
+				{
+					cmp_bit = ow_read_slot();
+					
+					if (ow_id && cmp_bit)
+					{
+						// no device answered
+						ow_finish(OW_XFER_NO_DEVICE);
+						break;
+					}
+					
+					if (ow_id != cmp_bit)
+					{
+						// every device left has the same bit
+						dir = ow_id;
+					}
+					else
+					{
+						// fork, go the way search_start set up
+						dir = (*p_byte & msk);
+						if (!dir)
+						{
+							xfer->fork = ow_ndx + 1;
+						}
+					}
+					
+					*p_byte = (dir ? *p_byte | msk : *p_byte & ~msk);
+					ow_phase = 2;
+				}
+				else
+				{
+					// writing the bit drops the devices that do not match
+					ow_write_slot(*p_byte & msk);
+					ow_ndx++;
+					ow_phase = 0;
+				}
+				break;
+			}
+			
+			ow_ndx = 0;
+			ow_bit = 0x01;
+			ow_step = OW_STEP_RX;
+			// fall through, the line is free for the next slot
 		
-		//DBG(this->p_serial, "Temp sensor %d: %d.%02dC or %ld.%02ldF\r\n",
-		//	dev_id, 
-		//	(temp / 100), (temp % 100),
-		//	(temp_f / 100), (temp_f % 100));
-	//}
-	runs++;
-}
\ No newline at end of file
+		case OW_STEP_RX:
+		default:
+			if (ow_ndx < xfer->nrx)
+			{
+				if (ow_bit == 0x01)
+				{
+					xfer->rx[ow_ndx] = 0;
+				}
+				if (ow_read_slot())
+				{
+					xfer->rx[ow_ndx] |= ow_bit;
+				}
+				ow_next_bit();
+				break;
+			}
+			
+			ow_finish(OW_XFER_DONE);
+			break;
+	}
+}
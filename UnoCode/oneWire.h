@@ -11,18 +11,135 @@
 #include "serial.h"
 #include <util/delay.h>
 
-#define NO_ID				0
-#define ID_SURFACE_TEMP		2
-#define ID_UNDERWATER_TEMP	3
+/* Registers of a bus, from the PIN register of its port. The DDR and PORT
+ * registers of a port always follow its PIN register. */
+#define OW_PIN_REG(pins)	(*(pins))
+#define OW_DDR_REG(pins)	(*((pins) + 1))
+#define OW_PORT_REG(pins)	(*((pins) + 2))
 
-#define DATA_DDR	DDRD
-#define DATA_PORT	PORTD
-#define DATA_PIN	PIND
+// ROM and function commands
+#define OW_SEARCH_ROM		0xF0
+#define OW_MATCH_ROM		0x55
+#define OW_SKIP_ROM			0xCC
+#define OW_CONVERT_T		0x44
+#define OW_WRITE_SCRATCH	0x4E
+#define OW_READ_SCRATCH		0xBE
+
+// Size of a ROM code, family code first, and the DS18B20 family code
+#define OW_ROM_SIZE			8
+#define OW_FAMILY_DS18B20	0x28
+
+// Most probes that can share one pin
+#ifndef OW_MAX_PROBES
+#define OW_MAX_PROBES		8
+#endif
+
+// Slot given to a probe that has none free
+#define OW_NO_SLOT			0xFF
+
+// Scratchpad size and the bytes in it used here, the CRC covers the rest
+#define OW_SCRATCH_SIZE		9
+#define OW_SCRATCH_TEMP_LSB	0
+#define OW_SCRATCH_TEMP_MSB	1
+#define OW_SCRATCH_CONFIG	4
+#define OW_SCRATCH_CRC		8
+
+// Resolution settings in bits, the DS18B20 powers up in 12 bit
+#define OW_MIN_RESOLUTION	9
+#define OW_MAX_RESOLUTION	12
+#define OW_DEF_RESOLUTION	12
+
+// Configuration register, the resolution sits above 5 bits always read as 1
+#define OW_CFG_RES_SHIFT	5
+#define OW_CFG_RES_MSK		0x03
+#define OW_CFG_RESERVED		0x1F
+
+// Alarm limits written along with the configuration, the factory defaults
+#define OW_ALARM_HIGH		0x4B
+#define OW_ALARM_LOW		0x46
+
+// Times a probe is read again after a bad scratchpad CRC
+#ifndef OW_READ_RETRIES
+#define OW_READ_RETRIES		2
+#endif
+
+// Conversion time at 9 bit resolution in ms, it doubles with each extra bit
+#define OW_CONV_MS_9BIT		94
+
+// Standard speed timing in us (Maxim application note 126). Each slot is 
+// OW_SLOT_US long, recovery included.
+#define OW_RESET_LOW_US		480
+#define OW_PRESENCE_US		70
+#define OW_RESET_REC_US		410
+#define OW_SLOT_US			65
+#define OW_W1_LOW_US		6
+#define OW_W0_LOW_US		60
+#define OW_R_LOW_US			2
+#define OW_R_SAMPLE_US		9
+#define OW_REC_US			5
+
+// Timer1 runs the time slots, at 0.5 us a count
+#define OW_TMR_PRESCALE		8
+#define OW_US_TO_TICKS(us)	((us) * (F_CPU / OW_TMR_PRESCALE / 1000000UL))
+
+/* Background transfers that can wait for the timer behind the running one,
+ * one for each bus is enough */
+#ifndef OW_QUEUE_SIZE
+#define OW_QUEUE_SIZE		2
+#endif
+
+// Task steps: find the probes on the bus, start a conversion on all of them
+// at once, wait for it to finish, then read each probe in turn
+enum ow_State {OW_SEARCH, OW_IDLE, OW_CONVERT, OW_READ};
+
+// Result of reading a probe
+enum ow_Status {OW_OK, OW_NO_DEVICE, OW_BAD_CRC};
+
+// Background transfer states
+enum ow_Xfer {OW_XFER_IDLE, OW_XFER_BUSY, OW_XFER_DONE, OW_XFER_NO_DEVICE};
+
+/* Water temperature probe settings. Each bus looks up the probes it finds in
+ * a table of these. A probe listed by ROM code gets its own entry. An entry 
+ * with a ROM of all zeros goes to the next probe found on its bus that is 
+ * not listed by ROM, in the order the search finds them. A probe with no 
+ * entry gets the next free slot, no calibration and the bus resolution. 
+ */
+struct ow_probe {
+	volatile uint8_t *pins;		// PIN register of the port the bus is on
+	uint8_t pin;				// bit of the port the bus is on
+	uint8_t rom[OW_ROM_SIZE];	// ROM code, or all zeros for any probe
+	uint8_t slot;				// index of the reading in water_temps
+	int16_t cal;				// added to the reading, C * 100
+	uint8_t res;				// resolution in bits, 9 to 12
+};
+
+/* Background 1-Wire transfer, run by the Timer1 compare interrupt. The bus is
+ * reset first if asked, then the tx bytes are written, then if rom is not 
+ * NULL the 64 bits of a ROM are searched for, then nrx bytes are read into 
+ * rx. A search goes the way of the bit in rom where devices disagree, and 
+ * leaves the ROM found in rom and the last bit it went the 0 way at such a
+ * fork in fork. The transfer and its buffers must stay valid until the state
+ * is no longer OW_XFER_BUSY.
+ */
+struct ow_xfer {
+	volatile uint8_t *pins;		// PIN register of the port the bus is on
+	uint8_t pin;				// bit of the port the bus is on
+	bool reset;					// start with a reset and presence pulse
+	const uint8_t *tx;			// bytes to write
+	uint8_t ntx;				// number of bytes to write
+	uint8_t *rom;				// ROM to search along, or NULL
+	uint8_t fork;				// last fork the search took 0 at, 1 based
+	uint8_t *rx;				// buffer to hold the bytes read
+	uint8_t nrx;				// number of bytes to read
+	volatile ow_Xfer state;		// state of the transfer, set by the ISR
+};
 
 /*****************************************************************************
  * Class:		oneWire
  * Description:	The oneWire class enables the microcontroller to 
- *				communicate with other oneWire devices.
+ *				communicate with other oneWire devices. The time slots are
+ *				made by the Timer1 compare interrupt, so the main loop goes
+ *				on while a transfer is on the bus.
  ****************************************************************************/
 class oneWire
 {
@@ -33,26 +150,108 @@ class oneWire
 		// serial debug connection
 		serial *p_serial;
 
-		// oneWire data input/output pin
+		// PIN register of the port and the bit of it the bus is on
+		volatile uint8_t *data_pins;
 		uint8_t data_line;
-
-		// unique device id
-		uint8_t dev_id;
 		
-		// this method resets the oneWire device
-		bool reset (void);
-
-		// this method writes one byte to the oneWire device
-		void write_byte (uint8_t byte);
-
-		// this method writes a logical high to the oneWire device
-		void write_1 (void);
-
-		// this method writes a logical low to the oneWire device
-		void write_0 (void);
+		// probe settings, only the entries for this bus are used
+		const ow_probe *table;
+		uint8_t table_len;
+		
+		// step the task is on, and if it has a transfer out on the bus
+		ow_State state;
+		bool pending;
+		
+		// transfer on the bus, the bytes it writes and the bytes read back
+		ow_xfer xfer;
+		uint8_t cmd[OW_ROM_SIZE + 2];
+		uint8_t scratch[OW_SCRATCH_SIZE];
+		
+		// ROM codes, settings and latest temperatures (C * 100) of the 
+		// probes found, the settings are NULL for a probe with no entry
+		uint8_t roms[OW_MAX_PROBES][OW_ROM_SIZE];
+		const ow_probe *settings[OW_MAX_PROBES];
+		uint8_t slots[OW_MAX_PROBES];
+		int16_t temps[OW_MAX_PROBES];
+		uint8_t num_probes;
+		
+		// slots given to probes with no entry
+		uint16_t free_slots;
+		
+		// probe the read step is on
+		uint8_t read_ndx;
+		
+		// ROM search state, the last ROM found, the last bit the search took
+		// the 0 path at where it could have taken either, and if the last
+		// ROM was found
+		uint8_t search_rom[OW_ROM_SIZE];
+		uint8_t last_fork;
+		bool last_rom;
+		
+		// a probe did not answer, search the bus again
+		bool lost_probe;
+		
+		// resolution in bits of probes with no entry, the resolution set
+		// for every probe (0 to use the table), if it still has to be 
+		// written to the probes and the probe being written
+		uint8_t resolution;
+		uint8_t res_set;
+		bool reconfig;
+		uint8_t config_ndx;
+		
+		// reads of the probe the read step is on that failed the CRC
+		uint8_t tries;
+		
+		// ROMs and scratchpads that failed the CRC
+		uint16_t crc_errs;
+		
+		// ms between samples and the tick the next one is due at
+		uint16_t period;
+		uint32_t wait_until;
+		
+		// tick the running conversion was started at
+		uint32_t conv_start;
+		
+		// this method starts a transfer of the cmd and scratch buffers
+		bool begin (bool reset, uint8_t ntx, uint8_t nrx, uint8_t *rom);
+		
+		// this method addresses one probe, or all of them if rom is NULL
+		uint8_t select (const uint8_t *rom);
+		
+		// these methods look for the next probe on the bus and keep it
+		bool search_start (void);
+		bool search_end (void);
+		
+		// this method starts the search for probes over
+		void new_search (void);
+		
+		// these methods match the probes found to their settings
+		void assign_probes (void);
+		const ow_probe* find_setting (const uint8_t *rom, uint8_t *p_used);
+		uint8_t take_slot (void);
+		
+		// this method returns the resolution a probe should be at
+		uint8_t probe_res (uint8_t ndx);
+		
+		// this method writes the resolution to one probe
+		bool write_config (uint8_t ndx);
+		
+		// these methods start a conversion and check if it is done
+		bool start_conversion (void);
+		bool poll_conversion (void);
+		
+		// these methods read a probe and check the result
+		bool read_start (uint8_t ndx);
+		ow_Status read_end (uint8_t ndx);
+		
+		// this method updates the shared temperature of one probe
+		void publish (uint8_t ndx);
+		
+		// this method returns how long a conversion takes in ms
+		uint16_t conv_time (void);
 
-		// this method reads one byte of data from the oneWire device
-		uint8_t read_byte (void);
+		// this method computes the Dallas CRC-8 of a buffer
+		static uint8_t crc8 (const uint8_t *src, uint8_t len);
 
 		// this method converts the raw temperature 
 		// data to human readable data
@@ -61,11 +260,24 @@ class oneWire
 	public:
 		// no public class variables
 		
-		// this constructor sets up the oneWire for use
-		oneWire (serial *ptr_serial, uint8_t pin, uint8_t id);
+		// this constructor sets up a bus for use, sampling every period ms
+		oneWire (serial *ptr_serial, volatile uint8_t *pins, uint8_t pin,
+				 const ow_probe *probes, uint8_t num, uint16_t sample_period,
+				 uint8_t res);
 		
 		// this method runs the oneWire task
 		void oneWireTask (void);
+		
+		// this method changes the resolution of every probe on the bus
+		void set_resolution (uint8_t res);
+		
+		// Getter Methods
+		uint8_t get_num_probes (void)		{ return num_probes;	};
+		int16_t get_temp (uint8_t ndx)		{ return temps[ndx];	};
+		const uint8_t* get_rom (uint8_t ndx)	{ return roms[ndx];	};
+		uint8_t get_slot (uint8_t ndx)		{ return slots[ndx];	};
+		uint8_t get_resolution (void)		{ return resolution;	};
+		uint16_t get_crc_errs (void)		{ return crc_errs;		};
 };
 
 
@@ -0,0 +1,340 @@
+/*****************************************************************************
+ * File:		scheduler.cpp
+ * Description:	This file contains the scheduler class, which runs each of
+ *				the sensor tasks at its own period based on a 1ms timer tick.
+ * Created:		10/17/2026
+ * Authors:		Jill Thetford, Daniel Griffith
+ ****************************************************************************/
+#include "scheduler.h"
+
+/*****************************************************************************
+ * Method:		scheduler
+ * Description:	This constructor sets up an empty task table and starts the
+ *				timer2 tick.
+ ****************************************************************************/
+scheduler::scheduler (void)
+{
+	num_tasks = 0;
+	lost_tasks = 0;
+	slept = 0;
+
+	init_timer();
+	
+	window_start = ticks();
+}
+
+/*****************************************************************************
+ * Method:		init_timer
+ * Description:	This method sets up timer2 in clear timer on compare match
+ *				(CTC) mode with a prescaler of 64 so that the compare A
+ *				interrupt fires once every millisecond.
+ ****************************************************************************/
+void scheduler::init_timer (void)
+{
+	// CTC mode, top = OCR2A
+	TCCR2A = (1 << WGM21);
+
+	// set prescaler to 64
+	TCCR2B = (1 << CS22);
+
+	// set timer output compare match for a 1ms period
+	OCR2A = SCHED_TICK_TOP;
+	TCNT2 = 0;
+
+	// clear any pending compare match and enable the interrupt
+	TIFR2 = (1 << OCF2A);
+	TIMSK2 |= (1 << OCIE2A);
+
+	sei();
+}
+
+/*****************************************************************************
+ * Method:		add_task
+ * Description:	This method registers a task with the scheduler. The task is
+ *				first run offset ms from now and then every period ms after
+ *				that. Offsets can be used to keep tasks with the same period
+ *				from all running on the same tick.
+ *
+ * Parameters:	fn		- the function to run when the task is due
+ *				arg		- the argument to pass to the task function
+ *				period	- the period of the task in ms
+ *				offset	- the delay before the first run of the task in ms
+ * Return:		int8_t	- the id of the task, or SCHED_NO_TASK if the task
+ *						  table is full. Such tasks are counted, see 
+ *						  get_lost.
+ ****************************************************************************/
+int8_t scheduler::add_task (task_fn fn, void *arg, uint16_t period,
+							uint16_t offset)
+{
+	if (num_tasks >= SCHED_MAX_TASKS)
+	{
+		lost_tasks++;
+		return SCHED_NO_TASK;
+	}
+
+	tasks[num_tasks].fn = fn;
+	tasks[num_tasks].arg = arg;
+	tasks[num_tasks].period = period;
+	tasks[num_tasks].next_run = ticks() + offset;
+
+	return num_tasks++;
+}
+
+/*****************************************************************************
+ * Method:		set_period
+ * Description:	This method changes the period of a registered task. The new
+ *				period takes effect after the next run of the task.
+ *
+ * Parameters:	id		- the id of the task returned by add_task
+ *				period	- the new period of the task in ms
+ * Return:		bool	- status of operation (true = error, false = success)
+ ****************************************************************************/
+bool scheduler::set_period (int8_t id, uint16_t period)
+{
+	if (id < 0 || id >= num_tasks || period == 0)
+	{
+		return true;
+	}
+
+	tasks[id].period = period;
+
+	return false;
+}
+
+/*****************************************************************************
+ * Method:		trigger
+ * Description:	This method makes a registered task due immediately, so it
+ *				will be run on the next pass of the scheduler.
+ *
+ * Parameters:	id - the id of the task returned by add_task
+ ****************************************************************************/
+void scheduler::trigger (int8_t id)
+{
+	if (id >= 0 && id < num_tasks)
+	{
+		tasks[id].next_run = ticks();
+	}
+}
+
+/*****************************************************************************
+ * Method:		run
+ * Description:	This method runs every task whose due time has been reached.
+ *				The next due time is advanced by exactly one period so that
+ *				the time a task takes to run does not add to its period. If a
+ *				task has fallen more than a full period behind, the missed
+ *				runs are dropped rather than run back to back. If no task was
+ *				due, the CPU is put to sleep until the next interrupt.
+ ****************************************************************************/
+void scheduler::run (void)
+{
+	uint32_t now;
+	bool ran = false;
+
+	for (uint8_t ndx = 0; ndx < num_tasks; ndx++)
+	{
+		now = ticks();
+
+		if ((int32_t)(now - tasks[ndx].next_run) >= 0)
+		{
+			tasks[ndx].next_run += tasks[ndx].period;
+
+			if ((int32_t)(now - tasks[ndx].next_run) >= 0)
+			{
+				// task overran, resync to now
+				tasks[ndx].next_run = now + tasks[ndx].period;
+			}
+
+			tasks[ndx].fn(tasks[ndx].arg);
+			ran = true;
+		}
+	}
+	
+	update_duty();
+	
+	if (!ran)
+	{
+		sleep();
+	}
+}
+
+/*****************************************************************************
+ * Method:		sleep
+ * Description:	This method puts the CPU to sleep until the next interrupt.
+ *				Idle mode is used because the UART, timer0 (PIR lane timers)
+ *				and the synchronously clocked timer2 tick all stop in the 
+ *				deeper power-save mode. The timer2 tick, the PIR pin change
+ *				interrupt or the UART will wake the CPU.
+ *				While UV samples are wanted, each sleep also takes one of 
+ *				them. If nothing needs the I/O clock, ADC noise reduction 
+ *				mode is used. That stops the CPU and I/O clocks, which keeps
+ *				their noise out of the conversion, and entering it starts
+ *				the conversion. The ADC interrupt wakes the CPU when it is
+ *				done, and the tick is moved on by the time timer2 was 
+ *				stopped. The pin change interrupt can wake it first, and
+ *				then the clocks have been running since, so the tick is
+ *				only moved on if it was the ADC interrupt that woke it. 
+ *				The CPU runs the interrupt that woke it and then at least
+ *				one instruction after the sleep before any other, so 
+ *				interrupts are disabled right there and adc_woke, set by
+ *				the ADC interrupt, tells which one it was.
+ *				Otherwise the conversion is started here and the CPU idles
+ *				through it.
+ *				The time spent asleep is added to the duty cycle measurement.
+ ****************************************************************************/
+void scheduler::sleep (void)
+{
+	uint32_t start;
+	bool adc_sleep = false;
+	
+	cli();
+	adc_woke = 0;
+	
+	if (uv_samples != 0 && !(ADCSRA & (1 << ADSC)))
+	{
+		adc_sleep = adc_sleep_ok();
+		if (!adc_sleep)
+		{
+			// sample with the clocks running
+			ADCSRA |= (1 << ADSC);
+		}
+	}
+	
+	set_sleep_mode(adc_sleep ? SLEEP_MODE_ADC : SLEEP_MODE_IDLE);
+	
+	start = timestamp();
+	sleep_enable();
+	
+	// sei takes effect after the next instruction, so no interrupt can
+	// sneak in between enabling interrupts and sleeping
+	sei();
+	sleep_cpu();
+	
+	// only the interrupt that woke the CPU has run yet
+	cli();
+	sleep_disable();
+	
+	if (adc_sleep && adc_woke)
+	{
+		adc_sleep_ticks();
+	}
+	
+	slept += timestamp() - start;
+	sei();
+}
+
+/*****************************************************************************
+ * Method:		adc_sleep_ok
+ * Description:	This method checks that nothing needs the I/O clock for the
+ *				length of an ADC conversion: the UART has nothing left to
+ *				send, and no 1-Wire transfer (timer1) or background i2c
+ *				transaction is running. A byte that starts arriving on the
+ *				UART during the conversion is lost, the frame CRC catches
+ *				it. Timer0 stops too, which stretches the PIR lane timers by
+ *				the length of the conversion. Must be called with interrupts
+ *				disabled.
+ *
+ * Return:		bool - if the CPU can sleep in ADC noise reduction mode
+ ****************************************************************************/
+bool scheduler::adc_sleep_ok (void)
+{
+	if ((UCSR0B & (1 << UDRIE0)) || !(UCSR0A & (1 << TXC0)))
+	{
+		// still sending
+		return false;
+	}
+	
+	return (TIMSK1 == 0) && !(TWCR & (1 << TWIE));
+}
+
+/*****************************************************************************
+ * Method:		adc_sleep_ticks
+ * Description:	This method moves timer2 on by the counts it missed while 
+ *				stopped for an ADC conversion. If that passes the end of the
+ *				tick, the tick count is moved on as the interrupt would have.
+ *				Must be called with interrupts disabled.
+ ****************************************************************************/
+void scheduler::adc_sleep_ticks (void)
+{
+	uint16_t cnt = TCNT2 + SCHED_ADC_CONV_COUNTS;
+	
+	if (cnt > SCHED_TICK_TOP)
+	{
+		cnt -= (SCHED_TICK_TOP + 1);
+		sys_ticks++;
+	}
+	
+	TCNT2 = (uint8_t)cnt;
+}
+
+/*****************************************************************************
+ * Method:		update_duty
+ * Description:	This method updates the shared duty cycle once every duty
+ *				window. The duty cycle is the fraction of the window spent
+ *				awake in tenths of a percent (1000 = never slept).
+ ****************************************************************************/
+void scheduler::update_duty (void)
+{
+	uint32_t now = ticks();
+	uint32_t window = now - window_start;
+	uint32_t slept_ms;
+	
+	if (window < SCHED_DUTY_WINDOW)
+	{
+		return;
+	}
+	
+	slept_ms = slept / SCHED_COUNTS_PER_MS;
+	slept_ms = (slept_ms > window ? window : slept_ms);
+	
+	duty_cycle = (uint16_t)(((window - slept_ms) * 1000) / window);
+	
+	window_start = now;
+	slept = 0;
+}
+
+/*****************************************************************************
+ * Method:		ticks
+ * Description:	This method reads the global tick count. The count is 32 bits
+ *				wide, so it has to be read with interrupts disabled.
+ *
+ * Return:		uint32_t - the number of ms since the scheduler started
+ ****************************************************************************/
+uint32_t scheduler::ticks (void)
+{
+	uint32_t now;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		now = sys_ticks;
+	}
+
+	return now;
+}
+
+/*****************************************************************************
+ * Method:		timestamp
+ * Description:	This method reads the current time in timer2 counts (4us)
+ *				from the tick count and the timer2 counter. A compare match 
+ *				that has happened but has not been serviced yet is accounted
+ *				for. Must be called with interrupts disabled.
+ *
+ * Return:		uint32_t - the current time in timer2 counts
+ ****************************************************************************/
+uint32_t scheduler::timestamp (void)
+{
+	uint32_t now = sys_ticks;
+	uint8_t cnt = TCNT2;
+	
+	if ((TIFR2 & (1 << OCF2A)) && cnt < (SCHED_TICK_TOP / 2))
+	{
+		// the counter wrapped but the tick interrupt has not run yet
+		now++;
+	}
+	
+	return (now * SCHED_COUNTS_PER_MS) + cnt;
+}
+
+ISR (TIMER2_COMPA_vect)
+{
+	sys_ticks++;
+}
@@ -0,0 +1,121 @@
+/*****************************************************************************
+ * File:		scheduler.h
+ * Description:	This file contains the class definition for the scheduler
+ *				class, a cooperative task scheduler driven by a 1ms timer2
+ *				tick.
+ * Created:		10/17/2026
+ * Authors:		Jill Thetford, Daniel Griffith
+ ****************************************************************************/
+#ifndef __SCHEDULER_H__
+#define __SCHEDULER_H__
+
+#define F_CPU 16000000UL
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <util/atomic.h>
+
+#include "shares.h"
+
+// maximum number of tasks that can be registered with the scheduler, main
+// registers 10 so there is room for two more. Each entry takes 10 bytes.
+#define SCHED_MAX_TASKS		12
+
+// timer2 runs at F_CPU / 64 = 250kHz, so 250 counts gives a 1ms tick
+#define SCHED_TICK_TOP		249
+
+// timer2 counts per ms, used to time sleep periods
+#define SCHED_COUNTS_PER_MS	250
+
+// timer2 counts one ADC conversion takes, 13 ADC clocks at F_CPU / 128.
+// Timer2 stops in ADC noise reduction sleep, so the tick loses this much
+// for each conversion slept through.
+#define SCHED_ADC_CONV_COUNTS	(13 * 128 / 64)
+
+// window in ms over which the duty cycle is measured
+#define SCHED_DUTY_WINDOW	10000
+
+// returned by add_task when the task table is full
+#define SCHED_NO_TASK		-1
+
+// a task is any function that takes a single pointer argument, typically
+// the object whose task method should be run
+typedef void (*task_fn)(void *arg);
+
+// Scheduler task table entry
+struct sched_task {
+	task_fn  fn;			// the function to run when the task is due
+	void*	 arg;			// the argument passed to the task function
+	uint16_t period;		// the period of the task in ms
+	uint32_t next_run;		// the tick at which the task is next due
+};
+
+/*****************************************************************************
+ * Class:		scheduler
+ * Description:	The scheduler class runs registered tasks at their own fixed
+ *				periods. A timer2 compare interrupt advances the global tick
+ *				count every millisecond and the main loop dispatches only
+ *				the tasks which are due. Between tasks the CPU sleeps in idle
+ *				mode until the next interrupt wakes it, or in ADC noise 
+ *				reduction mode while UV samples are being taken.
+ ****************************************************************************/
+class scheduler
+{
+	protected:
+		// No protected methods or class variables
+
+	private:
+		sched_task tasks[SCHED_MAX_TASKS];	// table of registered tasks
+		uint8_t num_tasks;					// number of registered tasks
+		uint8_t lost_tasks;					// tasks the table had no room for
+		
+		uint32_t window_start;				// start tick of duty window
+		uint32_t slept;						// timer2 counts spent asleep
+
+		// this method sets up timer2 to generate the 1ms tick
+		void init_timer (void);
+		
+		// this method sleeps the CPU until the next interrupt
+		void sleep (void);
+		
+		// this method checks if the CPU can sleep through an ADC conversion
+		static bool adc_sleep_ok (void);
+		
+		// this method adds the time of an ADC conversion to the tick
+		static void adc_sleep_ticks (void);
+		
+		// this method updates the measured duty cycle
+		void update_duty (void);
+		
+		// this method returns the time in timer2 counts
+		static uint32_t timestamp (void);
+
+	public:
+		// No public class variables
+
+		// this constructor sets up the scheduler and starts the tick
+		scheduler (void);
+
+		// this method registers a task to be run every period ms
+		int8_t add_task (task_fn fn, void *arg, uint16_t period,
+						 uint16_t offset);
+
+		// this method changes the period of a registered task
+		bool set_period (int8_t id, uint16_t period);
+
+		// this method makes a registered task due immediately
+		void trigger (int8_t id);
+
+		// this method runs every task which is currently due and then
+		// sleeps if nothing ran
+		void run (void);
+
+		// this method returns the number of ms since the scheduler started
+		static uint32_t ticks (void);
+		
+		// Getter Methods
+		uint8_t get_lost (void)				{ return lost_tasks;	};
+};
+
+#endif /* __SCHEDULER_H__ */
@@ -8,6 +8,25 @@
 #include "serial.h"		// header for this file
 #include "shares.h"		// extern globally shared variables
 #include "PIR.h"		// header that contains lane masks for lane states
+#include "scheduler.h"	// tick count for baud rate negotiation timeouts
+
+/* faster baud rates to try for the link, fastest first */
+static const uint32_t link_rates[] = {250000, 115200};
+#define NUM_LINK_RATES	(sizeof(link_rates) / sizeof(link_rates[0]))
+
+/* transmit ring buffer, shared with the data register empty interrupt */
+static volatile uint8_t tx_buf[SERIAL_TX_BUF_SIZE];
+static volatile uint8_t tx_head = 0;	// next free slot, written by send
+static volatile uint8_t tx_tail = 0;	// next byte out, written by the ISR
+static volatile uint16_t tx_overflows = 0;
+
+/* receive ring buffer and error counters, written by the receive ISR */
+static volatile uint8_t rx_buf[SERIAL_RX_BUF_SIZE];
+static volatile uint8_t rx_head = 0;	// next free slot, written by the ISR
+static volatile uint8_t rx_tail = 0;	// next byte in, written by receive
+static volatile uint16_t rx_overruns = 0;		// hardware overruns (DOR0)
+static volatile uint16_t rx_frame_errors = 0;	// framing errors (FE0)
+static volatile uint16_t rx_overflows = 0;		// bytes lost to a full buffer
 
 /*****************************************************************************
  * Method:		serial
@@ -20,38 +39,109 @@
 serial::serial (uint32_t baud, uint32_t clk)
 {
 	baud_rate = baud;		// store a local copy of baud rate
+	base_baud = baud;		// store a local copy of the starting baud rate
 	clk_speed = clk;		// store a local copy of clock speed of device
 	
+	link_state = LINK_START;
+	link_ndx = 0;
+	link_tries = 0;
+	link_time = 0;
+	link_errs = 0;
+	
+	frame_len = 0;
+	frame_drop = false;
+	
+	pkt_seq = 0;
+	
 	init();
 }
 
 /*****************************************************************************
  * Method:		init
  * Description:	This method initializes the registers on the ATmega328P for
- *				establishing a USART connection.
- * 
- * Return:		bool - the status of the operation (true  = success,
- *													false = failure)
+ *				establishing a USART connection. The UBRR value is computed
+ *				for both normal and double speed (U2X) mode, and whichever
+ *				lands closer to the desired baud rate is used. Normal mode
+ *				wins a tie since it samples each bit more times.
  ****************************************************************************/
 void serial::init (void)
 {
-	/* calculate ubrr for desired baud rate */
-	uint32_t ubrr = ((clk_speed / 16UL) / baud_rate) - 1;
-	UBRR0H = (uint8_t)(ubrr >> 8);
-	UBRR0L = (uint8_t)ubrr;
+	uint32_t ubrr_1x, ubrr_2x;
+	uint32_t baud_1x, baud_2x;
+	uint32_t err_1x, err_2x;
 	
-	/* Enable receiver and transmitter */
-	UCSR0B = ((1 << RXEN0) | (1 << TXEN0));
+	/* calculate rounded ubrr and resulting baud for both modes */
+	ubrr_1x = ((clk_speed + 8UL * baud_rate) / (16UL * baud_rate)) - 1;
+	ubrr_2x = ((clk_speed + 4UL * baud_rate) / (8UL * baud_rate)) - 1;
+	baud_1x = clk_speed / (16UL * (ubrr_1x + 1));
+	baud_2x = clk_speed / (8UL * (ubrr_2x + 1));
+	err_1x = (baud_1x > baud_rate ? baud_1x - baud_rate : baud_rate - baud_1x);
+	err_2x = (baud_2x > baud_rate ? baud_2x - baud_rate : baud_rate - baud_2x);
+	
+	if (err_2x < err_1x)
+	{
+		UBRR0H = (uint8_t)(ubrr_2x >> 8);
+		UBRR0L = (uint8_t)ubrr_2x;
+		UCSR0A = (1 << U2X0);
+		actual_baud = baud_2x;
+	}
+	else
+	{
+		UBRR0H = (uint8_t)(ubrr_1x >> 8);
+		UBRR0L = (uint8_t)ubrr_1x;
+		UCSR0A = 0;
+		actual_baud = baud_1x;
+	}
+	
+	/* Enable receiver, transmitter and the receive complete interrupt */
+	UCSR0B = ((1 << RXEN0) | (1 << TXEN0) | (1 << RXCIE0));
 	
 	/* Set frame format: 8data, 1stop bit */
 	UCSR0C = ((1 << USBS0) | (3 << UCSZ00));
-	UCSR0A &= ~(1 << U2X0);
+	
+	/* Carry on sending anything still queued */
+	if (tx_head != tx_tail)
+	{
+		UCSR0B |= (1 << UDRIE0);
+	}
+}
+
+/*****************************************************************************
+ * Method:		set_baud
+ * Description:	This method changes the baud rate of the link. Any frame
+ *				being assembled from the old rate is dropped. The transmit
+ *				buffer should be empty (see tx_idle) before calling this.
+ * 
+ * Parameters:	baud - the new baud rate
+ ****************************************************************************/
+void serial::set_baud (uint32_t baud)
+{
+	baud_rate = baud;
+	frame_len = 0;
+	frame_drop = false;
+	
+	init();
+}
+
+/*****************************************************************************
+ * Method:		tx_idle
+ * Description:	This method checks if every queued byte has been shifted out
+ *				onto the TX line, so the baud rate can be changed safely.
+ * 
+ * Return:		bool - if the transmitter is idle (true  = idle,
+ *												   false = still sending)
+ ****************************************************************************/
+bool serial::tx_idle (void)
+{
+	return (tx_head == tx_tail) && (UCSR0A & (1 << TXC0));
 }
 
 /*****************************************************************************
  * Method:		send
- * Description:	This method sends a byte of data over the TX line. The send
- *				operation may fail if it takes too long.
+ * Description:	This method queues a byte of data to be sent over the TX line
+ *				and enables the data register empty interrupt to send it. If
+ *				the transmit buffer is full the byte is dropped and counted
+ *				as an overflow.
  * 
  * Parameters:	data - the byte of data to transmit
  * Return:		bool - the status of the operation (true  = success,
@@ -59,35 +149,36 @@ void serial::init (void)
  ****************************************************************************/
 bool serial::send (uint8_t data)
 {
-	uint16_t cnt = 0;
+	uint8_t next = (tx_head + 1) & SERIAL_TX_BUF_MSK;
 	
-	/* Wait for empty transmit buffer */
-	while (!(UCSR0A & (1 << UDRE0)))// && cnt < SERIAL_TIMEOUT)
-	{
-		cnt++;
-	}
-	/*
-	if (cnt >= SERIAL_TIMEOUT)
+	if (next == tx_tail)
 	{
-		// send timed out
+		// buffer full, drop the byte
+		tx_overflows++;
 		return false;
 	}
-	*/
 	
-	/* Put data into buffer, sends the data */
-	UDR0 = data;
+	tx_buf[tx_head] = data;
+	tx_head = next;
+	
+	/* Enable the data register empty interrupt to start sending */
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		UCSR0B |= (1 << UDRIE0);
+	}
 	
 	return true;
 }
 
 /*****************************************************************************
  * Method:		send
- * Description:	This method sends a string of data over the TX line. A maximum
- *				of 255 bytes will be sent at a time. The total number of bytes
- *				transmitted will be returned.
+ * Description:	This method queues a string of data to be sent over the TX
+ *				line. A maximum of 255 bytes will be sent at a time. The total
+ *				number of bytes queued will be returned, which is less than
+ *				the string length if the transmit buffer filled up.
  * 
  * Parameters:	str - the string of data to be sent, maximum 255 bytes
- * Return:		uint8_t - the total number of characters successfully sent
+ * Return:		uint8_t - the total number of characters successfully queued
  ****************************************************************************/
 uint8_t serial::send (char *str)
 {
@@ -108,71 +199,876 @@ uint8_t serial::send (char *str)
 	return sent;
 }
 
+/*****************************************************************************
+ * Method:		tx_free
+ * Description:	This method returns the number of bytes that can be queued
+ *				before the transmit buffer is full.
+ * 
+ * Return:		uint8_t - the free space in the transmit buffer
+ ****************************************************************************/
+uint8_t serial::tx_free (void)
+{
+	return (tx_tail - tx_head - 1) & SERIAL_TX_BUF_MSK;
+}
+
+/*****************************************************************************
+ * Method:		get_tx_overflows
+ * Description:	This method returns the number of bytes that have been 
+ *				dropped because the transmit buffer was full.
+ * 
+ * Return:		uint16_t - the number of bytes dropped
+ ****************************************************************************/
+uint16_t serial::get_tx_overflows (void)
+{
+	uint16_t cnt;
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		cnt = tx_overflows;
+	}
+	
+	return cnt;
+}
+
+/*****************************************************************************
+ * Method:		send_num
+ * Description:	This method writes an unsigned number onto the TX line as
+ *				text in the given base. The digits are worked out least 
+ *				significant first into a small buffer on the stack, so no
+ *				string is ever built in RAM. The number is padded on the left
+ *				with the pad character up to the given width.
+ * 
+ * Parameters:	value	- the number to write
+ *				base	- the base to write the number in, 10 or 16
+ *				width	- the minimum number of characters to write
+ *				pad		- the character to pad with, ' ' or '0'
+ *				upper	- use upper case hex digits
+ ****************************************************************************/
+void serial::send_num (uint32_t value, uint8_t base, uint8_t width, char pad,
+					   bool upper)
+{
+	uint8_t digits[SERIAL_NUM_DIGITS];
+	uint8_t cnt = 0;
+	uint8_t digit;
+	
+	do
+	{
+		digit = value % base;
+		value /= base;
+		
+		if (digit < 10)
+		{
+			digits[cnt++] = '0' + digit;
+		}
+		else
+		{
+			digits[cnt++] = (upper ? 'A' : 'a') + digit - 10;
+		}
+	} while (value && cnt < SERIAL_NUM_DIGITS);
+	
+	while (width > cnt)
+	{
+		send((uint8_t)pad);
+		width--;
+	}
+	
+	while (cnt)
+	{
+		send(digits[--cnt]);
+	}
+}
+
+/*****************************************************************************
+ * Method:		send_dec
+ * Description:	This method writes a signed number onto the TX line in
+ *				decimal.
+ * 
+ * Parameters:	value - the number to write
+ ****************************************************************************/
+void serial::send_dec (int32_t value)
+{
+	if (value < 0)
+	{
+		send((uint8_t)'-');
+		send_num(-(uint32_t)value, 10, 0, ' ', false);
+	}
+	else
+	{
+		send_num((uint32_t)value, 10, 0, ' ', false);
+	}
+}
+
+/*****************************************************************************
+ * Method:		send_udec
+ * Description:	This method writes an unsigned number onto the TX line in
+ *				decimal.
+ * 
+ * Parameters:	value - the number to write
+ ****************************************************************************/
+void serial::send_udec (uint32_t value)
+{
+	send_num(value, 10, 0, ' ', false);
+}
+
+/*****************************************************************************
+ * Method:		send_hex
+ * Description:	This method writes a number onto the TX line in upper case 
+ *				hex, zero padded to the given number of digits.
+ * 
+ * Parameters:	value	- the number to write
+ *				digits	- the minimum number of hex digits to write
+ ****************************************************************************/
+void serial::send_hex (uint32_t value, uint8_t digits)
+{
+	send_num(value, 16, digits, '0', true);
+}
+
+/*****************************************************************************
+ * Method:		send_fixed
+ * Description:	This method writes a fixed point number onto the TX line with
+ *				two decimal places, rounded to the nearest hundredth. The 
+ *				scale is the raw value of 1.0, so temperatures in hundredths
+ *				use 100 and humidity in 1024ths of a percent uses 1024.
+ * 
+ * Parameters:	value	- the fixed point number to write
+ *				scale	- the raw value that represents 1.0
+ ****************************************************************************/
+void serial::send_fixed (int32_t value, uint16_t scale)
+{
+	uint32_t mag = (uint32_t)value;
+	uint32_t whole;
+	uint32_t frac;
+	
+	if (scale == 0)
+	{
+		return;
+	}
+	
+	if (value < 0)
+	{
+		send((uint8_t)'-');
+		mag = -mag;
+	}
+	
+	whole = mag / scale;
+	
+	// remainder is below scale, so times 100 can not overflow 32 bits
+	frac = (((mag % scale) * 100) + (scale / 2)) / scale;
+	
+	if (frac >= 100)
+	{
+		// rounded up into the next whole number
+		whole++;
+		frac -= 100;
+	}
+	
+	send_num(whole, 10, 0, ' ', false);
+	send((uint8_t)'.');
+	send_num(frac, 10, 2, '0', false);
+}
+
+/*****************************************************************************
+ * Method:		print
+ * Description:	This method writes formatted text straight onto the TX line,
+ *				taking the place of sprintf followed by send. Each character 
+ *				and each converted argument is queued as soon as it is ready,
+ *				so no string buffer is needed and vfprintf is not linked in.
+ *				A subset of the printf conversions is supported:
+ *
+ *				%d %i %u	int, or long with an l (%ld %lu)
+ *				%x %X		hex, int or long
+ *				%c %s %%	character, string, literal percent
+ *
+ *				An optional '0' flag and single digit width may be given,
+ *				e.g. %02ld. Fixed point values are written with send_fixed.
+ *				Unknown conversions are written out as they are.
+ * 
+ * Parameters:	fmt - the format string
+ *				... - the arguments for the format string
+ ****************************************************************************/
+void serial::print (const char *fmt, ...)
+{
+	va_list args;
+	uint32_t value;
+	uint8_t width;
+	char pad;
+	bool is_long;
+	const char *str;
+	
+	va_start(args, fmt);
+	
+	while (*fmt)
+	{
+		if (*fmt != '%')
+		{
+			send((uint8_t)*fmt++);
+			continue;
+		}
+		
+		fmt++;
+		width = 0;
+		pad = ' ';
+		is_long = false;
+		
+		if (*fmt == '0')
+		{
+			pad = '0';
+			fmt++;
+		}
+		
+		if (*fmt >= '1' && *fmt <= '9')
+		{
+			width = *fmt++ - '0';
+		}
+		
+		if (*fmt == 'l')
+		{
+			is_long = true;
+			fmt++;
+		}
+		
+		switch (*fmt)
+		{
+			case 'd':
+			case 'i':
+				value = (is_long ? (uint32_t)va_arg(args, int32_t) :
+								   (uint32_t)(int32_t)va_arg(args, int));
+				
+				if ((int32_t)value < 0)
+				{
+					send((uint8_t)'-');
+					value = -value;
+					width = (width ? width - 1 : 0);
+				}
+				
+				send_num(value, 10, width, pad, false);
+				break;
+				
+			case 'u':
+			case 'x':
+			case 'X':
+				value = (is_long ? va_arg(args, uint32_t) :
+								   (uint32_t)va_arg(args, unsigned int));
+				
+				send_num(value, (*fmt == 'u' ? 10 : 16), width, pad,
+						 (*fmt == 'X'));
+				break;
+				
+			case 'c':
+				send((uint8_t)va_arg(args, int));
+				break;
+				
+			case 's':
+				str = va_arg(args, const char *);
+				
+				while (*str)
+				{
+					send((uint8_t)*str++);
+				}
+				break;
+				
+			case '%':
+				send((uint8_t)'%');
+				break;
+				
+			case '\0':
+				// format string ended in the middle of a conversion
+				va_end(args);
+				return;
+				
+			default:
+				send((uint8_t)'%');
+				send((uint8_t)*fmt);
+				break;
+		}
+		
+		fmt++;
+	}
+	
+	va_end(args);
+}
+
 /*****************************************************************************
  * Method:		receive
- * Description:	This method receives a byte of data from the RX line, if there
- *				is data available, and returns it.
+ * Description:	This method takes the next received byte out of the receive
+ *				buffer, if there is data available, and returns it. It never 
+ *				waits for data to arrive.
  * 
  * Return:		uint8_t - the data received from the RX line, or 0xFF if an
  *					error occurs (i.e. data not ready)
  ****************************************************************************/
 uint8_t serial::receive (void)
 {
-	uint16_t cnt = 0;
+	uint8_t data;
 	
-	/* Wait for data to be received */
-	while ( !(UCSR0A & (1 << RXC0)) && cnt < SERIAL_TIMEOUT)
+	if (rx_head == rx_tail)
 	{
-		cnt++;
-	}
-	
-	if (cnt >= SERIAL_TIMEOUT)
-	{
-		// receive timed out
+		// no data received
 		return 0xFF;
 	}
 	
-	/* Get and return received data from buffer */
-	return (uint8_t)UDR0;
+	data = rx_buf[rx_tail];
+	rx_tail = (rx_tail + 1) & SERIAL_RX_BUF_MSK;
+	
+	return data;
 }
 
 /*****************************************************************************
  * Method:		data_avaialable
- * Description:	This method checks if there is data available on the RX line.
+ * Description:	This method checks if there is received data waiting in the
+ *				receive buffer.
  * 
  * Return:		bool - if there is data available  (true  = available, 
  *													false = not available) 
  ****************************************************************************/
 bool serial::data_available (void)
 {
-	return (UCSR0A & (1 << RXC0));
+	return (rx_head != rx_tail);
+}
+
+/*****************************************************************************
+ * Method:		get_frame
+ * Description:	This method moves received data into the frame being 
+ *				assembled until a zero byte delimiter is found. The frame is
+ *				then COBS decoded into buff and its header and CRC are 
+ *				checked. Frames that are too long, fail to decode or fail the
+ *				CRC are dropped. This method never waits for data to arrive,
+ *				so it is called repeatedly until it returns a frame.
+ * 
+ * Parameters:	buff - the buffer to decode the complete frame to
+ *				size - the size of buff
+ * Return:		uint8_t - the length of the frame header and payload copied
+ *						  to buff, or 0 if there is no complete frame yet
+ ****************************************************************************/
+uint8_t serial::get_frame (uint8_t *buff, uint8_t size)
+{
+	uint8_t data;
+	uint8_t len;
+	
+	while (data_available())
+	{
+		data = receive();
+		
+		if (data != PKT_DELIM)
+		{
+			if (frame_len < SERIAL_FRAME_SIZE)
+			{
+				frame[frame_len++] = data;
+			}
+			else
+			{
+				frame_drop = true;
+			}
+			continue;
+		}
+		
+		// delimiter found, decode the frame and start the next one
+		len = (frame_drop ? 0 : cobs_decode(frame, frame_len, buff, size));
+		frame_drop = false;
+		frame_len = 0;
+		
+		if (len < PKT_HDR_SIZE + PKT_CRC_SIZE
+		 || buff[PKT_NDX_VERSION] != PKT_VERSION
+		 || buff[PKT_NDX_LEN] != len - PKT_HDR_SIZE - PKT_CRC_SIZE)
+		{
+			// empty, corrupted or unsupported frame
+			continue;
+		}
+		
+		len -= PKT_CRC_SIZE;
+		if (crc16(buff, len) != (((uint16_t)buff[len + 1] << BYTE_SHIFT)
+								 | buff[len]))
+		{
+			continue;
+		}
+		
+		return len;
+	}
+	
+	return 0;
+}
+
+/*****************************************************************************
+ * Method:		get_rx_overruns
+ * Description:	This method returns the number of bytes lost because the
+ *				USART data register was not read in time (DOR0).
+ * 
+ * Return:		uint16_t - the number of data overruns
+ ****************************************************************************/
+uint16_t serial::get_rx_overruns (void)
+{
+	uint16_t cnt;
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		cnt = rx_overruns;
+	}
+	
+	return cnt;
+}
+
+/*****************************************************************************
+ * Method:		get_rx_frame_errors
+ * Description:	This method returns the number of bytes received with a bad
+ *				stop bit (FE0).
+ * 
+ * Return:		uint16_t - the number of framing errors
+ ****************************************************************************/
+uint16_t serial::get_rx_frame_errors (void)
+{
+	uint16_t cnt;
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		cnt = rx_frame_errors;
+	}
+	
+	return cnt;
+}
+
+/*****************************************************************************
+ * Method:		get_rx_overflows
+ * Description:	This method returns the number of bytes dropped because the 
+ *				receive buffer was full.
+ * 
+ * Return:		uint16_t - the number of bytes dropped
+ ****************************************************************************/
+uint16_t serial::get_rx_overflows (void)
+{
+	uint16_t cnt;
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		cnt = rx_overflows;
+	}
+	
+	return cnt;
+}
+
+/*****************************************************************************
+ * Method:		crc16
+ * Description:	This method computes the CRC-16 (CCITT polynomial 0x1021) of
+ *				a buffer, starting from PKT_CRC_INIT.
+ * 
+ * Parameters:	src - the buffer to compute the CRC of
+ *				len - the number of bytes in src
+ * Return:		uint16_t - the CRC of the buffer
+ ****************************************************************************/
+uint16_t serial::crc16 (const uint8_t *src, uint8_t len)
+{
+	uint16_t crc = PKT_CRC_INIT;
+	
+	while (len--)
+	{
+		crc = _crc_xmodem_update(crc, *src++);
+	}
+	
+	return crc;
+}
+
+/*****************************************************************************
+ * Method:		send_cobs
+ * Description:	This method COBS encodes a buffer straight onto the TX line.
+ *				Each run of up to 254 non-zero bytes is sent after a code
+ *				byte of the run length plus one. A code below 0xFF stands
+ *				for a zero byte following the run.
+ * 
+ * Parameters:	src - the buffer to encode
+ *				len - the number of bytes in src
+ ****************************************************************************/
+void serial::send_cobs (const uint8_t *src, uint8_t len)
+{
+	uint8_t start = 0;
+	uint8_t end;
+	uint8_t code;
+	
+	while (1)
+	{
+		// find the end of this run of non-zero bytes
+		for (end = start; end < len && src[end] && (end - start) < 0xFE; end++);
+		
+		code = end - start + 1;
+		send(code);
+		for (uint8_t ndx = start; ndx < end; ndx++)
+		{
+			send(src[ndx]);
+		}
+		
+		if (end >= len)
+		{
+			break;
+		}
+		
+		// skip the zero byte the code stands for, a full run has none
+		start = (code < 0xFF ? end + 1 : end);
+	}
+}
+
+/*****************************************************************************
+ * Method:		cobs_decode
+ * Description:	This method decodes a COBS encoded buffer, without its zero 
+ *				byte delimiters, into dst.
+ * 
+ * Parameters:	src  - the encoded buffer
+ *				len  - the number of bytes in src
+ *				dst  - the buffer to hold the decoded data
+ *				size - the size of dst
+ * Return:		uint8_t - the number of decoded bytes, or 0 if src is not a
+ *						  valid encoding or does not fit in dst
+ ****************************************************************************/
+uint8_t serial::cobs_decode (const uint8_t *src, uint8_t len, uint8_t *dst,
+							 uint8_t size)
+{
+	uint8_t in = 0;
+	uint8_t out = 0;
+	uint8_t code;
+	
+	while (in < len)
+	{
+		code = src[in++];
+		
+		if (code == PKT_DELIM || (in + code - 1) > len
+		 || (out + code - 1) > size)
+		{
+			// bad code or run past the end of either buffer
+			return 0;
+		}
+		
+		for (uint8_t ndx = 1; ndx < code; ndx++)
+		{
+			dst[out++] = src[in++];
+		}
+		
+		if (code < 0xFF && in < len)
+		{
+			if (out >= size)
+			{
+				return 0;
+			}
+			dst[out++] = 0;
+		}
+	}
+	
+	return out;
 }
 
+/*****************************************************************************
+ * Method:		send_frame
+ * Description:	This method builds a frame with a header, payload and CRC, 
+ *				COBS encodes it and queues it between zero byte delimiters.
+ *				The frame layout is described in serial.h. If the transmit
+ *				buffer does not have room for the whole frame, the frame is
+ *				dropped rather than sent in part.
+ * 
+ * Parameters:	type	- the frame type
+ *				payload	- the payload of the frame
+ *				len		- the number of bytes in payload
+ * Return:		bool - the status of the operation (true  = success,
+ *													false = failure)
+ ****************************************************************************/
+bool serial::send_frame (uint8_t type, const uint8_t *payload, uint8_t len)
+{
+	uint8_t raw[PKT_MAX_SIZE];
+	uint8_t raw_len = PKT_HDR_SIZE + len;
+	uint16_t crc;
+	
+	// frame, its COBS code byte and the two delimiters must all fit
+	if (len > PKT_MAX_PAYLOAD || tx_free() < raw_len + PKT_CRC_SIZE + 3)
+	{
+		tx_overflows += raw_len + PKT_CRC_SIZE;
+		return false;
+	}
+	
+	raw[PKT_NDX_VERSION] = PKT_VERSION;
+	raw[PKT_NDX_TYPE] = type;
+	raw[PKT_NDX_SEQ] = pkt_seq++;
+	raw[PKT_NDX_LEN] = len;
+	for (uint8_t ndx = 0; ndx < len; ndx++)
+	{
+		raw[PKT_HDR_SIZE + ndx] = payload[ndx];
+	}
+	
+	crc = crc16(raw, raw_len);
+	raw[raw_len++] = (uint8_t)crc;
+	raw[raw_len++] = (uint8_t)(crc >> BYTE_SHIFT);
+	
+	// leading delimiter ends any partial frame or debug text before it
+	send((uint8_t)PKT_DELIM);
+	send_cobs(raw, raw_len);
+	send((uint8_t)PKT_DELIM);
+	
+	return true;
+}
 
 /*****************************************************************************
  * Method:		sendPkt
- * Description:	This method sends a packet over the TX line that contains all
- *				of the latest sensor data.
+ * Description:	This method sends a sensor frame over the TX line that
+ *				contains all of the latest sensor data. The layout of the
+ *				payload is described in serial.h.
  ****************************************************************************/
 void serial::sendPkt (void)
 {
-	char pkt[PKT_SIZE];
+	uint8_t payload[PKT_SENSOR_LEN];
+	uint8_t *p = payload;
 	
-	// disable interrupts so data does not change
-	//cli();
+	p = put_le(p, (uint16_t)water_temps[WATER_SURFACE], 2);
+	p = put_le(p, (uint16_t)water_temps[WATER_UNDERWATER], 2);
+	p = put_le(p, (uint16_t)ext_temp, 2);
+	p = put_le(p, ext_hum, 4);
+	p = put_le(p, windy, 1);
+	p = put_le(p, (uint16_t)uv_ndx, 2);
+	p = put_le(p, lane_states & (LN_1 | LN_2), 1);
+	p = put_le(p, duty_cycle, 2);
+	p = put_le(p, ext_pres, 4);
+	p = put_le(p, (uint16_t)ext_dew, 2);
+	p = put_le(p, ext_abs_hum, 2);
+	p = put_le(p, (uint16_t)ext_heat, 2);
+	p = put_le(p, ext_slp, 4);
+	p = put_le(p, uv_var, 2);
+	p = put_le(p, uv_mean, 2);
+	p = put_le(p, uv_mean_bits, 1);
 	
-	sprintf(pkt, "<[=%ld,%ld,%ld,%lu,%d,%d,%d,%d=]>\r\n",
-		surf_temp,
-		sub_temp,
-		ext_temp,
-		ext_hum,
-		windy,
-		uv_ndx,
-		(lane_states & 0x01) ? 1 : 0,
-		(lane_states & 0x02) ? 1 : 0);
+	send_frame(PKT_TYPE_SENSOR, payload, PKT_SENSOR_LEN);
+}
+
+/*****************************************************************************
+ * Method:		sendWaterPkt
+ * Description:	This method sends a frame with the water temperature in each
+ *				slot of the probe table. The layout of the payload is 
+ *				described in serial.h.
+ ****************************************************************************/
+void serial::sendWaterPkt (void)
+{
+	uint8_t payload[WATER_SLOTS * PKT_WATER_ENTRY_LEN];
+	uint8_t *p = payload;
+	
+	for (uint8_t slot = 0; slot < WATER_SLOTS; slot++)
+	{
+		p = put_le(p, (uint16_t)water_temps[slot], PKT_WATER_ENTRY_LEN);
+	}
+	
+	send_frame(PKT_TYPE_WATER, payload, sizeof(payload));
+}
+
+/*****************************************************************************
+ * Method:		get_le
+ * Description:	This method reads a field stored least significant byte first
+ *				out of a received frame.
+ * 
+ * Parameters:	p		- the first byte of the field
+ *				size	- the size of the field in bytes
+ * Return:		uint32_t - the value of the field
+ ****************************************************************************/
+uint32_t serial::get_le (const uint8_t *p, uint8_t size)
+{
+	uint32_t value = 0;
 	
-	send(pkt);
+	while (size--)
+	{
+		value = (value << BYTE_SHIFT) | p[size];
+	}
+	
+	return value;
+}
+
+/*****************************************************************************
+ * Method:		put_le
+ * Description:	This method stores a value least significant byte first.
+ * 
+ * Parameters:	p		- where to store the value
+ *				value	- the value to store
+ *				size	- the number of bytes to store
+ * Return:		uint8_t* - the byte after the stored value
+ ****************************************************************************/
+uint8_t* serial::put_le (uint8_t *p, uint32_t value, uint8_t size)
+{
+	while (size--)
+	{
+		*p++ = (uint8_t)value;
+		value >>= BYTE_SHIFT;
+	}
+	
+	return p;
+}
+
+/*****************************************************************************
+ * Method:		next_link_rate
+ * Description:	This method gives up on the rate being negotiated, falls back
+ *				to the base rate and moves on to the next rate. Once every 
+ *				rate has failed, the link stays at the base rate and starts
+ *				over after LINK_RETRY_DELAY.
+ ****************************************************************************/
+void serial::next_link_rate (void)
+{
+	if (baud_rate != base_baud)
+	{
+		set_baud(base_baud);
+	}
+	
+	link_tries = 0;
+	link_time = scheduler::ticks();
+	
+	if (++link_ndx < NUM_LINK_RATES)
+	{
+		link_state = LINK_START;
+	}
+	else
+	{
+		link_ndx = 0;
+		link_state = LINK_DONE;
+	}
+}
+
+/*****************************************************************************
+ * Method:		linkTask
+ * Description:	This method runs the baud rate negotiation with the WiFi 
+ *				board. The Uno asks for each faster rate in turn, both sides 
+ *				switch once the WiFi board agrees, and the Uno then checks 
+ *				the link at the new rate. If the WiFi board stops answering
+ *				at any step both sides fall back to the base rate. Once at a
+ *				faster rate, framing errors mean the WiFi board has reset to 
+ *				the base rate, so the Uno falls back and negotiates again.
+ ****************************************************************************/
+void serial::linkTask (void)
+{
+	uint32_t now = scheduler::ticks();
+	uint8_t payload[PKT_BAUD_LEN];
+	
+	switch (link_state)
+	{
+		case LINK_START:
+			put_le(payload, link_rates[link_ndx], PKT_BAUD_LEN);
+			if (send_frame(PKT_TYPE_BAUD_REQ, payload, PKT_BAUD_LEN))
+			{
+				link_tries++;
+				link_time = now;
+				link_state = LINK_REQ;
+			}
+			break;
+			
+		case LINK_REQ:
+			if (now - link_time >= LINK_ACK_TIMEOUT)
+			{
+				if (link_tries < LINK_MAX_TRIES)
+				{
+					link_state = LINK_START;
+				}
+				else
+				{
+					next_link_rate();
+				}
+			}
+			break;
+			
+		case LINK_SWITCH:
+			// the request went out at the old rate, wait for it to finish
+			if (tx_idle())
+			{
+				set_baud(link_rates[link_ndx]);
+				put_le(payload, link_rates[link_ndx], PKT_BAUD_LEN);
+				send_frame(PKT_TYPE_BAUD_CHECK, payload, PKT_BAUD_LEN);
+				link_time = now;
+				link_state = LINK_CHECK;
+			}
+			break;
+			
+		case LINK_CHECK:
+			if (now - link_time >= LINK_ACK_TIMEOUT)
+			{
+				next_link_rate();
+			}
+			break;
+			
+		case LINK_DONE:
+		default:
+			if (baud_rate != base_baud)
+			{
+				if (get_rx_frame_errors() != link_errs)
+				{
+					set_baud(base_baud);
+					link_ndx = 0;
+					link_tries = 0;
+					link_state = LINK_START;
+				}
+			}
+			else if (now - link_time >= LINK_RETRY_DELAY)
+			{
+				link_state = LINK_START;
+			}
+			break;
+	}
+}
+
+/*****************************************************************************
+ * Method:		baud_ack
+ * Description:	This method handles a baud rate acknowledgment from the WiFi 
+ *				board. An answer to a request moves the negotiation on to 
+ *				switching rates, and an answer to the check at the new rate
+ *				completes it.
+ * 
+ * Parameters:	baud - the baud rate the WiFi board acknowledged
+ ****************************************************************************/
+void serial::baud_ack (uint32_t baud)
+{
+	if (baud != link_rates[link_ndx])
+	{
+		return;
+	}
+	
+	if (link_state == LINK_REQ)
+	{
+		link_state = LINK_SWITCH;
+	}
+	else if (link_state == LINK_CHECK)
+	{
+		link_errs = get_rx_frame_errors();
+		link_state = LINK_DONE;
+	}
+}
+
+ISR (USART_UDRE_vect)
+{
+	if (tx_head == tx_tail)
+	{
+		// nothing left to send, stop the interrupt
+		UCSR0B &= ~(1 << UDRIE0);
+	}
+	else
+	{
+		// clear the transmit complete flag, keeping the speed setting
+		UCSR0A = (UCSR0A & (1 << U2X0)) | (1 << TXC0);
+		UDR0 = tx_buf[tx_tail];
+		tx_tail = (tx_tail + 1) & SERIAL_TX_BUF_MSK;
+	}
+}
+
+ISR (USART_RX_vect)
+{
+	// status flags must be read before the data register
+	uint8_t status = UCSR0A;
+	uint8_t data = UDR0;
+	uint8_t next = (rx_head + 1) & SERIAL_RX_BUF_MSK;
+	
+	if (status & (1 << DOR0))
+	{
+		// one or more bytes were lost before this one
+		rx_overruns++;
+	}
+	
+	if (status & (1 << FE0))
+	{
+		// bad stop bit, the byte cannot be trusted
+		rx_frame_errors++;
+		return;
+	}
+	
+	if (next == rx_tail)
+	{
+		// buffer full, drop the byte
+		rx_overflows++;
+		return;
+	}
 	
-	// re-enable interrupts for PIR and timers
-	//sei();
+	rx_buf[rx_head] = data;
+	rx_head = next;
 }
\ No newline at end of file
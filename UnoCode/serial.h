@@ -13,18 +13,145 @@
 
 #include <stdlib.h>		// include standard library
 #include <avr/io.h>		// input-output ports, special registers
-#include <stdio.h>		// include standard I/O
+#include <stdarg.h>		// variable arguments for print
+#include <avr/interrupt.h>	// interrupt service routines
+#include <util/atomic.h>	// atomic blocks for shared buffer indexes
+#include <util/crc16.h>		// CRC-16 for sensor packets
 
-#define SERIAL_TIMEOUT	500
+// size of the transmit ring buffer, must be a power of 2 no larger than 256
+#ifndef SERIAL_TX_BUF_SIZE
+#define SERIAL_TX_BUF_SIZE	128
+#endif
+#define SERIAL_TX_BUF_MSK	(SERIAL_TX_BUF_SIZE - 1)
+
+// size of the receive ring buffer, must be a power of 2 no larger than 256
+#ifndef SERIAL_RX_BUF_SIZE
+#define SERIAL_RX_BUF_SIZE	32
+#endif
+#define SERIAL_RX_BUF_MSK	(SERIAL_RX_BUF_SIZE - 1)
+
+// maximum length of a received frame while still COBS encoded
+#define SERIAL_FRAME_SIZE	24
 
 #define SERIAL_MAX_SEND	255
 
-#define PKT_SIZE 50
+// most digits a 32 bit number can take when written as text (decimal)
+#define SERIAL_NUM_DIGITS	10
+
+// baud rate negotiation timing in ms
+#define LINK_ACK_TIMEOUT	250		// wait for the WiFi board to answer
+#define LINK_MAX_TRIES		3		// requests sent for each rate
+#define LINK_RETRY_DELAY	30000	// wait before trying again after failing
+
+/* Frame layout, used in both directions. All multi-byte fields are
+ * little-endian.
+ *
+ * [version][type][seq][len][payload ...][crc lo][crc hi]
+ *
+ * The CRC-16 (CCITT polynomial 0x1021, initial value 0xFFFF) covers the
+ * version byte through the end of the payload. Each frame is then COBS 
+ * (Consistent Overhead Byte Stuffing) encoded, which removes every zero 
+ * byte, and sent between two zero byte delimiters. A receiver that joins
+ * mid-frame or sees noise on the line resyncs at the next zero byte.
+ *
+ * The sensor payload (PKT_TYPE_SENSOR, Uno to WiFi board) is:
+ *
+ * surf_temp	int16_t		F * 100, water temperature slot WATER_SURFACE
+ * sub_temp		int16_t		F * 100, water temperature slot WATER_UNDERWATER
+ * ext_temp		int16_t		F * 100
+ * ext_hum		uint32_t	%rH * 1024
+ * windy		uint8_t		0 or 1
+ * uv_ndx		int16_t		UV index * 100
+ * lanes		uint8_t		bit 0 = lane 1 full, bit 1 = lane 2 full
+ * duty_cycle	uint16_t	tenths of a percent awake
+ * ext_pres		uint32_t	Pa
+ * ext_dew		int16_t		dew point, F * 100
+ * ext_abs_hum	uint16_t	absolute humidity, g/m^3 * 100
+ * ext_heat		int16_t		heat index, F * 100
+ * ext_slp		uint32_t	sea level pressure, Pa
+ * uv_var		uint16_t	variance of the UV samples, counts^2 * 100
+ * uv_mean		uint16_t	oversampled mean of the UV samples, counts of 
+ *							uv_mean_bits bits
+ * uv_mean_bits	uint8_t		resolution of uv_mean in bits, 0 until the first
+ *							reading
+ *
+ * The water temperature payload (PKT_TYPE_WATER, Uno to WiFi board) follows
+ * each sensor packet. It holds every slot of the probe table in order:
+ *
+ * temp			int16_t		F * 100, -32768 if no probe has been read
+ *
+ * The stats payload (PKT_TYPE_I2C_STATS, Uno to WiFi board) follows the
+ * water temperatures. It starts with:
+ *
+ * lost_tasks	uint8_t		tasks the scheduler table had no room for, which
+ *							never run
+ *
+ * then holds one entry for each i2c device that has had an error since 
+ * reset, none if the bus has been clean:
+ *
+ * addr			uint8_t		8 bit device address
+ * nacks		uint16_t	address or data bytes NACKed
+ * timeouts		uint16_t	transactions the bus hung on
+ * recoveries	uint16_t	times the bus had to be freed
+ *
+ * Commands (WiFi board to Uno):
+ *
+ * PKT_TYPE_CMD_SEND	no payload, send a sensor packet now
+ * PKT_TYPE_CMD_PERIOD	uint8_t task id, uint16_t period in ms
+ * PKT_TYPE_CMD_PROFILE	uint8_t BME280 sampling profile (bme_Profile)
+ * PKT_TYPE_CMD_OW_RES	uint8_t water temperature resolution in bits, 9 to 12
+ *
+ * Baud rate negotiation, all with a uint32_t baud rate payload:
+ *
+ * PKT_TYPE_BAUD_REQ	Uno asks to move the link to a new baud rate
+ * PKT_TYPE_BAUD_ACK	WiFi board agrees, then both switch to the new rate
+ * PKT_TYPE_BAUD_CHECK	Uno checks the link at the new rate, answered by
+ *						another PKT_TYPE_BAUD_ACK. With no answer both
+ *						sides fall back to the base rate.
+ */
+#define PKT_VERSION			8
+#define PKT_TYPE_SENSOR		0x01
+#define PKT_TYPE_I2C_STATS	0x02
+#define PKT_TYPE_WATER		0x03
+#define PKT_TYPE_CMD_SEND	0x10
+#define PKT_TYPE_CMD_PERIOD	0x11
+#define PKT_TYPE_CMD_PROFILE	0x12
+#define PKT_TYPE_CMD_OW_RES	0x13
+#define PKT_TYPE_BAUD_REQ	0x20
+#define PKT_TYPE_BAUD_ACK	0x21
+#define PKT_TYPE_BAUD_CHECK	0x22
+#define PKT_CRC_INIT		0xFFFF
+#define PKT_DELIM			0x00
+
+#define PKT_NDX_VERSION		0
+#define PKT_NDX_TYPE		1
+#define PKT_NDX_SEQ			2
+#define PKT_NDX_LEN			3
+
+#define PKT_HDR_SIZE		4
+#define PKT_CRC_SIZE		2
+#define PKT_MAX_PAYLOAD		35
+#define PKT_MAX_SIZE		(PKT_HDR_SIZE + PKT_MAX_PAYLOAD + PKT_CRC_SIZE)
+
+#define PKT_SENSOR_LEN		35
+#define PKT_WATER_ENTRY_LEN	2
+#define PKT_STATS_HDR_LEN	1
+#define PKT_CMD_PERIOD_LEN	3
+#define PKT_CMD_PROFILE_LEN	1
+#define PKT_CMD_OW_RES_LEN	1
+#define PKT_BAUD_LEN		4
+
+// Baud rate negotiation states
+enum link_State {LINK_START, LINK_REQ, LINK_SWITCH, LINK_CHECK, LINK_DONE};
 
 /*****************************************************************************
  * Class:		serial
  * Description:	The serial class enables the microcontroller to communicate 
- *				over a USART serial connection.
+ *				over a USART serial connection. Transmitted data is queued in
+ *				a ring buffer which is drained by the data register empty
+ *				interrupt, so sending never waits on the line. Received data
+ *				is queued by the receive complete interrupt and assembled into
+ *				COBS encoded frames.
  ****************************************************************************/
 class serial
 {
@@ -33,29 +160,110 @@ class serial
 		
 	private:
 		uint32_t baud_rate;		// the baud rate for serial connection
+		uint32_t base_baud;		// the baud rate both boards start at
+		uint32_t actual_baud;	// the baud rate the UBRR setting gives
 		uint32_t clk_speed;		// the clock speed of the microcontroller
 		
+		link_State link_state;	// baud rate negotiation state
+		uint8_t link_ndx;		// index of the rate being negotiated
+		uint8_t link_tries;		// requests sent for the current rate
+		uint32_t link_time;		// tick the current state started at
+		uint16_t link_errs;		// framing errors when the rate was set
+		
+		uint8_t frame[SERIAL_FRAME_SIZE];	// frame being assembled from RX
+		uint8_t frame_len;					// number of bytes in frame
+		bool frame_drop;					// frame too long, drop to delim
+		
+		uint8_t pkt_seq;		// sequence number of the next frame
+		
 		// this method initializes the USART Connection
 		void init (void);
 		
-		// this method sends a single byte of data over the TX line
+		// this method sets the baud rate and reinitializes the USART
+		void set_baud (uint32_t baud);
+		
+		// this method checks if every queued byte has left the TX line
+		bool tx_idle (void);
+		
+		// this method moves the negotiation to the next rate to try
+		void next_link_rate (void);
+		
+		// this method queues a single byte of data for the TX line
 		bool send (uint8_t data);
+		
+		// this method returns the free space in the transmit buffer
+		uint8_t tx_free (void);
+		
+		// this method COBS encodes a buffer onto the TX line
+		void send_cobs (const uint8_t *src, uint8_t len);
+		
+		// this method decodes a COBS encoded buffer
+		uint8_t cobs_decode (const uint8_t *src, uint8_t len, uint8_t *dst,
+							 uint8_t size);
+		
+		// this method writes a number in the given base onto the TX line
+		void send_num (uint32_t value, uint8_t base, uint8_t width, 
+					   char pad, bool upper);
 	
 	public:
 		// this is the constructor to set up the serial connection
 		serial (uint32_t baud, uint32_t clk);
 		
-		// this method sends a string of data over the TX line
+		// this method queues a string of data for the TX line
 		uint8_t send (char *str);
 		
+		// these methods write numbers as text straight onto the TX line
+		void send_dec (int32_t value);
+		void send_udec (uint32_t value);
+		void send_hex (uint32_t value, uint8_t digits);
+		void send_fixed (int32_t value, uint16_t scale);
+		
+		// this method writes formatted text straight onto the TX line
+		void print (const char *fmt, ...);
+		
+		// this method returns the number of bytes dropped on a full buffer
+		uint16_t get_tx_overflows (void);
+		
 		// this method receives a byte of data from the RX line
 		uint8_t receive (void);
 		
 		// this method checks if there is data available on the RX line
 		bool data_available (void);
 		
+		// this method assembles received data into a complete frame
+		uint8_t get_frame (uint8_t *buff, uint8_t size);
+		
+		// this method sends a frame with the given type and payload
+		bool send_frame (uint8_t type, const uint8_t *payload, uint8_t len);
+		
+		// these methods return the receive error counters
+		uint16_t get_rx_overruns (void);
+		uint16_t get_rx_frame_errors (void);
+		uint16_t get_rx_overflows (void);
+		
 		// this method sends a packet with all of the sensor values
 		void sendPkt (void);
+		
+		// this method sends a packet with every water temperature
+		void sendWaterPkt (void);
+		
+		// this method runs the baud rate negotiation with the WiFi board
+		void linkTask (void);
+		
+		// this method handles a baud rate acknowledgment from the WiFi board
+		void baud_ack (uint32_t baud);
+		
+		// this method returns the baud rate the link is running at
+		uint32_t get_baud (void)	{ return actual_baud; };
+		
+		// this method reads a little-endian field out of a frame
+		static uint32_t get_le (const uint8_t *p, uint8_t size);
+		
+		// this method stores a little-endian field into a frame
+		static uint8_t* put_le (uint8_t *p, uint32_t value, uint8_t size);
+		
+		// this method computes the CRC-16 of a buffer
+		static uint16_t crc16 (const uint8_t *src, uint8_t len);
 	
 };
 #endif /* __SERIAL_H__ */
\ No newline at end of file
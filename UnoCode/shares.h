@@ -8,9 +8,6 @@
 #ifndef __SHARES_H__
 #define __SHARES_H__
 
-// Debugging String
-extern char dbg_str[];
-
 // Commonly used shift amounts
 #define BYTE_SHIFT	8
 
@@ -22,13 +19,44 @@ extern volatile uint8_t portd_hist;
 extern volatile uint8_t ln_1_tmr_cnt;
 extern volatile uint8_t ln_2_tmr_cnt;
 
+// Globally shared variables for scheduler
+extern volatile uint32_t sys_ticks;
+extern uint16_t duty_cycle;
+
+// UV samples the ADC interrupt still has to take, the scheduler starts each
+// conversion when it sleeps
+extern volatile uint8_t uv_samples;
+
+// set by the ADC interrupt, so the scheduler can tell if it woke the CPU
+extern volatile uint8_t adc_woke;
+
+// Water temperatures, F * 100, in the slots set by the probe table. The
+// first two also go out in the sensor packet. The oneWire class keeps the
+// slots it has given out in 16 bit masks, so there can be at most 16.
+#ifndef WATER_SLOTS
+#define WATER_SLOTS			12
+#endif
+#if WATER_SLOTS > 16
+#error "WATER_SLOTS is over 16, the oneWire slot masks are 16 bits"
+#endif
+#define WATER_SURFACE		0
+#define WATER_UNDERWATER	1
+#define WATER_TEMP_NONE		((int16_t)0x8000)	// no probe read in the slot
+
 // Shared Variables for Sensor Values
-extern int32_t surf_temp;
-extern int32_t sub_temp;
+extern int16_t water_temps[WATER_SLOTS];
 extern int32_t ext_temp;
 extern uint32_t ext_hum;
+extern uint32_t ext_pres;
+extern int32_t ext_dew;
+extern uint16_t ext_abs_hum;
+extern int32_t ext_heat;
+extern uint32_t ext_slp;
 extern uint8_t windy;
 extern int16_t uv_ndx;
+extern uint16_t uv_var;
+extern uint16_t uv_mean;
+extern uint8_t uv_mean_bits;
 
 /*****************************************************************************
  * MACRO:		INPUT
@@ -48,14 +76,15 @@ extern int16_t uv_ndx;
 
 /*****************************************************************************
  * MACRO:		DBG
- * Description:	Prints via serial, the debugging message
+ * Description:	Prints via serial, the debugging message. The message is
+ *				formatted straight onto the TX line by serial::print, which
+ *				supports a subset of the printf conversions.
  * Parameters:	ser - the serial device to print to
  *				fmt - the format string
  *				... - any additional params for the format string
  ****************************************************************************/ 
 #define DBG(ser, fmt, ... )	{											\
-								sprintf(dbg_str, fmt, ##__VA_ARGS__);	\
-								(ser)->send((char*)dbg_str);			\
+								(ser)->print(fmt, ##__VA_ARGS__);		\
 							}
 
 /****************************************************************************
@@ -0,0 +1,68 @@
+/*****************************************************************************
+ * File:		hw.cpp
+ * Description:	This file holds what the host tests need in place of the
+ *				hardware and of main.cpp: the registers, the EEPROM, the
+ *				delay count and the shared variables.
+ ****************************************************************************/
+#include <string.h>
+#include <avr/io.h>
+#include <avr/eeprom.h>
+#include <util/delay.h>
+#include "shares.h"
+
+/* Registers */
+volatile uint8_t UBRR0H, UBRR0L, UCSR0A, UCSR0B, UCSR0C, UDR0, TWBR, TWAR,
+	DDRB, PORTB, PINB, DDRD, PORTD, PIND, TCCR0A, TCCR0B, TIMSK0, OCR0A,
+	OCR0B, TCNT0, TIFR0, TCCR1A, TCCR1B, TCCR1C, TIMSK1, TIFR1, TCCR2A,
+	TCCR2B, TCNT2, OCR2A, OCR2B, TIMSK2, TIFR2, ASSR, GTCCR, PCICR, PCMSK0,
+	PCMSK1, PCMSK2, PCIFR, EICRA, EIMSK, EIFR, ADCSRA, ADCSRB, ADMUX, ADCL,
+	ADCH, DIDR0, SMCR, MCUSR, MCUCR, PRR, SREG;
+volatile uint16_t TCNT1, OCR1A, OCR1B, ICR1, ADC, ADCW;
+hw_reg TWSR, TWCR, TWDR, DDRC, PORTC, PINC;
+
+/* Delay asked for, see util/delay.h */
+double test_delay_us = 0;
+void (*test_delay_hook)(double us) = NULL;
+
+/*****************************************************************************
+ * Function:	eeprom_read_block
+ * Description:	This function reads EEMEM data, which is kept in RAM.
+ ****************************************************************************/
+void eeprom_read_block (void *dst, const void *src, size_t n)
+{
+	memcpy(dst, src, n);
+}
+
+/*****************************************************************************
+ * Function:	eeprom_update_block
+ * Description:	This function writes EEMEM data, which is kept in RAM.
+ ****************************************************************************/
+void eeprom_update_block (const void *src, void *dst, size_t n)
+{
+	memcpy(dst, src, n);
+}
+
+/* Shared variables, as set up in main.cpp */
+volatile uint8_t lane_states = 0;
+volatile uint8_t ln_tmr_flg = 0x00;
+volatile uint8_t changedBits = 0x00;
+volatile uint8_t portd_hist = 0x00;
+volatile uint8_t ln_1_tmr_cnt = 0;
+volatile uint8_t ln_2_tmr_cnt = 0;
+volatile uint32_t sys_ticks = 0;
+uint16_t duty_cycle = 1000;
+volatile uint8_t uv_samples = 0;
+volatile uint8_t adc_woke = 0;
+int16_t water_temps[WATER_SLOTS];
+int32_t ext_temp = 0;
+uint32_t ext_hum = 0;
+uint32_t ext_pres = 0;
+int32_t ext_dew = 0;
+uint16_t ext_abs_hum = 0;
+int32_t ext_heat = 0;
+uint32_t ext_slp = 0;
+uint8_t windy = 0;
+int16_t uv_ndx = 0;
+uint16_t uv_var = 0;
+uint16_t uv_mean = 0;
+uint8_t uv_mean_bits = 0;
@@ -0,0 +1,617 @@
+/*****************************************************************************
+ * File:		ow_model.cpp
+ * Description:	This file models Timer1 and up to two 1-Wire buses of
+ *				DS18B20s for the host tests. Time only moves on while the
+ *				timer runs and when the interrupt asks for a delay, and
+ *				each interrupt can be held off by a set time, as another
+ *				interrupt would. The devices go by the length of each low
+ *				pulse the master makes, and the worst timing of each kind
+ *				is kept for the test to check against the DS18B20
+ *				datasheet. They answer within the tightest times it allows:
+ *				a presence pulse only from 60 us to 75 us after the reset,
+ *				and a 0 read only held for 15 us from the start of the slot.
+ ****************************************************************************/
+#include <math.h>
+#include <string.h>
+#include "ow_model.h"
+
+// Timer1 counts in a us
+#define TICKS_PER_US		OW_US_TO_TICKS(1)
+
+// DS18B20 timing in us
+#define DEV_RSTL_US			480		// shortest reset pulse
+#define DEV_LOW1_MAX_US		15		// longest write 1 or read pulse
+#define DEV_LOW0_MIN_US		60		// shortest write 0 pulse
+#define DEV_LOW0_MAX_US		120		// longest write 0 pulse
+#define DEV_PDHIGH_US		60		// latest a presence pulse starts
+#define DEV_PDLOW_US		15		// shortest it is still there after
+#define DEV_RDV_US			15		// how long a 0 read is held
+#define DEV_CONV_9BIT_US	93750	// longest conversion at 9 bits
+
+// Temperature register at power up, 85 C, and the default configuration
+#define DEV_POWER_UP_TEMP	0x0550
+#define DEV_POWER_UP_CFG	0x7F
+
+/* Port, clock and timer */
+volatile uint8_t ow_port[3];
+double now_us;
+double isr_late_us;
+double max_isr_gap;
+static double last_isr;			// time of the last interrupt, or < 0
+static bool in_isr;				// the interrupt is running
+
+/* Buses on the port */
+static ow_bus_model *buses[2];
+static uint8_t num_buses;
+
+/*****************************************************************************
+ * Function:	dev_crc8
+ * Description:	This function computes the Dallas CRC-8 a bit at a time.
+ ****************************************************************************/
+static uint8_t dev_crc8 (const uint8_t *src, uint8_t len)
+{
+	uint8_t crc = 0;
+
+	while (len--)
+	{
+		crc ^= *src++;
+		for (uint8_t bit = 0; bit < 8; bit++)
+		{
+			crc = (crc & 0x01) ? (crc >> 1) ^ 0x8C : (crc >> 1);
+		}
+	}
+
+	return crc;
+}
+
+/*****************************************************************************
+ * Function:	dev_scratch
+ * Description:	This function fills in the scratchpad of a device.
+ ****************************************************************************/
+static void dev_scratch (const ow_dev *dev, uint8_t *buff)
+{
+	buff[OW_SCRATCH_TEMP_LSB] = (uint8_t)dev->temp;
+	buff[OW_SCRATCH_TEMP_MSB] = (uint8_t)(dev->temp >> 8);
+	buff[2] = OW_ALARM_HIGH;
+	buff[3] = OW_ALARM_LOW;
+	buff[OW_SCRATCH_CONFIG] = dev->cfg;
+	buff[5] = 0xFF;
+	buff[6] = 0x0C;
+	buff[7] = 0x10;
+	buff[OW_SCRATCH_CRC] = dev_crc8(buff, OW_SCRATCH_CRC);
+}
+
+/*****************************************************************************
+ * Function:	dev_expect
+ * Description:	This function moves the devices on to a step where they are
+ *				written to.
+ ****************************************************************************/
+static void dev_expect (ow_bus_model *bus, dev_Step step)
+{
+	bus->step = step;
+	bus->nbits = 0;
+	memset(bus->shift, 0, sizeof(bus->shift));
+}
+
+/*****************************************************************************
+ * Function:	dev_update
+ * Description:	This function ends the conversions that are done by now.
+ ****************************************************************************/
+static void dev_update (ow_bus_model *bus)
+{
+	for (uint8_t ndx = 0; ndx < bus->num_devs; ndx++)
+	{
+		ow_dev *dev = &bus->devs[ndx];
+		if (dev->converting && now_us >= bus->conv_end)
+		{
+			dev->temp = dev->raw;
+			dev->converting = false;
+		}
+	}
+}
+
+/*****************************************************************************
+ * Function:	dev_reset
+ * Description:	This function resets the devices, which answer with a
+ *				presence pulse.
+ ****************************************************************************/
+static void dev_reset (ow_bus_model *bus)
+{
+	bus->resets++;
+	if (bus->num_devs == 0)
+	{
+		bus->step = DEV_IDLE;
+		return;
+	}
+
+	bus->hold_from = now_us + DEV_PDHIGH_US;
+	bus->hold_to = bus->hold_from + DEV_PDLOW_US;
+	for (uint8_t ndx = 0; ndx < bus->num_devs; ndx++)
+	{
+		bus->devs[ndx].active = true;
+	}
+	dev_expect(bus, DEV_ROM_CMD);
+}
+
+/*****************************************************************************
+ * Function:	dev_command
+ * Description:	This function carries out a ROM or function command, or
+ *				the bytes that follow one, once all of it has been written.
+ ****************************************************************************/
+static void dev_command (ow_bus_model *bus)
+{
+	uint8_t cmd = bus->shift[0];
+	double conv = 0;
+
+	switch (bus->step)
+	{
+		case DEV_ROM_CMD:
+			if (cmd == OW_SEARCH_ROM)
+			{
+				bus->step = DEV_SEARCH;
+				bus->search_bit = 0;
+				bus->search_slot = 0;
+			}
+			else if (cmd == OW_SKIP_ROM)
+			{
+				dev_expect(bus, DEV_FUNC_CMD);
+			}
+			else if (cmd == OW_MATCH_ROM)
+			{
+				dev_expect(bus, DEV_MATCH);
+			}
+			else
+			{
+				bus->proto_errs++;
+				bus->step = DEV_IDLE;
+			}
+			break;
+
+		case DEV_MATCH:
+			for (uint8_t ndx = 0; ndx < bus->num_devs; ndx++)
+			{
+				ow_dev *dev = &bus->devs[ndx];
+				dev->active = !memcmp(dev->rom, bus->shift, OW_ROM_SIZE);
+				bus->matches += dev->active;
+			}
+			dev_expect(bus, DEV_FUNC_CMD);
+			break;
+
+		case DEV_FUNC_CMD:
+			if (cmd == OW_CONVERT_T)
+			{
+				for (uint8_t ndx = 0; ndx < bus->num_devs; ndx++)
+				{
+					ow_dev *dev = &bus->devs[ndx];
+					if (dev->active)
+					{
+						dev->converting = true;
+						conv = fmax(conv, (double)DEV_CONV_9BIT_US *
+									(1 << ((dev->cfg >> OW_CFG_RES_SHIFT) &
+										   OW_CFG_RES_MSK)));
+					}
+				}
+				bus->conv_end = now_us + conv;
+				bus->step = DEV_CONVERT;
+			}
+			else if (cmd == OW_READ_SCRATCH)
+			{
+				bus->read_bit = 0;
+				bus->step = DEV_READ;
+			}
+			else if (cmd == OW_WRITE_SCRATCH)
+			{
+				dev_expect(bus, DEV_WRITE);
+			}
+			else
+			{
+				bus->proto_errs++;
+				bus->step = DEV_IDLE;
+			}
+			break;
+
+		case DEV_WRITE:
+		default:
+			// alarm limits then configuration, the reserved bits read 1
+			for (uint8_t ndx = 0; ndx < bus->num_devs; ndx++)
+			{
+				ow_dev *dev = &bus->devs[ndx];
+				if (dev->active)
+				{
+					dev->cfg = (bus->shift[2] & (OW_CFG_RES_MSK <<
+												 OW_CFG_RES_SHIFT)) |
+							   OW_CFG_RESERVED;
+					dev->cfg_writes++;
+				}
+			}
+			bus->step = DEV_IDLE;
+			break;
+	}
+}
+
+/*****************************************************************************
+ * Function:	dev_write
+ * Description:	This function gives the devices a bit the master wrote.
+ ****************************************************************************/
+static void dev_write (ow_bus_model *bus, bool bit)
+{
+	uint8_t want;
+
+	switch (bus->step)
+	{
+		case DEV_ROM_CMD:
+		case DEV_FUNC_CMD:
+			want = 8;
+			break;
+		case DEV_MATCH:
+			want = OW_ROM_SIZE * 8;
+			break;
+		case DEV_WRITE:
+			want = 3 * 8;
+			break;
+
+		case DEV_SEARCH:
+			if (bus->search_slot != 2)
+			{
+				bus->proto_errs++;
+				return;
+			}
+
+			// devices that do not have the bit the master took drop out
+			for (uint8_t ndx = 0; ndx < bus->num_devs; ndx++)
+			{
+				ow_dev *dev = &bus->devs[ndx];
+				if (((dev->rom[bus->search_bit >> 3] >>
+					  (bus->search_bit & 0x07)) & 0x01) != bit)
+				{
+					dev->active = false;
+				}
+			}
+			bus->search_slot = 0;
+			if (++bus->search_bit == OW_ROM_SIZE * 8)
+			{
+				bus->step = DEV_IDLE;
+			}
+			return;
+
+		case DEV_READ:
+			bus->proto_errs++;
+			return;
+
+		default:
+			return;
+	}
+
+	bus->shift[bus->nbits >> 3] |= (bit << (bus->nbits & 0x07));
+	if (++bus->nbits == want)
+	{
+		dev_command(bus);
+	}
+}
+
+/*****************************************************************************
+ * Function:	dev_read
+ * Description:	This function gives the bit the devices send in a read slot,
+ *				every device pulling the line low for a 0.
+ ****************************************************************************/
+static bool dev_read (ow_bus_model *bus)
+{
+	uint8_t buff[OW_SCRATCH_SIZE];
+	bool bit = true;
+
+	dev_update(bus);
+
+	switch (bus->step)
+	{
+		case DEV_SEARCH:
+			if (bus->search_slot == 2)
+			{
+				bus->proto_errs++;
+				return true;
+			}
+
+			// the bit, then its complement
+			for (uint8_t ndx = 0; ndx < bus->num_devs; ndx++)
+			{
+				ow_dev *dev = &bus->devs[ndx];
+				if (dev->active)
+				{
+					bit &= (((dev->rom[bus->search_bit >> 3] >>
+							  (bus->search_bit & 0x07)) & 0x01) ^
+							bus->search_slot);
+				}
+			}
+			bus->search_slot++;
+			return bit;
+
+		case DEV_READ:
+			if (bus->read_bit >= OW_SCRATCH_SIZE * 8)
+			{
+				return true;
+			}
+
+			for (uint8_t ndx = 0; ndx < bus->num_devs; ndx++)
+			{
+				if (bus->devs[ndx].active)
+				{
+					dev_scratch(&bus->devs[ndx], buff);
+					bit &= ((buff[bus->read_bit >> 3] >>
+							 (bus->read_bit & 0x07)) & 0x01);
+				}
+			}
+			if (bus->read_bit == 0 && bus->corrupt > 0)
+			{
+				bus->corrupt--;
+				bit = !bit;
+			}
+			bus->read_bit++;
+			return bit;
+
+		case DEV_CONVERT:
+			// powered devices send 0 until they are all done
+			for (uint8_t ndx = 0; ndx < bus->num_devs; ndx++)
+			{
+				bit &= !bus->devs[ndx].converting;
+			}
+			return bit;
+
+		default:
+			return true;
+	}
+}
+
+/*****************************************************************************
+ * Function:	dev_sends
+ * Description:	This function checks if the devices send in the next slot
+ *				rather than take a bit.
+ ****************************************************************************/
+static bool dev_sends (ow_bus_model *bus)
+{
+	return (bus->step == DEV_SEARCH && bus->search_slot < 2) ||
+		   bus->step == DEV_READ || bus->step == DEV_CONVERT;
+}
+
+/*****************************************************************************
+ * Function:	bus_edge
+ * Description:	This function plays the devices when the master pulls the
+ *				line low or lets it go, and keeps the worst timing.
+ ****************************************************************************/
+static void bus_edge (ow_bus_model *bus, bool low)
+{
+	double width;
+
+	bus->low = low;
+
+	if (low)
+	{
+		if (bus->rose_at >= 0 && bus->after_reset)
+		{
+			bus->min_rsth = fmin(bus->min_rsth, now_us - bus->rose_at);
+		}
+		else if (bus->rose_at >= 0)
+		{
+			bus->min_rec = fmin(bus->min_rec, now_us - bus->rose_at);
+			bus->min_slot = fmin(bus->min_slot, now_us - bus->fell_at);
+		}
+		bus->fell_at = now_us;
+		return;
+	}
+
+	width = now_us - bus->fell_at;
+	bus->rose_at = now_us;
+	bus->after_reset = false;
+
+	if (width > DEV_LOW0_MAX_US)
+	{
+		bus->min_rstl = fmin(bus->min_rstl, width);
+		if (width < DEV_RSTL_US)
+		{
+			bus->bad_slots++;
+			return;
+		}
+		bus->after_reset = true;
+		dev_reset(bus);
+	}
+	else if (width >= DEV_LOW0_MIN_US)
+	{
+		bus->min_low0 = fmin(bus->min_low0, width);
+		bus->max_low0 = fmax(bus->max_low0, width);
+		dev_write(bus, false);
+	}
+	else if (width >= 1 && width <= DEV_LOW1_MAX_US)
+	{
+		bus->min_low1 = fmin(bus->min_low1, width);
+		bus->max_low1 = fmax(bus->max_low1, width);
+		if (!dev_sends(bus))
+		{
+			dev_write(bus, true);
+		}
+		else if (!dev_read(bus))
+		{
+			bus->hold_from = bus->fell_at;
+			bus->hold_to = bus->fell_at + DEV_RDV_US;
+		}
+	}
+	else
+	{
+		bus->bad_slots++;
+	}
+}
+
+/*****************************************************************************
+ * Function:	sample_buses
+ * Description:	This function looks at what the master is doing to each
+ *				bus, plays the devices and sets the PIN register to the
+ *				level of each line.
+ ****************************************************************************/
+static void sample_buses (void)
+{
+	for (uint8_t ndx = 0; ndx < num_buses; ndx++)
+	{
+		ow_bus_model *bus = buses[ndx];
+		uint8_t msk = (1 << bus->pin);
+		bool low = (ow_port[1] & msk) && !(ow_port[2] & msk);
+
+		if (low != bus->low)
+		{
+			bus_edge(bus, low);
+		}
+
+		if (low || (now_us >= bus->hold_from && now_us < bus->hold_to))
+		{
+			ow_port[0] &= ~msk;
+		}
+		else
+		{
+			ow_port[0] |= msk;
+		}
+	}
+}
+
+/*****************************************************************************
+ * Function:	delay_hook
+ * Description:	This function moves the clock and timer on by a delay the
+ *				interrupt asks for.
+ ****************************************************************************/
+static void delay_hook (double us)
+{
+	if (!in_isr)
+	{
+		return;
+	}
+
+	sample_buses();
+	now_us += us;
+	TCNT1 = (uint16_t)(TCNT1 + us * TICKS_PER_US);
+	sample_buses();
+}
+
+/*****************************************************************************
+ * Function:	ow_model_init
+ * Description:	This function sets up the clock and Timer1, takes the buses
+ *				off the port and hooks the model up to the delays.
+ ****************************************************************************/
+void ow_model_init (void)
+{
+	memset((void *)ow_port, 0, sizeof(ow_port));
+	now_us = 0;
+	isr_late_us = 0;
+	max_isr_gap = 0;
+	last_isr = -1;
+	in_isr = false;
+	num_buses = 0;
+	TCNT1 = 0;
+	OCR1A = 0;
+	TIMSK1 = 0;
+	TCCR1B = 0;
+	test_delay_hook = delay_hook;
+}
+
+/*****************************************************************************
+ * Function:	ow_model_bus
+ * Description:	This function puts a bus with no devices on a pin of the
+ *				port.
+ ****************************************************************************/
+void ow_model_bus (ow_bus_model *bus, uint8_t pin)
+{
+	memset(bus, 0, sizeof(*bus));
+	bus->pin = pin;
+	bus->rose_at = -1;
+	bus->hold_from = bus->hold_to = -1;
+	ow_model_clear(bus);
+	ow_port[0] |= (1 << pin);
+	buses[num_buses++] = bus;
+}
+
+/*****************************************************************************
+ * Function:	ow_model_dev
+ * Description:	This function adds a device to a bus. Its ROM is made from
+ *				the family code and the low 48 bits of the serial number,
+ *				with the CRC after them.
+ ****************************************************************************/
+ow_dev* ow_model_dev (ow_bus_model *bus, uint8_t family, uint64_t serial,
+					  int16_t raw)
+{
+	ow_dev *dev = &bus->devs[bus->num_devs++];
+
+	memset(dev, 0, sizeof(*dev));
+	dev->rom[0] = family;
+	for (uint8_t ndx = 1; ndx < OW_ROM_SIZE - 1; ndx++)
+	{
+		dev->rom[ndx] = (uint8_t)(serial >> (8 * (ndx - 1)));
+	}
+	dev->rom[OW_ROM_SIZE - 1] = dev_crc8(dev->rom, OW_ROM_SIZE - 1);
+	dev->raw = raw;
+	dev->temp = DEV_POWER_UP_TEMP;
+	dev->cfg = DEV_POWER_UP_CFG;
+
+	return dev;
+}
+
+/*****************************************************************************
+ * Function:	ow_model_clear
+ * Description:	This function clears the worst timing seen on a bus.
+ ****************************************************************************/
+void ow_model_clear (ow_bus_model *bus)
+{
+	bus->min_rstl = bus->min_rsth = bus->min_low0 = bus->min_low1 = 1e9;
+	bus->min_slot = bus->min_rec = 1e9;
+	bus->max_low0 = bus->max_low1 = 0;
+	bus->bad_slots = 0;
+	bus->proto_errs = 0;
+	bus->resets = 0;
+	bus->matches = 0;
+}
+
+/*****************************************************************************
+ * Function:	run_timer
+ * Description:	This function runs Timer1 in CTC mode for a while, playing
+ *				the interrupt at each compare match. The timer clears on a
+ *				match and the interrupt starts isr_late_us later. A compare
+ *				value the count has already passed is only matched once
+ *				the timer wraps.
+ ****************************************************************************/
+void run_timer (double us)
+{
+	double end = now_us + us;
+	double match;
+	uint32_t counts;
+
+	while ((TIMSK1 & (1 << OCIE1A)) && (TCCR1B & 0x07))
+	{
+		counts = (TCNT1 <= OCR1A) ? (uint32_t)OCR1A + 1 - TCNT1
+								  : 0x10000UL - TCNT1 + OCR1A + 1;
+		match = now_us + (double)counts / TICKS_PER_US;
+		if (match > end)
+		{
+			TCNT1 = (uint16_t)(TCNT1 + (end - now_us) * TICKS_PER_US);
+			break;
+		}
+
+		now_us = match + isr_late_us;
+		TCNT1 = (uint16_t)(isr_late_us * TICKS_PER_US);
+		if (last_isr >= 0)
+		{
+			max_isr_gap = fmax(max_isr_gap, now_us - last_isr);
+		}
+		last_isr = now_us;
+
+		in_isr = true;
+		sample_buses();
+		TIMER1_COMPA_vect();
+		sample_buses();
+		in_isr = false;
+
+		if (!(TIMSK1 & (1 << OCIE1A)))
+		{
+			// transfers all done, the next one starts the timer afresh
+			last_isr = -1;
+		}
+	}
+
+	if (now_us < end)
+	{
+		now_us = end;
+	}
+	sample_buses();
+}
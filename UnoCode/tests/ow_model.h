@@ -0,0 +1,93 @@
+/*****************************************************************************
+ * File:		ow_model.h
+ * Description:	This file declares the model of Timer1 and of 1-Wire buses
+ *				of DS18B20s used by the host tests.
+ ****************************************************************************/
+#ifndef __OW_MODEL_H__
+#define __OW_MODEL_H__
+
+#include "oneWire.h"
+
+extern "C" void TIMER1_COMPA_vect (void);
+
+// Most devices on one modeled bus
+#define OW_MODEL_DEVS		12
+
+// Steps of the protocol the devices on a bus are at
+enum dev_Step {DEV_IDLE, DEV_ROM_CMD, DEV_SEARCH, DEV_MATCH, DEV_FUNC_CMD,
+			   DEV_CONVERT, DEV_READ, DEV_WRITE};
+
+/* A DS18B20, or another device on the bus if its family code says so */
+struct ow_dev {
+	uint8_t rom[OW_ROM_SIZE];	// ROM code, CRC included
+	int16_t raw;				// temperature it converts to, C * 16
+	int16_t temp;				// temperature register
+	uint8_t cfg;				// configuration register
+	bool active;				// still addressed by the ROM command
+	bool converting;			// converting, temp set at conv_end
+	int cfg_writes;				// Write Scratchpads it took
+};
+
+/* A bus on one pin of the modeled port, the devices on it and the worst
+ * timing the master gave it, in us */
+struct ow_bus_model {
+	uint8_t pin;				// bit of the port the bus is on
+	ow_dev devs[OW_MODEL_DEVS];	// devices on the bus
+	uint8_t num_devs;			// number of devices
+	int corrupt;				// scratchpad reads to get a bit wrong
+
+	double min_rstl;			// reset pulse, 480 or more
+	double min_rsth;			// reset to the first slot, 480 or more
+	double min_low0;			// write 0 pulse, 60 to 120
+	double max_low0;
+	double min_low1;			// write 1 and read pulses, 1 to 15
+	double max_low1;
+	double min_slot;			// start of one slot to the next, 61 or more
+	double min_rec;				// recovery between slots, 1 or more
+	int bad_slots;				// low pulses of no valid length
+	int proto_errs;				// slots the devices were not expecting
+	int resets;					// reset pulses
+	int matches;				// Match ROMs that addressed a device
+
+	// protocol and line state
+	dev_Step step;
+	uint8_t nbits;				// bits into the byte or ROM being written
+	uint8_t shift[OW_ROM_SIZE];	// bits written so far
+	uint8_t search_bit;			// ROM bit being searched
+	uint8_t search_slot;		// 0 bit, 1 complement, 2 direction
+	uint8_t read_bit;			// scratchpad bit being read
+	double conv_end;			// when the running conversion is done
+	bool low;					// held low by the master
+	double fell_at;				// last time the master pulled it low
+	double rose_at;				// last time the master let it go
+	bool after_reset;			// the last pulse was a reset
+	double hold_from;			// a device holds the line low over this
+	double hold_to;
+};
+
+/* Port the buses are on: PIN, DDR and PORT, in the order oneWire expects */
+extern volatile uint8_t ow_port[3];
+
+/* Clock and Timer1 */
+extern double now_us;			// time since the model was set up
+extern double isr_late_us;		// time each interrupt is held off for
+extern double max_isr_gap;		// longest time between two interrupts
+								// with the timer running
+
+// sets up the clock and Timer1, and hooks the model up to the delays
+void ow_model_init (void);
+
+// puts a bus with no devices on a pin of the port
+void ow_model_bus (ow_bus_model *bus, uint8_t pin);
+
+// adds a device to a bus, its ROM made from the family and serial number
+ow_dev* ow_model_dev (ow_bus_model *bus, uint8_t family, uint64_t serial,
+					  int16_t raw);
+
+// clears the worst timing seen on a bus
+void ow_model_clear (ow_bus_model *bus);
+
+// runs Timer1 and its interrupt for a while
+void run_timer (double us);
+
+#endif /* __OW_MODEL_H__ */
@@ -0,0 +1,17 @@
+/*****************************************************************************
+ * File:		eeprom.h
+ * Description:	Host stand-in for <avr/eeprom.h>, used by the host tests.
+ *				EEMEM variables live in RAM, so a test can look at them.
+ ****************************************************************************/
+#ifndef __STUB_AVR_EEPROM_H__
+#define __STUB_AVR_EEPROM_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define EEMEM
+
+void eeprom_read_block (void *dst, const void *src, size_t n);
+void eeprom_update_block (const void *src, void *dst, size_t n);
+
+#endif /* __STUB_AVR_EEPROM_H__ */
@@ -0,0 +1,14 @@
+/*****************************************************************************
+ * File:		interrupt.h
+ * Description:	Host stand-in for <avr/interrupt.h>, used by the host tests.
+ ****************************************************************************/
+#ifndef __STUB_AVR_INTERRUPT_H__
+#define __STUB_AVR_INTERRUPT_H__
+
+// an ISR is a plain function the test calls to play the interrupt
+#define ISR(vect)	extern "C" void vect (void); void vect (void)
+
+static inline void sei (void) {}
+static inline void cli (void) {}
+
+#endif /* __STUB_AVR_INTERRUPT_H__ */
@@ -0,0 +1,213 @@
+/*****************************************************************************
+ * File:		io.h
+ * Description:	Host stand-in for <avr/io.h>, used by the host tests. The 
+ *				registers are plain variables, apart from the TWI and port C
+ *				ones, which a test can hook to model the i2c bus.
+ ****************************************************************************/
+#ifndef __STUB_AVR_IO_H__
+#define __STUB_AVR_IO_H__
+
+#include <stdint.h>
+
+/* Register a test can watch: reads and writes go through the hooks when
+ * they are set, otherwise it acts as a plain variable */
+struct hw_reg {
+	volatile uint8_t val;			// value when not hooked
+	void (*on_write)(uint8_t v);	// called after each write
+	uint8_t (*on_read)(void);		// gives the value read
+	
+	operator uint8_t () const	{ return on_read ? on_read() : val; }
+	hw_reg& operator= (uint8_t v)
+		{ val = v; if (on_write) on_write(v); return *this; }
+	hw_reg& operator|= (uint8_t v)	{ return *this = (uint8_t)(*this | v); }
+	hw_reg& operator&= (uint8_t v)	{ return *this = (uint8_t)(*this & v); }
+};
+
+extern volatile uint8_t UBRR0H;
+extern volatile uint8_t UBRR0L;
+extern volatile uint8_t UCSR0A;
+extern volatile uint8_t UCSR0B;
+extern volatile uint8_t UCSR0C;
+extern volatile uint8_t UDR0;
+extern volatile uint8_t TWBR;
+extern hw_reg TWSR;
+extern hw_reg TWCR;
+extern hw_reg TWDR;
+extern volatile uint8_t TWAR;
+extern volatile uint8_t DDRB;
+extern volatile uint8_t PORTB;
+extern volatile uint8_t PINB;
+extern hw_reg DDRC;
+extern hw_reg PORTC;
+extern hw_reg PINC;
+extern volatile uint8_t DDRD;
+extern volatile uint8_t PORTD;
+extern volatile uint8_t PIND;
+extern volatile uint8_t TCCR0A;
+extern volatile uint8_t TCCR0B;
+extern volatile uint8_t TIMSK0;
+extern volatile uint8_t OCR0A;
+extern volatile uint8_t OCR0B;
+extern volatile uint8_t TCNT0;
+extern volatile uint8_t TIFR0;
+extern volatile uint8_t TCCR1A;
+extern volatile uint8_t TCCR1B;
+extern volatile uint8_t TCCR1C;
+extern volatile uint8_t TIMSK1;
+extern volatile uint8_t TIFR1;
+extern volatile uint8_t TCCR2A;
+extern volatile uint8_t TCCR2B;
+extern volatile uint8_t TCNT2;
+extern volatile uint8_t OCR2A;
+extern volatile uint8_t OCR2B;
+extern volatile uint8_t TIMSK2;
+extern volatile uint8_t TIFR2;
+extern volatile uint8_t ASSR;
+extern volatile uint8_t GTCCR;
+extern volatile uint8_t PCICR;
+extern volatile uint8_t PCMSK0;
+extern volatile uint8_t PCMSK1;
+extern volatile uint8_t PCMSK2;
+extern volatile uint8_t PCIFR;
+extern volatile uint8_t EICRA;
+extern volatile uint8_t EIMSK;
+extern volatile uint8_t EIFR;
+extern volatile uint8_t ADCSRA;
+extern volatile uint8_t ADCSRB;
+extern volatile uint8_t ADMUX;
+extern volatile uint8_t ADCL;
+extern volatile uint8_t ADCH;
+extern volatile uint8_t DIDR0;
+extern volatile uint8_t SMCR;
+extern volatile uint8_t MCUSR;
+extern volatile uint8_t MCUCR;
+extern volatile uint8_t PRR;
+extern volatile uint8_t SREG;
+extern volatile uint16_t TCNT1;
+extern volatile uint16_t OCR1A;
+extern volatile uint16_t OCR1B;
+extern volatile uint16_t ICR1;
+extern volatile uint16_t ADC;
+extern volatile uint16_t ADCW;
+#define RXC0 7
+#define TXC0 6
+#define UDRE0 5
+#define FE0 4
+#define DOR0 3
+#define UPE0 2
+#define U2X0 1
+#define MPCM0 0
+#define RXCIE0 7
+#define TXCIE0 6
+#define UDRIE0 5
+#define RXEN0 4
+#define TXEN0 3
+#define UCSZ02 2
+#define UMSEL01 7
+#define UMSEL00 6
+#define UPM01 5
+#define UPM00 4
+#define USBS0 3
+#define UCSZ01 2
+#define UCSZ00 1
+#define UCPOL0 0
+#define TWINT 7
+#define TWEA 6
+#define TWSTA 5
+#define TWSTO 4
+#define TWWC 3
+#define TWEN 2
+#define TWIE 0
+#define TWPS1 1
+#define TWPS0 0
+#define COM0A1 7
+#define COM0A0 6
+#define COM0B1 5
+#define COM0B0 4
+#define WGM01 1
+#define WGM00 0
+#define FOC0A 7
+#define FOC0B 6
+#define WGM02 3
+#define CS02 2
+#define CS01 1
+#define CS00 0
+#define OCIE0B 2
+#define OCIE0A 1
+#define TOIE0 0
+#define OCF0B 2
+#define OCF0A 1
+#define TOV0 0
+#define COM1A1 7
+#define COM1A0 6
+#define WGM11 1
+#define WGM10 0
+#define WGM13 4
+#define WGM12 3
+#define CS12 2
+#define CS11 1
+#define CS10 0
+#define OCIE1B 2
+#define OCIE1A 1
+#define TOIE1 0
+#define OCF1B 2
+#define OCF1A 1
+#define TOV1 0
+#define COM2A1 7
+#define COM2A0 6
+#define WGM21 1
+#define WGM20 0
+#define WGM22 3
+#define CS22 2
+#define CS21 1
+#define CS20 0
+#define OCIE2B 2
+#define OCIE2A 1
+#define TOIE2 0
+#define OCF2B 2
+#define OCF2A 1
+#define TOV2 0
+#define AS2 5
+#define PCIE2 2
+#define PCIE1 1
+#define PCIE0 0
+#define PCIF2 2
+#define PCIF1 1
+#define PCIF0 0
+#define ADEN 7
+#define ADSC 6
+#define ADATE 5
+#define ADIF 4
+#define ADIE 3
+#define ADPS2 2
+#define ADPS1 1
+#define ADPS0 0
+#define REFS1 7
+#define REFS0 6
+#define ADLAR 5
+#define MUX3 3
+#define MUX2 2
+#define MUX1 1
+#define MUX0 0
+#define SM2 3
+#define SM1 2
+#define SM0 1
+#define SE 0
+#define PRTWI 7
+#define PRTIM2 6
+#define PRTIM0 5
+#define PRTIM1 3
+#define PRSPI 2
+#define PRUSART0 1
+#define PRADC 0
+#define PC4 4
+#define PC5 5
+#define PORTC4 4
+#define PORTC5 5
+#define DDC4 4
+#define DDC5 5
+#define PINC4 4
+#define PINC5 5
+#define _BV(b) (1<<(b))
+
+#endif /* __STUB_AVR_IO_H__ */
@@ -0,0 +1,15 @@
+/*****************************************************************************
+ * File:		pgmspace.h
+ * Description:	Host stand-in for <avr/pgmspace.h>, used by the host tests.
+ ****************************************************************************/
+#ifndef __STUB_AVR_PGMSPACE_H__
+#define __STUB_AVR_PGMSPACE_H__
+
+#include <stdint.h>
+
+#define PROGMEM
+#define PSTR(s)				(s)
+#define pgm_read_byte(a)	(*(const uint8_t *)(a))
+#define pgm_read_word(a)	(*(const uint16_t *)(a))
+
+#endif /* __STUB_AVR_PGMSPACE_H__ */
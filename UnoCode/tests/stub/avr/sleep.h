@@ -0,0 +1,17 @@
+/*****************************************************************************
+ * File:		sleep.h
+ * Description:	Host stand-in for <avr/sleep.h>, used by the host tests.
+ ****************************************************************************/
+#ifndef __STUB_AVR_SLEEP_H__
+#define __STUB_AVR_SLEEP_H__
+
+#define SLEEP_MODE_IDLE		0
+#define SLEEP_MODE_ADC		2
+#define SLEEP_MODE_PWR_SAVE	6
+
+static inline void set_sleep_mode (int mode) { (void)mode; }
+static inline void sleep_enable (void) {}
+static inline void sleep_disable (void) {}
+static inline void sleep_cpu (void) {}
+
+#endif /* __STUB_AVR_SLEEP_H__ */
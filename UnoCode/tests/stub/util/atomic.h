@@ -0,0 +1,14 @@
+/*****************************************************************************
+ * File:		atomic.h
+ * Description:	Host stand-in for <util/atomic.h>, used by the host tests.
+ ****************************************************************************/
+#ifndef __STUB_UTIL_ATOMIC_H__
+#define __STUB_UTIL_ATOMIC_H__
+
+#define ATOMIC_RESTORESTATE	0
+#define ATOMIC_FORCEON		1
+
+// the tests run the ISRs by hand, so there is nothing to lock out
+#define ATOMIC_BLOCK(type)	for (int __todo = 1; __todo; __todo = 0)
+
+#endif /* __STUB_UTIL_ATOMIC_H__ */
@@ -0,0 +1,30 @@
+/*****************************************************************************
+ * File:		crc16.h
+ * Description:	Host stand-in for <util/crc16.h>, used by the host tests.
+ ****************************************************************************/
+#ifndef __STUB_UTIL_CRC16_H__
+#define __STUB_UTIL_CRC16_H__
+
+#include <stdint.h>
+
+static inline uint16_t _crc_xmodem_update (uint16_t crc, uint8_t data)
+{
+	crc ^= ((uint16_t)data << 8);
+	for (uint8_t bit = 0; bit < 8; bit++)
+	{
+		crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+	}
+	return crc;
+}
+
+static inline uint8_t _crc_ibutton_update (uint8_t crc, uint8_t data)
+{
+	crc ^= data;
+	for (uint8_t bit = 0; bit < 8; bit++)
+	{
+		crc = (crc & 0x01) ? (crc >> 1) ^ 0x8C : (crc >> 1);
+	}
+	return crc;
+}
+
+#endif /* __STUB_UTIL_CRC16_H__ */
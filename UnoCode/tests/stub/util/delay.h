@@ -0,0 +1,20 @@
+/*****************************************************************************
+ * File:		delay.h
+ * Description:	Host stand-in for <util/delay.h>, used by the host tests.
+ *				Nothing waits, the time asked for is added up instead, and
+ *				passed to a hook a test can set to move its own clock on.
+ ****************************************************************************/
+#ifndef __STUB_UTIL_DELAY_H__
+#define __STUB_UTIL_DELAY_H__
+
+// us of delay asked for since the test last cleared it
+extern double test_delay_us;
+
+// called with each delay asked for, when set
+extern void (*test_delay_hook)(double us);
+
+static inline void _delay_us (double us)
+	{ test_delay_us += us; if (test_delay_hook) test_delay_hook(us); }
+static inline void _delay_ms (double ms)	{ _delay_us(ms * 1000); }
+
+#endif /* __STUB_UTIL_DELAY_H__ */
@@ -0,0 +1,57 @@
+/*****************************************************************************
+ * File:		test.h
+ * Description:	This file contains the checks used by the host tests. Each
+ *				test program runs its checks, prints the ones that fail and
+ *				returns non-zero if any did.
+ ****************************************************************************/
+#ifndef __TEST_H__
+#define __TEST_H__
+
+#include <stdio.h>
+
+// failed checks so far
+static int test_fails = 0;
+
+// counts and prints a failed check, the test goes on
+#define CHECK(cond)														\
+	do {																\
+		if (!(cond))													\
+		{																\
+			printf("%s:%d: FAIL: %s\n", __FILE__, __LINE__, #cond);		\
+			test_fails++;												\
+		}																\
+	} while (0)
+
+// checks two integers are equal, printing both if not
+#define CHECK_EQ(got, want)												\
+	do {																\
+		long long _got = (long long)(got);								\
+		long long _want = (long long)(want);							\
+		if (_got != _want)												\
+		{																\
+			printf("%s:%d: FAIL: %s = %lld, want %lld\n", __FILE__,		\
+				   __LINE__, #got, _got, _want);						\
+			test_fails++;												\
+		}																\
+	} while (0)
+
+// checks a worst case error is within its limit, printing both
+#define CHECK_MAX(err, limit)											\
+	do {																\
+		double _err = (double)(err);									\
+		double _limit = (double)(limit);								\
+		printf("    %s = %.4f (limit %.4f)\n", #err, _err, _limit);		\
+		if (!(_err <= _limit))											\
+		{																\
+			printf("%s:%d: FAIL: %s = %.4f, limit %.4f\n", __FILE__,	\
+				   __LINE__, #err, _err, _limit);						\
+			test_fails++;												\
+		}																\
+	} while (0)
+
+// prints the result of a test program, returned from main
+#define TEST_DONE(name)													\
+	(printf("%s: %s\n", (name), test_fails ? "FAILED" : "ok"),			\
+	 test_fails != 0)
+
+#endif /* __TEST_H__ */
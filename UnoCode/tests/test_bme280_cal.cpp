@@ -0,0 +1,186 @@
+/*****************************************************************************
+ * File:		test_bme280_cal.cpp
+ * Description:	Host test of the BME280 calibration EEPROM cache, with the
+ *				sensor played by the TWI model. The cache must only be used
+ *				for the sensor it was read from: every BME280 has the same
+ *				chip id, so a swapped sensor is caught by its dig_T1 to
+ *				dig_T3 fingerprint and its calibration is read again. Both
+ *				the polled start in the constructor and the background one
+ *				in the task are covered.
+ ****************************************************************************/
+#include <string.h>
+
+// the state and calibration are private
+#define private public
+#include "BME280.h"
+#undef private
+
+#include "shares.h"
+#include "twi_model.h"
+#include "test.h"
+
+// the datasheet calibration
+static const BME280_Cal_Data ds_cal = {27504, 26435, -1000, 36477, -10685,
+									   3024, 2855, 140, -7, 15500, -14600,
+									   6000, 75, 362, 0, 313, 50, 30};
+
+// bytes read from the sensor: the chip id and fingerprint on every start,
+// and the whole calibration when it is not cached
+#define READ_CACHED		(1 + BME280_FPRINT_LEN)
+#define READ_FULL		(READ_CACHED + BME280_CAL_RNG_1 + BME280_CAL_RNG_2)
+
+/*****************************************************************************
+ * Function:	put_le16
+ * Description:	This function stores a 16 bit calibration value in the
+ *				sensor's registers, low byte first.
+ ****************************************************************************/
+static void put_le16 (uint8_t reg, uint16_t val)
+{
+	dev_mem[reg] = (uint8_t)val;
+	dev_mem[reg + 1] = (uint8_t)(val >> 8);
+}
+
+/*****************************************************************************
+ * Function:	fit_sensor
+ * Description:	This function sets the sensor's registers up for the given
+ *				calibration, as if that sensor had been fitted.
+ ****************************************************************************/
+static void fit_sensor (const BME280_Cal_Data &c)
+{
+	memset(dev_mem, 0, sizeof(dev_mem));
+	dev_mem[BME280_ID] = 0x60;
+
+	put_le16(BME280_CAL_START_1 + CAL_DIG_T1_LSB, c.dig_T1);
+	put_le16(BME280_CAL_START_1 + CAL_DIG_T2_LSB, c.dig_T2);
+	put_le16(BME280_CAL_START_1 + CAL_DIG_T3_LSB, c.dig_T3);
+	put_le16(BME280_CAL_START_1 + CAL_DIG_P1_LSB, c.dig_P1);
+	put_le16(BME280_CAL_START_1 + CAL_DIG_P2_LSB, c.dig_P2);
+	put_le16(BME280_CAL_START_1 + CAL_DIG_P3_LSB, c.dig_P3);
+	put_le16(BME280_CAL_START_1 + CAL_DIG_P4_LSB, c.dig_P4);
+	put_le16(BME280_CAL_START_1 + CAL_DIG_P5_LSB, c.dig_P5);
+	put_le16(BME280_CAL_START_1 + CAL_DIG_P6_LSB, c.dig_P6);
+	put_le16(BME280_CAL_START_1 + CAL_DIG_P7_LSB, c.dig_P7);
+	put_le16(BME280_CAL_START_1 + CAL_DIG_P8_LSB, c.dig_P8);
+	put_le16(BME280_CAL_START_1 + CAL_DIG_P9_LSB, c.dig_P9);
+	dev_mem[BME280_CAL_START_1 + CAL_DIG_H1_LSB] = c.dig_H1;
+
+	put_le16(BME280_CAL_START_2 + CAL_DIG_H2_LSB, c.dig_H2);
+	dev_mem[BME280_CAL_START_2 + CAL_DIG_H3_LSB] = c.dig_H3;
+	dev_mem[BME280_CAL_START_2 + CAL_DIG_H4_MSB] = (uint8_t)(c.dig_H4 >> 4);
+	dev_mem[BME280_CAL_START_2 + CAL_DIG_H4_LSB] =
+		(uint8_t)((c.dig_H4 & 0x0F) | ((c.dig_H5 & 0x0F) << 4));
+	dev_mem[BME280_CAL_START_2 + CAL_DIG_H5_MSB] = (uint8_t)(c.dig_H5 >> 4);
+	dev_mem[BME280_CAL_START_2 + CAL_DIG_H6_LSB] = (uint8_t)c.dig_H6;
+}
+
+/*****************************************************************************
+ * Function:	cal_eq
+ * Description:	This function compares two sets of calibration data field by
+ *				field, as the padding between them is not set.
+ ****************************************************************************/
+static bool cal_eq (const BME280_Cal_Data &a, const BME280_Cal_Data &b)
+{
+	return a.dig_T1 == b.dig_T1 && a.dig_T2 == b.dig_T2
+		&& a.dig_T3 == b.dig_T3 && a.dig_P1 == b.dig_P1
+		&& a.dig_P2 == b.dig_P2 && a.dig_P3 == b.dig_P3
+		&& a.dig_P4 == b.dig_P4 && a.dig_P5 == b.dig_P5
+		&& a.dig_P6 == b.dig_P6 && a.dig_P7 == b.dig_P7
+		&& a.dig_P8 == b.dig_P8 && a.dig_P9 == b.dig_P9
+		&& a.dig_H1 == b.dig_H1 && a.dig_H2 == b.dig_H2
+		&& a.dig_H3 == b.dig_H3 && a.dig_H4 == b.dig_H4
+		&& a.dig_H5 == b.dig_H5 && a.dig_H6 == b.dig_H6;
+}
+
+/*****************************************************************************
+ * Function:	bytes_read
+ * Description:	This function counts the bytes read from the sensor since
+ *				the bus log was last cleared.
+ ****************************************************************************/
+static int bytes_read (void)
+{
+	int n = 0;
+
+	for (size_t ndx = 0; ndx < bus_log.size(); ndx++)
+	{
+		n += (bus_log[ndx] == 'r');
+	}
+
+	return n;
+}
+
+/*****************************************************************************
+ * Function:	start_polled
+ * Description:	This function starts a sensor in the constructor, as on a
+ *				boot with the sensor answering, and checks how much was read
+ *				and that the calibration in use is the fitted sensor's.
+ ****************************************************************************/
+static void start_polled (i2c *bus, const BME280_Cal_Data &c, int want_read)
+{
+	reset_bus();
+	BME280 bme = BME280(bus, NULL, 0, 1000, BME_WEATHER);
+
+	CHECK_EQ(bme.state, BME_TRIGGER);
+	CHECK_EQ(bytes_read(), want_read);
+	CHECK(cal_eq(bme.cal, c));
+}
+
+/*****************************************************************************
+ * Function:	start_task
+ * Description:	This function starts a sensor in the background, as when it
+ *				did not answer at boot, and checks the same.
+ ****************************************************************************/
+static void start_task (i2c *bus, const BME280_Cal_Data &c, int want_read)
+{
+	reset_bus();
+	nack_addr = 1000;
+	BME280 bme = BME280(bus, NULL, 0, 1000, BME_WEATHER);
+	CHECK_EQ(bme.state, BME_INIT);
+
+	reset_bus();
+	for (int ms = 0; ms < 100 && bme.state != BME_TRIGGER; ms++)
+	{
+		sys_ticks++;
+		bme.BME280Task();
+		run_bus();
+	}
+
+	CHECK_EQ(bme.state, BME_TRIGGER);
+	CHECK_EQ(bytes_read(), want_read);
+	CHECK(cal_eq(bme.cal, c));
+}
+
+int main (void)
+{
+	BME280_Cal_Data other = ds_cal;
+
+	twi_model_init();
+	dev_addr = BME280_ADDR;
+	dev_pairs = true;
+
+	i2c bus = i2c(NULL, I2C_FAST);
+
+	// first boot reads and caches the calibration, the next uses the cache
+	fit_sensor(ds_cal);
+	start_polled(&bus, ds_cal, READ_FULL);
+	start_polled(&bus, ds_cal, READ_CACHED);
+
+	// another sensor, same chip id, is caught by its fingerprint
+	other.dig_T2 += 1;
+	other.dig_P5 -= 7;
+	fit_sensor(other);
+	start_polled(&bus, other, READ_FULL);
+	start_polled(&bus, other, READ_CACHED);
+
+	// the same in the background
+	fit_sensor(ds_cal);
+	start_task(&bus, ds_cal, READ_FULL);
+	start_task(&bus, ds_cal, READ_CACHED);
+
+	other = ds_cal;
+	other.dig_T1 ^= 0x0100;
+	fit_sensor(other);
+	start_task(&bus, other, READ_FULL);
+	start_polled(&bus, other, READ_CACHED);
+
+	return TEST_DONE("test_bme280_cal");
+}
@@ -0,0 +1,172 @@
+/*****************************************************************************
+ * File:		test_bme280_derived.cpp
+ * Description:	Host test of the readings the BME280 class derives from the
+ *				converted ones: dew point, absolute humidity, heat index and
+ *				sea level pressure. Each fixed point method is held to the
+ *				same formula worked out in double precision, over -40 C to
+ *				85 C, 1% to 100% RH and 300 hPa to 1100 hPa. Built with
+ *				BME280_ALTITUDE at the top of the range calc_sea_level is
+ *				meant for, where its series are furthest out.
+ ****************************************************************************/
+#include <math.h>
+
+// the derived values are private
+#define private public
+#include "BME280.h"
+#undef private
+
+#include "test.h"
+
+// Worst case errors allowed against the double precision formulas. The
+// fixed point may add no more than a twentieth of the sensor's +/-1 C to
+// the dew point, and 5 counts of the hundredths the absolute humidity is
+// sent in. The heat index is given to the whole degree by the NWS, so a
+// quarter of one is allowed. The sea level pressure may be out by no more
+// than the 64 bit pressure conversion it starts from.
+#define DEW_MAX_C		0.05		// dew point, C
+#define ABS_HUM_MAX_G	0.05		// absolute humidity, g/m^3
+#define HEAT_MAX_F		0.25		// heat index, F
+#define SEA_LEVEL_MAX_PA	2.0		// sea level pressure, Pa
+
+// the heat index is only defined up to here, F
+#define HEAT_TOP_F		110.0
+
+/*****************************************************************************
+ * Function:	ref_dew_point
+ * Description:	This function is the Magnus dew point, in C.
+ ****************************************************************************/
+static double ref_dew_point (double t, double rh)
+{
+	double g = log(rh / 100.0) + 17.62 * t / (243.12 + t);
+
+	return 243.12 * g / (17.62 - g);
+}
+
+/*****************************************************************************
+ * Function:	ref_abs_humidity
+ * Description:	This function is the absolute humidity from the Magnus
+ *				vapour pressure, in g/m^3.
+ ****************************************************************************/
+static double ref_abs_humidity (double t, double rh)
+{
+	double e = 6.112 * exp(17.62 * t / (243.12 + t)) * rh / 100.0;
+
+	return 216.74 * e / (273.15 + t);
+}
+
+/*****************************************************************************
+ * Function:	ref_heat_index
+ * Description:	This function is the NWS heat index, in F.
+ ****************************************************************************/
+static double ref_heat_index (double t, double rh)
+{
+	double hi = 0.5 * (t + 61.0 + (t - 68.0) * 1.2 + rh * 0.094);
+
+	if ((hi + t) / 2.0 < 80.0)
+	{
+		return hi;
+	}
+
+	hi = -42.379 + 2.04901523 * t + 10.14333127 * rh
+		 - 0.22475541 * t * rh - 0.00683783 * t * t
+		 - 0.05481717 * rh * rh + 0.00122874 * t * t * rh
+		 + 0.00085282 * t * rh * rh - 0.00000199 * t * t * rh * rh;
+
+	if (rh < 13.0 && t > 80.0 && t < 112.0)
+	{
+		hi -= ((13.0 - rh) / 4.0) * sqrt((17.0 - fabs(t - 95.0)) / 17.0);
+	}
+	else if (rh > 85.0 && t > 80.0 && t < 87.0)
+	{
+		hi += ((rh - 85.0) / 10.0) * ((87.0 - t) / 5.0);
+	}
+
+	return hi;
+}
+
+/*****************************************************************************
+ * Function:	ref_sea_level
+ * Description:	This function is the barometric formula, in Pa.
+ ****************************************************************************/
+static double ref_sea_level (double p, double t, double h)
+{
+	return p * pow(1.0 + 0.0065 * h / (t + 273.15), 5.257);
+}
+
+/*****************************************************************************
+ * Function:	test_humidity
+ * Description:	Sweeps temperature and humidity for the dew point, absolute
+ *				humidity and heat index.
+ ****************************************************************************/
+static void test_humidity (BME280 *bme)
+{
+	double err_dew = 0;
+	double err_abs = 0;
+	double err_heat = 0;
+
+	for (int32_t t = -4000; t <= 8500; t += 25)
+	{
+		for (uint32_t h = 1024; h <= 102400; h += 256)
+		{
+			double tc = t / 100.0;
+			double rh = h / 1024.0;
+			double tf = tc * 9.0 / 5.0 + 32.0;
+
+			bme->temperature = t;
+			bme->humidity = h;
+			int32_t vapor = bme->calc_vapor();
+
+			err_dew = fmax(err_dew, fabs(bme->calc_dew_point(vapor) / 100.0
+										 - ref_dew_point(tc, rh)));
+			err_abs = fmax(err_abs, fabs(bme->calc_abs_humidity(vapor)
+										 / 100.0
+										 - ref_abs_humidity(tc, rh)));
+
+			if (tf <= HEAT_TOP_F)
+			{
+				err_heat = fmax(err_heat,
+								fabs(bme->calc_heat_index() / 100.0
+									 - ref_heat_index(tf, rh)));
+			}
+		}
+	}
+
+	CHECK_MAX(err_dew, DEW_MAX_C);
+	CHECK_MAX(err_abs, ABS_HUM_MAX_G);
+	CHECK_MAX(err_heat, HEAT_MAX_F);
+}
+
+/*****************************************************************************
+ * Function:	test_sea_level
+ * Description:	Sweeps temperature and pressure for the sea level pressure.
+ ****************************************************************************/
+static void test_sea_level (BME280 *bme)
+{
+	double err_slp = 0;
+
+	for (int32_t t = -4000; t <= 8500; t += 25)
+	{
+		for (int32_t p = 30000; p <= 110000; p += 250)
+		{
+			bme->temperature = t;
+			bme->pressure = p;
+
+			err_slp = fmax(err_slp, fabs((double)bme->calc_sea_level()
+								- ref_sea_level(p, t / 100.0,
+												BME280_ALTITUDE)));
+		}
+	}
+
+	CHECK_MAX(err_slp, SEA_LEVEL_MAX_PA);
+}
+
+int main (void)
+{
+	i2c bus = i2c(NULL, I2C_FAST);
+	BME280 bme = BME280(&bus, NULL, 0, 1000, BME_WEATHER);
+
+	test_humidity(&bme);
+	test_sea_level(&bme);
+
+	return TEST_DONE("test_bme280_derived");
+}
@@ -0,0 +1,197 @@
+/*****************************************************************************
+ * File:		test_bme280_pres.cpp
+ * Description:	Host test of the BME280 pressure compensation. Built twice,
+ *				with BME280_PRES_32BIT set and clear. Every raw pressure 
+ *				code is tried at 49 raw temperatures spread evenly over 
+ *				-40 C to 85 C. The 64 bit build must match the datasheet's 
+ *				64 bit integer formula exactly for every code. The 32 bit
+ *				formula wraps for codes that come out below about 10 hPa,
+ *				and when hot above about 1800 hPa, so it is only held to 
+ *				the 64 bit one where that gives 300 hPa to 1100 hPa, the
+ *				sensor's operating range. Both are held to the datasheet's
+ *				double precision formula over that range as well.
+ ****************************************************************************/
+#include <math.h>
+#include <string.h>
+
+// the conversions are private
+#define private public
+#include "BME280.h"
+#undef private
+
+#include "test.h"
+
+// datasheet calibration and example readings, 25.08 C and 100653.27 Pa
+static const BME280_Cal_Data ds_cal = {27504, 26435, -1000, 36477, -10685,
+									   3024, 2855, 140, -7, 15500, -14600,
+									   6000, 0, 0, 0, 0, 0, 0};
+#define DS_ADC_T		519888
+#define DS_ADC_P		415148
+
+// raw temperatures giving -40 C and 85 C with the datasheet calibration,
+// and the number of steps between them
+#define ADC_T_MIN		313696
+#define ADC_T_MAX		712464
+#define ADC_T_STEPS		48
+
+// the sensor's operating range, Pa
+#define PRES_MIN_PA		30000
+#define PRES_MAX_PA		110000
+
+// The 32 bit formula may be off by less than the sensor's own relative
+// accuracy, +/-0.12 hPa in the datasheet, so it never costs more than the
+// sensor does
+#define PRES_32BIT_MAX_PA	12
+
+// the 64 bit formula truncates to whole Pa, under 1 Pa, on top of the
+// rounding in its fixed point terms
+#define PRES_64BIT_MAX_PA	2
+
+/*****************************************************************************
+ * Function:	ref_pres_64
+ * Description:	This function is the datasheet's 64 bit integer pressure
+ *				compensation, as Bosch gives it.
+ ****************************************************************************/
+static int32_t ref_pres_64 (const BME280_Cal_Data &c, int32_t t_fine,
+							int32_t adc_P)
+{
+	int64_t var1, var2, p;
+
+	var1 = (int64_t)t_fine - 128000;
+	var2 = var1 * var1 * (int64_t)c.dig_P6;
+	var2 = var2 + ((var1 * (int64_t)c.dig_P5) << 17);
+	var2 = var2 + (((int64_t)c.dig_P4) << 35);
+	var1 = ((var1 * var1 * (int64_t)c.dig_P3) >> 8) +
+		   ((var1 * (int64_t)c.dig_P2) << 12);
+	var1 = (((((int64_t)1) << 47) + var1)) * ((int64_t)c.dig_P1) >> 33;
+	if (var1 == 0)
+	{
+		return 0;
+	}
+	p = 1048576 - adc_P;
+	p = (((p << 31) - var2) * 3125) / var1;
+	var1 = (((int64_t)c.dig_P9) * (p >> 13) * (p >> 13)) >> 25;
+	var2 = (((int64_t)c.dig_P8) * p) >> 19;
+	p = ((p + var1 + var2) >> 8) + (((int64_t)c.dig_P7) << 4);
+
+	return (int32_t)(p >> 8);
+}
+
+/*****************************************************************************
+ * Function:	ref_pres
+ * Description:	This function is the datasheet's double precision
+ *				temperature and pressure compensation.
+ ****************************************************************************/
+static double ref_pres (const BME280_Cal_Data &c, int32_t adc_T,
+						int32_t adc_P)
+{
+	double var1, var2, t_fine, p;
+
+	var1 = (adc_T / 16384.0 - c.dig_T1 / 1024.0) * c.dig_T2;
+	var2 = (adc_T / 131072.0 - c.dig_T1 / 8192.0) *
+		   (adc_T / 131072.0 - c.dig_T1 / 8192.0) * c.dig_T3;
+	t_fine = var1 + var2;
+
+	var1 = t_fine / 2.0 - 64000.0;
+	var2 = var1 * var1 * c.dig_P6 / 32768.0;
+	var2 = var2 + var1 * c.dig_P5 * 2.0;
+	var2 = var2 / 4.0 + c.dig_P4 * 65536.0;
+	var1 = (c.dig_P3 * var1 * var1 / 524288.0 + c.dig_P2 * var1) / 524288.0;
+	var1 = (1.0 + var1 / 32768.0) * c.dig_P1;
+	p = 1048576.0 - adc_P;
+	p = (p - var2 / 4096.0) * 6250.0 / var1;
+	var1 = c.dig_P9 * p * p / 2147483648.0;
+	var2 = p * c.dig_P8 / 32768.0;
+
+	return p + (var1 + var2 + c.dig_P7) / 16.0;
+}
+
+/*****************************************************************************
+ * Function:	test_example
+ * Description:	The datasheet example comes out at 100653 Pa from the 64 bit
+ *				formula and 100656 Pa from the 32 bit one.
+ ****************************************************************************/
+static void test_example (BME280 *bme)
+{
+	bme->raw_temp = DS_ADC_T;
+	bme->raw_pres = DS_ADC_P;
+	CHECK_EQ(bme->convert_temperature(), 2508);
+	CHECK_EQ(bme->t_fine, 128422);
+#if BME280_PRES_32BIT
+	CHECK_EQ(bme->convert_pressure(), 100656);
+#else
+	CHECK_EQ(bme->convert_pressure(), 100653);
+#endif
+	CHECK_EQ(ref_pres_64(ds_cal, bme->t_fine, DS_ADC_P), 100653);
+}
+
+/*****************************************************************************
+ * Function:	test_sweep
+ * Description:	Sweeps the raw temperature over -40 C to 85 C and, at each,
+ *				every raw pressure code, comparing with the reference 
+ *				formulas.
+ ****************************************************************************/
+static void test_sweep (BME280 *bme)
+{
+	double err_64 = 0;		// against the 64 bit formula, in range
+	double err_ref = 0;		// against the double formula, in range
+	double err_all = 0;		// against the 64 bit formula, every code
+	long in_range = 0;
+
+	for (int32_t step = 0; step <= ADC_T_STEPS; step++)
+	{
+		int32_t adc_T = ADC_T_MIN + ((ADC_T_MAX - ADC_T_MIN) * step) / 
+						ADC_T_STEPS;
+
+		bme->raw_temp = adc_T;
+		bme->convert_temperature();
+
+		for (int32_t adc_P = 0; adc_P < (1L << 20); adc_P++)
+		{
+			bme->raw_pres = adc_P;
+			int32_t got = bme->convert_pressure();
+			int32_t want = ref_pres_64(ds_cal, bme->t_fine, adc_P);
+			double err = fabs((double)got - want);
+
+			err_all = fmax(err_all, err);
+
+			if (want < PRES_MIN_PA || want > PRES_MAX_PA)
+			{
+				continue;
+			}
+
+			err_64 = fmax(err_64, err);
+			err_ref = fmax(err_ref, fabs(got - ref_pres(ds_cal, adc_T,
+														adc_P)));
+			in_range++;
+		}
+	}
+
+	printf("    %ld of %ld codes in range\n", in_range, 
+		   (ADC_T_STEPS + 1) * (1L << 20));
+	CHECK(in_range > 10000000L);
+#if BME280_PRES_32BIT
+	CHECK_MAX(err_64, PRES_32BIT_MAX_PA);
+	CHECK_MAX(err_ref, PRES_32BIT_MAX_PA);
+#else
+	CHECK_MAX(err_all, 0);
+	CHECK_MAX(err_ref, PRES_64BIT_MAX_PA);
+#endif
+}
+
+int main (void)
+{
+	i2c bus = i2c(NULL, I2C_FAST);
+	BME280 bme = BME280(&bus, NULL, 0, 1000, BME_WEATHER);
+
+	bme.cal = ds_cal;
+
+	test_example(&bme);
+	test_sweep(&bme);
+
+#if BME280_PRES_32BIT
+	return TEST_DONE("test_bme280_pres32");
+#else
+	return TEST_DONE("test_bme280_pres64");
+#endif
+}
@@ -0,0 +1,245 @@
+/*****************************************************************************
+ * File:		test_i2c.cpp
+ * Description:	Host test of the i2c class against a model of the TWI
+ *				hardware and one device on the bus. Covers the background
+ *				transaction queue, the repeated start between the write and
+ *				read parts, NACK, arbitration and timeout retries with their
+ *				backoff, and freeing a stuck bus with recover.
+ ****************************************************************************/
+#include <string.h>
+#include "twi_model.h"
+#include "test.h"
+
+// the device on the bus, 8 bit address
+#define DEV_ADDR	0xEE
+
+/*****************************************************************************
+ * Function:	dev_stats
+ * Description:	This function finds the error counters of the device in the
+ *				stats frame payload.
+ ****************************************************************************/
+static void dev_stats (i2c *bus, uint16_t *nacks, uint16_t *timeouts,
+					   uint16_t *recoveries)
+{
+	uint8_t buff[I2C_MAX_DEVS * I2C_STATS_LEN];
+	uint8_t len = bus->get_stats(buff, sizeof(buff));
+
+	*nacks = *timeouts = *recoveries = 0;
+	for (uint8_t ndx = 0; ndx + I2C_STATS_LEN <= len; ndx += I2C_STATS_LEN)
+	{
+		if (buff[ndx] == DEV_ADDR)
+		{
+			*nacks = serial::get_le(&buff[ndx + 1], 2);
+			*timeouts = serial::get_le(&buff[ndx + 3], 2);
+			*recoveries = serial::get_le(&buff[ndx + 5], 2);
+		}
+	}
+}
+
+/*****************************************************************************
+ * Function:	test_queue
+ * Description:	Background transactions queue behind the running one, run
+ *				in order, and a full queue turns the next one away.
+ ****************************************************************************/
+static void test_queue (i2c *bus)
+{
+	static const uint8_t regs[I2C_QUEUE_SIZE + 2] = {0x10, 0x20, 0x30, 0x40,
+													 0x50, 0x60};
+	uint8_t rx[I2C_QUEUE_SIZE + 2][2];
+	twi_xfer xfers[I2C_QUEUE_SIZE + 2];
+
+	reset_bus();
+	for (uint8_t ndx = 0; ndx < I2C_QUEUE_SIZE + 2; ndx++)
+	{
+		twi_xfer x = {DEV_ADDR, &regs[ndx], 1, rx[ndx], 2, false, TWI_IDLE};
+		xfers[ndx] = x;
+	}
+
+	// one running and a full queue, then one too many
+	for (uint8_t ndx = 0; ndx <= I2C_QUEUE_SIZE; ndx++)
+	{
+		CHECK(!bus->begin(&xfers[ndx]));
+		CHECK_EQ(xfers[ndx].state, TWI_BUSY);
+	}
+	CHECK(bus->begin(&xfers[I2C_QUEUE_SIZE + 1]));
+	CHECK_EQ(xfers[I2C_QUEUE_SIZE + 1].state, TWI_ERROR);
+
+	// the polled methods keep off the bus meanwhile
+	CHECK(bus->write(DEV_ADDR, 0x00, 0x00));
+
+	run_bus();
+
+	CHECK(!bus->busy());
+	for (uint8_t ndx = 0; ndx <= I2C_QUEUE_SIZE; ndx++)
+	{
+		CHECK_EQ(xfers[ndx].state, TWI_DONE);
+		CHECK_EQ(rx[ndx][0], regs[ndx]);
+		CHECK_EQ(rx[ndx][1], regs[ndx] + 1);
+	}
+
+	// back to back, each with a repeated start into its read part
+	std::string one = "SWdRArrP";
+	std::string all;
+	for (uint8_t ndx = 0; ndx <= I2C_QUEUE_SIZE; ndx++)
+	{
+		all += one;
+	}
+	CHECK(bus_log == all);
+
+	// a waiting transaction can be taken back out
+	reset_bus();
+	CHECK(!bus->begin(&xfers[0]));
+	CHECK(!bus->begin(&xfers[1]));
+	CHECK(!bus->begin(&xfers[2]));
+	bus->abort(&xfers[1]);
+	CHECK_EQ(xfers[1].state, TWI_ERROR);
+	run_bus();
+	CHECK_EQ(xfers[0].state, TWI_DONE);
+	CHECK_EQ(xfers[2].state, TWI_DONE);
+	CHECK(bus_log == one + one);
+}
+
+/*****************************************************************************
+ * Function:	test_background_errors
+ * Description:	A NACK ends a background transaction with a stop. Lost
+ *				arbitration ends it without one, and the next transaction
+ *				waits for the bus with a fresh start.
+ ****************************************************************************/
+static void test_background_errors (i2c *bus)
+{
+	static const uint8_t w[] = {0xF4, 0x27};
+	twi_xfer a = {DEV_ADDR, w, 2, NULL, 0, false, TWI_IDLE};
+	twi_xfer b = {DEV_ADDR, w, 2, NULL, 0, false, TWI_IDLE};
+	uint16_t nacks, timeouts, recoveries, nacks_0;
+
+	dev_stats(bus, &nacks_0, &timeouts, &recoveries);
+
+	reset_bus();
+	nack_addr = 1;
+	CHECK(!bus->begin(&a));
+	run_bus();
+	CHECK_EQ(a.state, TWI_ERROR);
+	CHECK(bus_log == "SNP");
+	dev_stats(bus, &nacks, &timeouts, &recoveries);
+	CHECK_EQ(nacks, nacks_0 + 1);
+
+	reset_bus();
+	dev_mem[0xF4] = 0;
+	lose_arb = 1;
+	a.state = TWI_IDLE;
+	CHECK(!bus->begin(&a));
+	CHECK(!bus->begin(&b));
+	run_bus();
+	CHECK_EQ(a.state, TWI_ERROR);
+	CHECK_EQ(b.state, TWI_DONE);
+	CHECK(bus_log == "SLSWddP");
+	CHECK_EQ(dev_mem[0xF4], 0x27);
+}
+
+/*****************************************************************************
+ * Function:	test_retry
+ * Description:	Polled transactions are tried up to I2C_MAX_TRIES times. The
+ *				wait between tries starts at I2C_RETRY_US and doubles. Each
+ *				failure is counted, and a timeout recovers the bus first.
+ ****************************************************************************/
+static void test_retry (i2c *bus)
+{
+	uint16_t nacks_0, timeouts_0, recoveries_0;
+	uint16_t nacks, timeouts, recoveries;
+	uint8_t data[2];
+
+	dev_stats(bus, &nacks_0, &timeouts_0, &recoveries_0);
+
+	// NACKed twice, through on the third try
+	reset_bus();
+	nack_addr = 2;
+	dev_mem[0x42] = 0;
+	CHECK(!bus->write(DEV_ADDR, 0x42, 0x99));
+	CHECK_EQ(dev_mem[0x42], 0x99);
+	CHECK_EQ(test_delay_us, I2C_RETRY_US + 2 * I2C_RETRY_US);
+	CHECK(bus_log == "SNPSNPSWddP");
+	dev_stats(bus, &nacks, &timeouts, &recoveries);
+	CHECK_EQ(nacks, nacks_0 + 2);
+
+	// never answers, gives up after the last try without a wait after it
+	reset_bus();
+	nack_addr = 100;
+	CHECK(bus->write(DEV_ADDR, 0x42, 0x11));
+	CHECK_EQ(dev_mem[0x42], 0x99);
+	CHECK_EQ(test_delay_us, I2C_RETRY_US + 2 * I2C_RETRY_US);
+	dev_stats(bus, &nacks, &timeouts, &recoveries);
+	CHECK_EQ(nacks, nacks_0 + 2 + I2C_MAX_TRIES);
+
+	// lost arbitration is tried again like a NACK
+	reset_bus();
+	lose_arb = 1;
+	dev_mem[0x50] = 0x12;
+	dev_mem[0x51] = 0x34;
+	CHECK(!bus->read(DEV_ADDR, 0x50, data, 2));
+	CHECK_EQ(data[0], 0x12);
+	CHECK_EQ(data[1], 0x34);
+	CHECK_EQ(test_delay_us, I2C_RETRY_US);
+
+	// a hung bus times out and is recovered before the next try
+	reset_bus();
+	hang = true;
+	CHECK(!bus->write(DEV_ADDR, 0x42, 0x55));
+	CHECK_EQ(dev_mem[0x42], 0x55);
+	CHECK_EQ(pin_stops, 1);
+	dev_stats(bus, &nacks, &timeouts, &recoveries);
+	CHECK_EQ(timeouts, timeouts_0 + 1);
+	CHECK_EQ(recoveries, recoveries_0 + 1);
+}
+
+/*****************************************************************************
+ * Function:	test_recover
+ * Description:	recover clocks SCL until the device lets go of SDA, up to
+ *				I2C_RECOVER_CLKS times, then sends a stop by hand and sets
+ *				the TWI back up.
+ ****************************************************************************/
+static void test_recover (i2c *bus)
+{
+	// free bus, just the stop
+	reset_bus();
+	CHECK(!bus->recover());
+	CHECK_EQ(scl_clks, 1);
+	CHECK_EQ(pin_stops, 1);
+	CHECK_EQ(TWCR.val, (1 << TWEN));
+
+	// device stuck part way through a byte
+	reset_bus();
+	stuck_clks = 3;
+	CHECK(!bus->recover());
+	CHECK_EQ(scl_clks, 3 + 1);
+	CHECK_EQ(pin_stops, 1);
+	CHECK_EQ(DDRC.val & ((1 << I2C_SDA) | (1 << I2C_SCL)), 0);
+
+	// device that never lets go
+	reset_bus();
+	stuck_clks = 100;
+	CHECK(bus->recover());
+	CHECK_EQ(scl_clks, I2C_RECOVER_CLKS + 1);
+	CHECK_EQ(TWCR.val, (1 << TWEN));
+	stuck_clks = 0;
+}
+
+int main (void)
+{
+	twi_model_init();
+	dev_addr = DEV_ADDR;
+
+	for (int ndx = 0; ndx < 256; ndx++)
+	{
+		dev_mem[ndx] = (uint8_t)ndx;
+	}
+
+	i2c bus = i2c(NULL, I2C_FAST);
+	CHECK_EQ(bus.get_clock(), 400000);
+
+	test_queue(&bus);
+	test_background_errors(&bus);
+	test_retry(&bus);
+	test_recover(&bus);
+
+	return TEST_DONE("test_i2c");
+}
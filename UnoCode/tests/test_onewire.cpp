@@ -0,0 +1,430 @@
+/*****************************************************************************
+ * File:		test_onewire.cpp
+ * Description:	Host test of the oneWire class against a model of Timer1
+ *				and of DS18B20s on the bus. Covers the slot timing, with
+ *				the interrupt on time and held off long enough to pass
+ *				the shortest compare value, the ROM search through forks,
+ *				reading a scratchpad again after a bad CRC, setting each
+ *				probe's resolution with Match ROM, and two buses sharing
+ *				the timer.
+ ****************************************************************************/
+#include <string.h>
+
+// the task state is private
+#define private public
+#include "oneWire.h"
+#undef private
+
+#include "shares.h"
+#include "ow_model.h"
+#include "test.h"
+
+// pins of the port the buses are on
+#define PIN_A			3
+#define PIN_B			2
+
+// longest the task may take to finish a sample, ms
+#define SAMPLE_MAX_MS	3000
+
+/*****************************************************************************
+ * Function:	want_temp
+ * Description:	This function works out what a probe reading raw at a
+ *				resolution and calibration should put in water_temps.
+ ****************************************************************************/
+static int16_t want_temp (int16_t raw, uint8_t res, int16_t cal)
+{
+	int16_t temp = raw & ~((1 << (OW_MAX_RESOLUTION - res)) - 1);
+
+	return (int16_t)TEMP_C_TO_F((int32_t)((temp * 6) + (temp / 4) + cal));
+}
+
+/*****************************************************************************
+ * Function:	find_dev
+ * Description:	This function finds the modeled device a probe is.
+ ****************************************************************************/
+static ow_dev* find_dev (ow_bus_model *bus, oneWire *ow, uint8_t ndx)
+{
+	for (uint8_t dev = 0; dev < bus->num_devs; dev++)
+	{
+		if (!memcmp(bus->devs[dev].rom, ow->get_rom(ndx), OW_ROM_SIZE))
+		{
+			return &bus->devs[dev];
+		}
+	}
+
+	return NULL;
+}
+
+/*****************************************************************************
+ * Function:	run_ms
+ * Description:	This function runs the tasks once a ms for a while, and
+ *				counts the ms both buses had a transfer out at once.
+ ****************************************************************************/
+static int run_ms (uint32_t ms, oneWire *a, oneWire *b)
+{
+	int both = 0;
+
+	while (ms--)
+	{
+		run_timer(1000);
+		sys_ticks++;
+		a->oneWireTask();
+		if (b != NULL)
+		{
+			b->oneWireTask();
+			both += (a->xfer.state == OW_XFER_BUSY &&
+					 b->xfer.state == OW_XFER_BUSY);
+		}
+	}
+
+	return both;
+}
+
+/*****************************************************************************
+ * Function:	run_sample
+ * Description:	This function runs the task until it has read every probe
+ *				once more.
+ ****************************************************************************/
+static void run_sample (oneWire *ow)
+{
+	uint32_t ms = 0;
+
+	while (ow->state != OW_READ && ms++ < SAMPLE_MAX_MS)
+	{
+		run_ms(1, ow, NULL);
+	}
+	while (ow->state == OW_READ && ms++ < SAMPLE_MAX_MS)
+	{
+		run_ms(1, ow, NULL);
+	}
+
+	CHECK(ms < SAMPLE_MAX_MS);
+}
+
+/*****************************************************************************
+ * Function:	finish
+ * Description:	This function lets the transfer on the bus end and hands
+ *				back the slots the probes took, before the bus goes away.
+ ****************************************************************************/
+static void finish (oneWire *ow)
+{
+	while (TIMSK1 & (1 << OCIE1A))
+	{
+		run_timer(1000);
+	}
+	ow->new_search();
+}
+
+/*****************************************************************************
+ * Function:	start
+ * Description:	This function sets the model up with one empty bus, and
+ *				clears water_temps.
+ ****************************************************************************/
+static void start (ow_bus_model *bus, uint8_t pin)
+{
+	ow_model_init();
+	ow_model_bus(bus, pin);
+
+	for (uint8_t slot = 0; slot < WATER_SLOTS; slot++)
+	{
+		water_temps[slot] = WATER_TEMP_NONE;
+	}
+}
+
+/*****************************************************************************
+ * Function:	check_timing
+ * Description:	This function checks the master kept to the DS18B20 timing
+ *				and the devices saw nothing they did not expect.
+ ****************************************************************************/
+static void check_timing (ow_bus_model *bus)
+{
+	CHECK(bus->min_rstl >= 480);
+	CHECK(bus->min_rsth >= 480);
+	CHECK(bus->min_low0 >= 60);
+	CHECK(bus->max_low0 <= 120);
+	CHECK(bus->min_low1 >= 1);
+	CHECK(bus->max_low1 <= 15);
+	CHECK(bus->min_slot >= 61);
+	CHECK(bus->min_rec >= 1);
+	CHECK_EQ(bus->bad_slots, 0);
+	CHECK_EQ(bus->proto_errs, 0);
+}
+
+/*****************************************************************************
+ * Function:	check_temps
+ * Description:	This function checks each probe found put the reading of
+ *				the right device in its slot, with no calibration and the
+ *				resolution given.
+ ****************************************************************************/
+static void check_temps (ow_bus_model *bus, oneWire *ow, uint8_t res)
+{
+	for (uint8_t ndx = 0; ndx < ow->get_num_probes(); ndx++)
+	{
+		ow_dev *dev = find_dev(bus, ow, ndx);
+		CHECK(dev != NULL);
+		CHECK(ow->get_slot(ndx) < WATER_SLOTS);
+		if (dev != NULL && ow->get_slot(ndx) < WATER_SLOTS)
+		{
+			CHECK_EQ(water_temps[ow->get_slot(ndx)],
+					 want_temp(dev->raw, res, 0));
+		}
+	}
+}
+
+/*****************************************************************************
+ * Function:	test_slots
+ * Description:	Every slot keeps to the DS18B20 timing, with the interrupt
+ *				held off by late us. Held off past OW_REC_US, the count is
+ *				beyond the compare value the ISR sets for the recovery
+ *				after a written 0, and the match must still come at once
+ *				rather than after the timer wraps.
+ ****************************************************************************/
+static void test_slots (double late)
+{
+	ow_bus_model bus;
+
+	start(&bus, PIN_A);
+	isr_late_us = late;
+	ow_model_dev(&bus, OW_FAMILY_DS18B20, 0x1234, 0x0191);
+	ow_model_dev(&bus, OW_FAMILY_DS18B20, 0x5678, (int16_t)0xFF5E);
+
+	oneWire ow = oneWire(NULL, ow_port, PIN_A, NULL, 0, 1000, 12);
+	run_sample(&ow);
+
+	CHECK_EQ(ow.get_num_probes(), 2);
+	check_temps(&bus, &ow, 12);
+	check_timing(&bus);
+	CHECK(max_isr_gap <= OW_RESET_LOW_US);
+	CHECK_EQ(ow.get_crc_errs(), 0);
+
+	finish(&ow);
+}
+
+/*****************************************************************************
+ * Function:	test_search
+ * Description:	The search finds every DS18B20 on the bus through the forks
+ *				between their ROMs and passes over other families. It stops
+ *				at OW_MAX_PROBES.
+ ****************************************************************************/
+static void test_search (void)
+{
+	static const uint64_t serials[] = {0x000000000001ULL, 0x000000000003ULL,
+									   0x000000000103ULL, 0x800000000001ULL,
+									   0x8000000000F1ULL};
+	uint8_t num = sizeof(serials) / sizeof(serials[0]);
+	uint16_t slots = 0;
+	ow_bus_model bus;
+
+	// forks in the first, second and last byte of the serial number, and
+	// another family that forks from them in the family code
+	start(&bus, PIN_A);
+	for (uint8_t ndx = 0; ndx < num; ndx++)
+	{
+		ow_model_dev(&bus, OW_FAMILY_DS18B20, serials[ndx], 0x0100 + ndx);
+	}
+	ow_model_dev(&bus, 0x10, serials[0], 0x0100);
+
+	oneWire ow = oneWire(NULL, ow_port, PIN_A, NULL, 0, 1000, 12);
+	run_sample(&ow);
+
+	CHECK_EQ(ow.get_num_probes(), num);
+	for (uint8_t ndx = 0; ndx < ow.get_num_probes(); ndx++)
+	{
+		CHECK_EQ(ow.get_rom(ndx)[0], OW_FAMILY_DS18B20);
+		CHECK(!(slots & (1U << ow.get_slot(ndx))));
+		slots |= (1U << ow.get_slot(ndx));
+	}
+	check_temps(&bus, &ow, 12);
+	check_timing(&bus);
+	finish(&ow);
+
+	// more than fit, each found once
+	start(&bus, PIN_A);
+	for (uint8_t ndx = 0; ndx < OW_MAX_PROBES + 2; ndx++)
+	{
+		ow_model_dev(&bus, OW_FAMILY_DS18B20, 0x10101ULL * (ndx + 1), 0x0200);
+	}
+
+	oneWire full = oneWire(NULL, ow_port, PIN_A, NULL, 0, 1000, 12);
+	run_sample(&full);
+
+	CHECK_EQ(full.get_num_probes(), OW_MAX_PROBES);
+	for (uint8_t ndx = 0; ndx < full.get_num_probes(); ndx++)
+	{
+		for (uint8_t other = 0; other < ndx; other++)
+		{
+			CHECK(memcmp(full.get_rom(ndx), full.get_rom(other),
+						 OW_ROM_SIZE) != 0);
+		}
+	}
+	check_temps(&bus, &full, 12);
+	check_timing(&bus);
+	finish(&full);
+}
+
+/*****************************************************************************
+ * Function:	test_crc_retry
+ * Description:	A scratchpad that fails the CRC is read again up to
+ *				OW_READ_RETRIES times. If one of those reads is good it is
+ *				used, otherwise the probe keeps its last reading.
+ ****************************************************************************/
+static void test_crc_retry (void)
+{
+	ow_bus_model bus;
+
+	start(&bus, PIN_A);
+	ow_dev *dev = ow_model_dev(&bus, OW_FAMILY_DS18B20, 0x4242, 0x0150);
+
+	oneWire ow = oneWire(NULL, ow_port, PIN_A, NULL, 0, 1000, 12);
+	run_sample(&ow);
+	CHECK_EQ(ow.get_num_probes(), 1);
+	CHECK_EQ(water_temps[ow.get_slot(0)], want_temp(0x0150, 12, 0));
+
+	// good on the last retry
+	dev->raw = 0x0160;
+	bus.corrupt = OW_READ_RETRIES;
+	run_sample(&ow);
+	CHECK_EQ(water_temps[ow.get_slot(0)], want_temp(0x0160, 12, 0));
+	CHECK_EQ(ow.get_crc_errs(), OW_READ_RETRIES);
+
+	// bad every time, the last reading stays
+	dev->raw = 0x0170;
+	bus.corrupt = OW_READ_RETRIES + 1;
+	run_sample(&ow);
+	CHECK_EQ(water_temps[ow.get_slot(0)], want_temp(0x0160, 12, 0));
+	CHECK_EQ(ow.get_crc_errs(), 2 * OW_READ_RETRIES + 1);
+
+	// and the next sample is read
+	run_sample(&ow);
+	CHECK_EQ(water_temps[ow.get_slot(0)], want_temp(0x0170, 12, 0));
+	CHECK_EQ(ow.get_num_probes(), 1);
+	check_timing(&bus);
+
+	finish(&ow);
+}
+
+/*****************************************************************************
+ * Function:	test_config
+ * Description:	Each probe is set to its resolution on its own with Match
+ *				ROM: the one listed by ROM to its entry's, the first of the
+ *				rest to the entry for any probe, and the last to the bus
+ *				resolution. Each reading is cut to its resolution, gets
+ *				its entry's calibration and goes to its slot. Setting the
+ *				resolution for the whole bus writes every probe again.
+ ****************************************************************************/
+static void test_config (void)
+{
+	ow_bus_model bus;
+	ow_probe table[2] = {
+		{ow_port, PIN_A, {0}, 5, 50, 9},
+		{ow_port, PIN_A, {0}, 7, -25, 11}
+	};
+	uint8_t seen = 0;
+
+	start(&bus, PIN_A);
+	ow_model_dev(&bus, OW_FAMILY_DS18B20, 0x0A0A, 0x0197);
+	ow_dev *listed = ow_model_dev(&bus, OW_FAMILY_DS18B20, 0x0B0B, 0x01A5);
+	ow_model_dev(&bus, OW_FAMILY_DS18B20, 0x0C0C, (int16_t)0xFE6B);
+	memcpy(table[0].rom, listed->rom, OW_ROM_SIZE);
+
+	oneWire ow = oneWire(NULL, ow_port, PIN_A, table, 2, 1000, 10);
+	run_sample(&ow);
+	CHECK_EQ(ow.get_num_probes(), 3);
+
+	for (uint8_t ndx = 0; ndx < ow.get_num_probes(); ndx++)
+	{
+		ow_dev *dev = find_dev(&bus, &ow, ndx);
+		uint8_t slot = ow.get_slot(ndx);
+		uint8_t res = 10;
+		int16_t cal = 0;
+
+		CHECK(dev != NULL);
+		if (dev == NULL || slot >= WATER_SLOTS)
+		{
+			continue;
+		}
+
+		if (slot == 5)
+		{
+			CHECK(dev == listed);
+			res = 9;
+			cal = 50;
+		}
+		else if (slot == 7)
+		{
+			res = 11;
+			cal = -25;
+		}
+		seen |= (1 << (slot == 5 ? 0 : slot == 7 ? 1 : 2));
+
+		CHECK_EQ(dev->cfg, ((res - OW_MIN_RESOLUTION) << OW_CFG_RES_SHIFT) |
+						   OW_CFG_RESERVED);
+		CHECK_EQ(dev->cfg_writes, 1);
+		CHECK_EQ(water_temps[slot], want_temp(dev->raw, res, cal));
+	}
+	CHECK_EQ(seen, 0x07);
+	CHECK(bus.matches >= 2 * ow.get_num_probes());
+
+	ow.set_resolution(12);
+	run_sample(&ow);
+	for (uint8_t ndx = 0; ndx < bus.num_devs; ndx++)
+	{
+		CHECK_EQ(bus.devs[ndx].cfg, 0x7F);
+		CHECK_EQ(bus.devs[ndx].cfg_writes, 2);
+	}
+	CHECK_EQ(water_temps[5], want_temp(listed->raw, 12, 50));
+	check_timing(&bus);
+
+	finish(&ow);
+}
+
+/*****************************************************************************
+ * Function:	test_two_buses
+ * Description:	Two buses share Timer1, one transfer waiting behind the
+ *				other's, and each gets its probes read in full.
+ ****************************************************************************/
+static void test_two_buses (void)
+{
+	ow_bus_model bus_a, bus_b;
+	uint16_t slots = 0;
+	int both;
+
+	start(&bus_a, PIN_A);
+	ow_model_bus(&bus_b, PIN_B);
+	ow_model_dev(&bus_a, OW_FAMILY_DS18B20, 0x1111, 0x0120);
+	ow_model_dev(&bus_a, OW_FAMILY_DS18B20, 0x2222, 0x0130);
+	ow_model_dev(&bus_b, OW_FAMILY_DS18B20, 0x3333, 0x0140);
+	ow_model_dev(&bus_b, OW_FAMILY_DS18B20, 0x4444, (int16_t)0xFF00);
+
+	oneWire a = oneWire(NULL, ow_port, PIN_A, NULL, 0, 1000, 11);
+	oneWire b = oneWire(NULL, ow_port, PIN_B, NULL, 0, 1000, 11);
+	both = run_ms(2000, &a, &b);
+
+	CHECK(both > 0);
+	CHECK_EQ(a.get_num_probes(), 2);
+	CHECK_EQ(b.get_num_probes(), 2);
+	for (uint8_t ndx = 0; ndx < 2; ndx++)
+	{
+		slots |= (1U << a.get_slot(ndx)) | (1U << b.get_slot(ndx));
+	}
+	CHECK_EQ(slots, 0x000F);
+	check_temps(&bus_a, &a, 11);
+	check_temps(&bus_b, &b, 11);
+	check_timing(&bus_a);
+	check_timing(&bus_b);
+
+	finish(&a);
+	b.new_search();
+}
+
+int main (void)
+{
+	test_slots(0);
+	test_slots(OW_REC_US + 1);
+	test_search();
+	test_crc_retry();
+	test_config();
+	test_two_buses();
+
+	return TEST_DONE("test_onewire");
+}
@@ -0,0 +1,222 @@
+/*****************************************************************************
+ * File:		twi_model.cpp
+ * Description:	This file models the TWI hardware and one device on the bus
+ *				for the host tests. The device has 256 registers and a 
+ *				register pointer that the first byte written sets, which 
+ *				moves on with every byte read or written. Faults are set up
+ *				by the test: NACKed addresses, lost arbitration, a hung TWI
+ *				and a device holding SDA low.
+ ****************************************************************************/
+#include "twi_model.h"
+
+/* Bus and device model */
+uint8_t dev_addr = 0xEE;		// 8 bit address of the device
+uint8_t dev_mem[256];			// device registers
+bool dev_pairs;					// writes are register and value pairs
+static uint8_t dev_ptr;			// register pointer
+static bool owned;				// bus held by the TWI since a start
+static bool addr_next;			// next byte is an address
+static bool reading;			// device is sending
+static bool first_byte;			// next written byte is the register
+int nack_addr;					// address bytes to NACK
+int lose_arb;					// address bytes to lose arbitration on
+bool hang;						// TWI never finishes, until recovered
+std::string bus_log;			// what went out on the bus
+
+/* Pin model for recover: the device holds SDA low for stuck_clks clocks */
+int stuck_clks;
+int scl_clks;
+int pin_stops;
+
+/*****************************************************************************
+ * Function:	twcr_write
+ * Description:	This function plays the TWI hardware: each write to TWCR
+ *				with TWINT set carries out one bus operation at once, sets
+ *				the status and sets TWINT again.
+ ****************************************************************************/
+static void twcr_write (uint8_t v)
+{
+	uint8_t status;
+
+	if (!(v & (1 << TWEN)))
+	{
+		// TWI off, as recover does
+		owned = false;
+		hang = false;
+		return;
+	}
+
+	if (!(v & (1 << TWINT)))
+	{
+		return;
+	}
+
+	if (hang)
+	{
+		TWCR.val = v & ~(1 << TWINT);
+		return;
+	}
+
+	if (v & (1 << TWSTO))
+	{
+		bus_log += 'P';
+		owned = false;
+		if (!(v & (1 << TWSTA)))
+		{
+			TWCR.val = v & ~((1 << TWSTO) | (1 << TWINT));
+			return;
+		}
+	}
+
+	if (v & (1 << TWSTA))
+	{
+		bus_log += (owned ? 'R' : 'S');
+		status = (owned ? STAT_RESTART : STAT_START);
+		owned = true;
+		addr_next = true;
+	}
+	else if (addr_next)
+	{
+		addr_next = false;
+		reading = TWDR.val & READ_BIT;
+		first_byte = true;
+
+		if (lose_arb > 0)
+		{
+			lose_arb--;
+			bus_log += 'L';
+			owned = false;
+			status = STAT_BAD;
+		}
+		else if ((TWDR.val & ~READ_BIT) != dev_addr || nack_addr > 0)
+		{
+			nack_addr -= (nack_addr > 0);
+			bus_log += 'N';
+			status = (reading ? STAT_READ_NACK : STAT_WRITE_NACK);
+		}
+		else
+		{
+			bus_log += (reading ? 'A' : 'W');
+			status = (reading ? STAT_READ_ACK : STAT_WRITE_ACK);
+		}
+	}
+	else if (reading)
+	{
+		bus_log += 'r';
+		TWDR.val = dev_mem[dev_ptr++];
+		status = ((v & (1 << TWEA)) ? STAT_REC_ACK : STAT_REC_NACK);
+	}
+	else
+	{
+		bus_log += 'd';
+		if (first_byte)
+		{
+			dev_ptr = TWDR.val;
+		}
+		else
+		{
+			dev_mem[dev_ptr++] = TWDR.val;
+		}
+		first_byte = (dev_pairs ? !first_byte : false);
+		status = STAT_TRANS_ACK;
+	}
+
+	TWSR.val = status | (TWSR.val & ~STAT_MSK);
+	TWCR.val = (v | (1 << TWINT)) & ~(1 << TWSTO);
+}
+
+/*****************************************************************************
+ * Function:	ddrc_write
+ * Description:	This function counts the SCL clocks and stop conditions
+ *				recover makes by driving the pins. A pin is low while its
+ *				DDR bit is set.
+ ****************************************************************************/
+static void ddrc_write (uint8_t v)
+{
+	static uint8_t last = 0;
+	uint8_t scl = (1 << I2C_SCL);
+	uint8_t sda = (1 << I2C_SDA);
+
+	if ((last & scl) && !(v & scl))
+	{
+		// SCL released, one clock
+		scl_clks++;
+		stuck_clks -= (stuck_clks > 0);
+	}
+
+	if ((last & sda) && !(v & sda) && !(v & scl))
+	{
+		// SDA rises with SCL high
+		pin_stops++;
+	}
+
+	last = v;
+}
+
+/*****************************************************************************
+ * Function:	pinc_read
+ * Description:	This function gives the level of the bus pins: released
+ *				pins are pulled high, unless the device is holding SDA.
+ ****************************************************************************/
+static uint8_t pinc_read (void)
+{
+	uint8_t pins = 0;
+
+	if (!(DDRC.val & (1 << I2C_SCL)))
+	{
+		pins |= (1 << I2C_SCL);
+	}
+
+	if (!(DDRC.val & (1 << I2C_SDA)) && stuck_clks == 0)
+	{
+		pins |= (1 << I2C_SDA);
+	}
+
+	return pins;
+}
+
+/*****************************************************************************
+ * Function:	run_bus
+ * Description:	This function plays the TWI interrupt until the background
+ *				transactions are all done.
+ ****************************************************************************/
+void run_bus (void)
+{
+	for (int steps = 0; steps < 1000; steps++)
+	{
+		if (!(TWCR.val & (1 << TWIE)) || !(TWCR.val & (1 << TWINT)))
+		{
+			return;
+		}
+		TWI_vect();
+	}
+}
+
+/*****************************************************************************
+ * Function:	reset_bus
+ * Description:	This function clears the bus model between checks.
+ ****************************************************************************/
+void reset_bus (void)
+{
+	owned = false;
+	nack_addr = 0;
+	lose_arb = 0;
+	hang = false;
+	stuck_clks = 0;
+	scl_clks = 0;
+	pin_stops = 0;
+	bus_log.clear();
+	test_delay_us = 0;
+}
+
+/*****************************************************************************
+ * Function:	twi_model_init
+ * Description:	This function hooks the model up to the TWI registers and
+ *				the bus pins.
+ ****************************************************************************/
+void twi_model_init (void)
+{
+	TWCR.on_write = twcr_write;
+	DDRC.on_write = ddrc_write;
+	PINC.on_read = pinc_read;
+}
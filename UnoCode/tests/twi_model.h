@@ -0,0 +1,42 @@
+/*****************************************************************************
+ * File:		twi_model.h
+ * Description:	This file declares the model of the TWI hardware and the 
+ *				device on the bus used by the host tests.
+ ****************************************************************************/
+#ifndef __TWI_MODEL_H__
+#define __TWI_MODEL_H__
+
+#include <string>
+#include "i2c.h"
+
+extern "C" void TWI_vect (void);
+
+/* Device */
+extern uint8_t dev_addr;		// 8 bit address of the device
+extern uint8_t dev_mem[256];	// device registers
+extern bool dev_pairs;			// writes are register and value pairs
+
+/* Faults */
+extern int nack_addr;			// address bytes to NACK
+extern int lose_arb;			// address bytes to lose arbitration on
+extern bool hang;				// TWI never finishes, until recovered
+extern int stuck_clks;			// SCL clocks the device holds SDA low for
+
+/* What happened on the bus */
+extern std::string bus_log;		// S start, R repeated start, P stop, 
+								// W/A address ACKed for write/read, 
+								// N NACKed, L arbitration lost, 
+								// d byte written, r byte read
+extern int scl_clks;			// SCL clocks made by hand
+extern int pin_stops;			// stops made by hand
+
+// hooks the model up to the TWI registers and bus pins
+void twi_model_init (void);
+
+// plays the TWI interrupt until the background transactions are done
+void run_bus (void);
+
+// clears the faults and what happened on the bus
+void reset_bus (void);
+
+#endif /* __TWI_MODEL_H__ */
@@ -29,9 +29,76 @@ String windy;
 String uv_ndx;
 String ln_1_status;
 String ln_2_status;
+String duty_cycle;
+String pressure;
+String dew_point;
+String abs_humidity;
+String heat_index;
+String sea_level;
+String uv_var;
+String uv_mean;
+String uv_mean_bits;
+
+/*
+ * Frame layout, used in both directions between the Uno and this board. All
+ * multi-byte fields are little-endian. See serial.h in UnoCode for the
+ * payload fields.
+ *
+ * [version][type][seq][len][payload ...][crc lo][crc hi]
+ *
+ * The CRC-16 (CCITT polynomial 0x1021, initial value 0xFFFF) covers the
+ * version byte through the end of the payload. Each frame is COBS encoded,
+ * so it holds no zero bytes, and sent between two zero byte delimiters.
+ */
+#define PKT_VERSION         8
+#define PKT_TYPE_SENSOR     0x01
+#define PKT_TYPE_I2C_STATS  0x02
+#define PKT_TYPE_WATER      0x03
+#define PKT_TYPE_CMD_SEND   0x10
+#define PKT_TYPE_CMD_PERIOD 0x11
+#define PKT_TYPE_CMD_PROFILE 0x12
+#define PKT_TYPE_CMD_OW_RES 0x13
+#define PKT_TYPE_BAUD_REQ   0x20
+#define PKT_TYPE_BAUD_ACK   0x21
+#define PKT_TYPE_BAUD_CHECK 0x22
+#define PKT_CRC_INIT        0xFFFF
+#define PKT_DELIM           0x00
+#define PKT_HDR_SIZE        4
+#define PKT_CRC_SIZE        2
+#define PKT_MAX_PAYLOAD     35
+#define PKT_MAX_SIZE        (PKT_HDR_SIZE + PKT_MAX_PAYLOAD + PKT_CRC_SIZE)
+#define PKT_SENSOR_LEN      35
+#define PKT_BAUD_LEN        4
+#define PKT_STATS_HDR_LEN   1
+#define PKT_I2C_STATS_LEN   7
+#define PKT_WATER_ENTRY_LEN 2
+#define WATER_TEMP_NONE     -32768
+
+/*
+ * Baud rate negotiation. The link starts at BASE_BAUD. When the Uno asks for
+ * a faster rate this board agrees and switches, then waits for the Uno to
+ * check the link at the new rate. If the check never arrives, or no frames
+ * arrive for a long time at the faster rate, it falls back to BASE_BAUD.
+ */
+#define BASE_BAUD           9600
+#define LINK_CHECK_TIMEOUT  1000
+#define LINK_IDLE_TIMEOUT   75000
+
+// COBS encoding adds one byte per 254, so this holds any valid frame
+#define FRAME_BUF_SIZE      (PKT_MAX_SIZE + 2)
+
+// encoded frame being received, bounded so noise can never overrun it
+uint8_t rx_frame[FRAME_BUF_SIZE];
+int rx_len = 0;
+bool rx_drop = false;
+uint8_t tx_seq = 0;
+
+uint32_t link_baud = BASE_BAUD;
+bool link_checked = true;
+unsigned long link_time = 0;
 
 void setup() {
-  Serial.begin(9600);
+  Serial.begin(BASE_BAUD);
  
   WiFi.begin(ssid, password);
 
@@ -46,111 +113,312 @@ void setup() {
   Serial.println("WiFi connected");
   Serial.println("IP address: ");
   Serial.println(WiFi.localIP());
+
+  // ask the Uno for a packet now instead of waiting for the next one
+  send_frame(PKT_TYPE_CMD_SEND, NULL, 0);
 }
 
 /*
- * push_to_server takse in a url and establishes a connection using the url.
- */
-void push_to_server(String url)
-{  
-  Serial.println();
-  Serial.print("pushing url [");
-  Serial.print(url);
-  Serial.println("] to server...");
-  // Create HTTP Client
-  HTTPClient http;
-  // setup connection
-  http.begin(url);
-  // actually start connection
-  http.GET();
-  // close connection
-  http.end();
+ * crc16_update adds one byte to a CRC-16 CCITT (polynomial 0x1021), matching
+ * _crc_xmodem_update on the Uno
+ */
+uint16_t crc16_update(uint16_t crc, uint8_t data)
+{
+  crc ^= (uint16_t)data << 8;
+  for (int i = 0; i < 8; i++)
+  {
+    crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+  }
+  return crc;
 }
 
 /*
- * read_pkt parses through a string to check if it is formatted correctly and
- * stores the values of the packet content appropriately
- * 
- * Expected packet format:
- * <[=surf_temp,sub_temp,ext_temp,humidity,windy,uv_ndx,ln_1_status,ln_2_status=]>
+ * get_le reads a little-endian field of size bytes out of a buffer
+ */
+uint32_t get_le(const uint8_t *buf, int size)
+{
+  uint32_t value = 0;
+  for (int i = size - 1; i >= 0; i--)
+  {
+    value = (value << 8) | buf[i];
+  }
+  return value;
+}
+
+/*
+ * cobs_decode decodes a COBS encoded buffer without its delimiters, returning
+ * the number of decoded bytes or 0 if the encoding is bad or does not fit
  */
-bool read_pkt(String pkt) {
-  int ndx_start = 0;
-  int ndx_comma;
-  int loop_cnt = 0;
+int cobs_decode(const uint8_t *src, int len, uint8_t *dst, int size)
+{
+  int in = 0;
+  int out = 0;
 
-  pkt.trim();
-  
-  // check for correct packet header and trailer
-  if (pkt.startsWith("<[=") && pkt.endsWith("=]>"))
-  {
-    Serial.println("Packet formatted correctly!");
-    // remove header from string
-    pkt.remove(0,3);
-    // remove trailor from string
-    pkt.remove(pkt.indexOf("="));
-
-    loop_cnt = 0;
-    while ((loop_cnt < 8  && (ndx_comma = pkt.indexOf(",",ndx_start+1)) > ndx_start)
-           || ((ndx_comma == -1) && (loop_cnt == 7)))
+  while (in < len)
+  {
+    int code = src[in++];
+    if (code == 0 || in + code - 1 > len || out + code - 1 > size)
+    {
+      return 0;
+    }
+    for (int i = 1; i < code; i++)
     {
-      switch (loop_cnt)
+      dst[out++] = src[in++];
+    }
+    if (code < 0xFF && in < len)
+    {
+      if (out >= size)
       {
-        case 0:
-          surf_temp = pkt.substring(ndx_start, ndx_comma);
-          break;
-        case 1:
-          sub_temp = pkt.substring(ndx_start, ndx_comma);
-          break;
-        case 2:
-          ext_temp = pkt.substring(ndx_start, ndx_comma);
-          break;
-        case 3:
-          humidity = pkt.substring(ndx_start, ndx_comma);
-          break;
-        case 4:
-          windy = pkt.substring(ndx_start, ndx_comma);
-          break;
-        case 5:
-          uv_ndx = pkt.substring(ndx_start, ndx_comma);
-          break;
-        case 6:
-          ln_1_status = pkt.substring(ndx_start, ndx_comma);
-          break;
-        case 7:
-          ln_2_status = pkt.substring(ndx_start);
-          break;
-        default:
-          return false;
-          break;
+        return 0;
       }
-      // update new start of substring
-      ndx_start = ndx_comma + 1;
-      // increment the loop count
-      loop_cnt += 1;
+      dst[out++] = 0;
+    }
+  }
+  return out;
+}
+
+/*
+ * send_frame builds a frame with a header, payload and CRC, COBS encodes it
+ * and writes it to the Uno between zero byte delimiters
+ */
+void send_frame(uint8_t type, const uint8_t *payload, int len)
+{
+  uint8_t raw[PKT_MAX_SIZE];
+  int raw_len = 0;
+
+  raw[raw_len++] = PKT_VERSION;
+  raw[raw_len++] = type;
+  raw[raw_len++] = tx_seq++;
+  raw[raw_len++] = len;
+  for (int i = 0; i < len; i++)
+  {
+    raw[raw_len++] = payload[i];
+  }
+
+  uint16_t crc = PKT_CRC_INIT;
+  for (int i = 0; i < raw_len; i++)
+  {
+    crc = crc16_update(crc, raw[i]);
+  }
+  raw[raw_len++] = crc & 0xFF;
+  raw[raw_len++] = crc >> 8;
+
+  // encode each run of non-zero bytes behind a code byte of its length + 1
+  Serial.write((uint8_t)PKT_DELIM);
+  int start = 0;
+  while (true)
+  {
+    int end = start;
+    while (end < raw_len && raw[end] != 0 && end - start < 0xFE)
+    {
+      end++;
     }
-    // check that packet fully parsed
-    if (loop_cnt < 8)
+    int code = end - start + 1;
+    Serial.write((uint8_t)code);
+    Serial.write(&raw[start], end - start);
+    if (end >= raw_len)
     {
-      return false;
+      break;
     }
+    start = (code < 0xFF) ? end + 1 : end;
+  }
+  Serial.write((uint8_t)PKT_DELIM);
+}
+
+/*
+ * check_frame checks the header and CRC of a decoded frame. Frames that fail
+ * the CRC are rejected so corrupted data never reaches the database.
+ */
+bool check_frame(const uint8_t *pkt, int len)
+{
+  // check for correct packet header and that it all arrived
+  if (len < PKT_HDR_SIZE + PKT_CRC_SIZE || pkt[0] != PKT_VERSION
+      || pkt[3] != len - PKT_HDR_SIZE - PKT_CRC_SIZE)
+  {
+    return false;
+  }
+
+  uint16_t crc = PKT_CRC_INIT;
+  for (int i = 0; i < len - PKT_CRC_SIZE; i++)
+  {
+    crc = crc16_update(crc, pkt[i]);
+  }
+  if (crc != get_le(&pkt[len - PKT_CRC_SIZE], 2))
+  {
+    Serial.println("Packet failed CRC!");
+    return false;
+  }
+
+  return true;
+}
+
+/*
+ * water_str gives a water temperature as a string, or an empty one if the
+ * probe had no reading
+ */
+String water_str(int16_t temp)
+{
+  if (temp == WATER_TEMP_NONE)
+  {
+    return String();
+  }
+  return String(temp);
+}
+
+/*
+ * url_field gives "&name=value" to add to a URL, or nothing if there is no
+ * value, so the server keeps the last one it had
+ */
+String url_field(const char *name, const String &value)
+{
+  if (value.length() == 0)
+  {
+    return String();
   }
-  else
+  return String("&") + name + "=" + value;
+}
+
+/*
+ * read_pkt stores the values of a checked sensor packet appropriately
+ */
+bool read_pkt(const uint8_t *pkt) {
+  if (pkt[3] != PKT_SENSOR_LEN)
   {
     return false;
   }
 
+  Serial.println("Packet formatted correctly!");
+  const uint8_t *payload = &pkt[PKT_HDR_SIZE];
+  surf_temp = water_str((int16_t)get_le(&payload[0], 2));
+  sub_temp = water_str((int16_t)get_le(&payload[2], 2));
+  ext_temp = String((int16_t)get_le(&payload[4], 2));
+  humidity = String(get_le(&payload[6], 4));
+  windy = String(payload[10]);
+  uv_ndx = String((int16_t)get_le(&payload[11], 2));
+  ln_1_status = String((payload[13] & 0x01) ? 1 : 0);
+  ln_2_status = String((payload[13] & 0x02) ? 1 : 0);
+  duty_cycle = String(get_le(&payload[14], 2));
+  pressure = String(get_le(&payload[16], 4));
+  dew_point = String((int16_t)get_le(&payload[20], 2));
+  abs_humidity = String(get_le(&payload[22], 2));
+  heat_index = String((int16_t)get_le(&payload[24], 2));
+  sea_level = String(get_le(&payload[26], 4));
+  uv_var = String(get_le(&payload[30], 2));
+  uv_mean = String(get_le(&payload[32], 2));
+  uv_mean_bits = String(payload[34]);
+
   return true;
 }
 
+/*
+ * print_stats prints the number of tasks the Uno's scheduler had no room for,
+ * if any, then the Uno's i2c error counters, one line for each device that
+ * has had an error
+ */
+void print_stats(const uint8_t *pkt)
+{
+  const uint8_t *payload = &pkt[PKT_HDR_SIZE];
+
+  if (pkt[3] < PKT_STATS_HDR_LEN)
+  {
+    return;
+  }
+  if (payload[0] != 0)
+  {
+    Serial.print("scheduler: tasks that did not fit: ");
+    Serial.println(payload[0]);
+  }
+
+  for (int i = PKT_STATS_HDR_LEN; i + PKT_I2C_STATS_LEN <= pkt[3];
+       i += PKT_I2C_STATS_LEN)
+  {
+    Serial.print("i2c 0x");
+    Serial.print(payload[i], HEX);
+    Serial.print(" nacks: ");
+    Serial.print(get_le(&payload[i + 1], 2));
+    Serial.print(" timeouts: ");
+    Serial.print(get_le(&payload[i + 3], 2));
+    Serial.print(" recoveries: ");
+    Serial.println(get_le(&payload[i + 5], 2));
+  }
+}
+
+/*
+ * print_water prints the water temperature in each slot of the Uno's probe
+ * table that has a reading
+ */
+void print_water(const uint8_t *pkt)
+{
+  const uint8_t *payload = &pkt[PKT_HDR_SIZE];
+
+  for (int i = 0; i + PKT_WATER_ENTRY_LEN <= pkt[3]; i += PKT_WATER_ENTRY_LEN)
+  {
+    int16_t temp = (int16_t)get_le(&payload[i], PKT_WATER_ENTRY_LEN);
+
+    if (temp == WATER_TEMP_NONE)
+    {
+      continue;
+    }
+    Serial.print("water ");
+    Serial.print(i / PKT_WATER_ENTRY_LEN);
+    Serial.print(": ");
+    Serial.println(temp);
+  }
+}
+
+/*
+ * set_link_baud waits for everything queued to go out at the old rate and
+ * then moves the link to a new baud rate
+ */
+void set_link_baud(uint32_t baud)
+{
+  Serial.flush();
+  Serial.begin(baud);
+  link_baud = baud;
+  link_time = millis();
+}
+
+/*
+ * handle_baud answers the Uno's baud rate requests and checks. A request is
+ * acknowledged at the old rate before switching, a check is acknowledged at
+ * the new rate to confirm the link.
+ */
+void handle_baud(const uint8_t *pkt)
+{
+  if (pkt[3] != PKT_BAUD_LEN)
+  {
+    return;
+  }
+
+  uint32_t baud = get_le(&pkt[PKT_HDR_SIZE], PKT_BAUD_LEN);
+  uint8_t payload[PKT_BAUD_LEN];
+  for (int i = 0; i < PKT_BAUD_LEN; i++)
+  {
+    payload[i] = pkt[PKT_HDR_SIZE + i];
+  }
+
+  if (pkt[1] == PKT_TYPE_BAUD_REQ)
+  {
+    send_frame(PKT_TYPE_BAUD_ACK, payload, PKT_BAUD_LEN);
+    set_link_baud(baud);
+    link_checked = false;
+  }
+  else if (pkt[1] == PKT_TYPE_BAUD_CHECK && baud == link_baud)
+  {
+    send_frame(PKT_TYPE_BAUD_ACK, payload, PKT_BAUD_LEN);
+    link_checked = true;
+  }
+}
+
 /*
  * build_and_send constructs the URLS for updating the databases on the webserver
  */
 void build_and_send()
 {
   // update the pond
-  String pond_url = dbUpdateURL + "?pool=1&surf=" + surf_temp +
-    "&sub=" + sub_temp + "&ext=" + ext_temp + "&hum=" + humidity +
+  // a water probe that has not been read is left out
+  String pond_url = dbUpdateURL + "?pool=1" + url_field("surf", surf_temp) +
+    url_field("sub", sub_temp) + "&ext=" + ext_temp + "&hum=" + humidity +
     "&hum=" + humidity + "&wind=" + windy + "&uv=" + uv_ndx;
   push_to_server(pond_url);
 
@@ -166,13 +434,59 @@ void build_and_send()
 void loop() {
   // put your main code here, to run repeatedly:
 
-  if (Serial.available() > 0)
+  // fall back to the base rate if the Uno never checked the new rate, or
+  // has gone quiet (it may have reset back to the base rate)
+  if (link_baud != BASE_BAUD
+      && ((!link_checked && millis() - link_time > LINK_CHECK_TIMEOUT)
+          || millis() - link_time > LINK_IDLE_TIMEOUT))
+  {
+    set_link_baud(BASE_BAUD);
+    link_checked = true;
+  }
+
+  while (Serial.available() > 0)
   {
-    // allow data to fully be put onto line
-    delay(1000);
+    uint8_t data = Serial.read();
+
+    // collect the encoded frame up to its delimiter
+    if (data != PKT_DELIM)
+    {
+      if (rx_len < FRAME_BUF_SIZE)
+      {
+        rx_frame[rx_len++] = data;
+      }
+      else
+      {
+        rx_drop = true;
+      }
+      continue;
+    }
+
+    uint8_t pkt[PKT_MAX_SIZE];
+    int len = rx_drop ? 0 : cobs_decode(rx_frame, rx_len, pkt, sizeof(pkt));
+    rx_len = 0;
+    rx_drop = false;
 
+    if (!check_frame(pkt, len))
+    {
+      continue;
+    }
+    link_time = millis();
+
+    if (pkt[1] == PKT_TYPE_BAUD_REQ || pkt[1] == PKT_TYPE_BAUD_CHECK)
+    {
+      handle_baud(pkt);
+    }
     // read packet and check if formatted correctly
-    if (read_pkt(Serial.readString()))
+    else if (pkt[1] == PKT_TYPE_I2C_STATS)
+    {
+      print_stats(pkt);
+    }
+    else if (pkt[1] == PKT_TYPE_WATER)
+    {
+      print_water(pkt);
+    }
+    else if (pkt[1] == PKT_TYPE_SENSOR && read_pkt(pkt))
     {
       Serial.println("Packet Contents:");
       Serial.print("surf_temp: ");
@@ -191,6 +505,25 @@ void loop() {
       Serial.println(ln_1_status);
       Serial.print("ln_2_status: ");
       Serial.println(ln_2_status);
+      Serial.print("duty_cycle: ");
+      Serial.println(duty_cycle);
+      Serial.print("pressure: ");
+      Serial.println(pressure);
+      Serial.print("dew_point: ");
+      Serial.println(dew_point);
+      Serial.print("abs_humidity: ");
+      Serial.println(abs_humidity);
+      Serial.print("heat_index: ");
+      Serial.println(heat_index);
+      Serial.print("sea_level: ");
+      Serial.println(sea_level);
+      Serial.print("uv_var: ");
+      Serial.println(uv_var);
+      Serial.print("uv_mean: ");
+      Serial.print(uv_mean);
+      Serial.print(" (");
+      Serial.print(uv_mean_bits);
+      Serial.println(" bits)");
       // build URLs and send to server
       build_and_send(); 
     }